@@ -47,7 +47,7 @@ void directory_iterator_test()
 			}
 			else
 			{
-				printf("  %s   %ld bytes", entity.name.c_str(), entity.file_size_bytes);
+				printf("  %s   %llu bytes", entity.name.c_str(), (unsigned long long)entity.file_size_bytes);
 			}
 
 			printf("   last write time: %04d-%02d-%02d %02d:%02d:%02d\n",
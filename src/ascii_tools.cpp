@@ -0,0 +1,240 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "ascii_tools.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define ASCII_TOOLS_SSE2
+#	include <immintrin.h>
+#elif defined(__ARM_NEON) && !defined(_MSC_VER)
+#	define ASCII_TOOLS_NEON
+#	include <arm_neon.h>
+#endif
+
+// AVX2 is picked at runtime unless the whole build targets it
+#if defined(ASCII_TOOLS_SSE2) && !defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+#	define ASCII_TOOLS_AVX2_DISPATCH
+#endif
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+//
+
+namespace ascii_tools
+{
+
+static inline uint32_t lowest_set_bit_index(uint32_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index = 0;
+	_BitScanForward(&index, value);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(value);
+#endif
+}
+
+
+static inline const char* find_byte_scalar(const char* p, const char* end, char c)
+{
+	while (p < end && *p != c)
+		++p;
+
+	return p;
+}
+
+
+#if defined(ASCII_TOOLS_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+#endif
+#if defined(__AVX2__) || defined(ASCII_TOOLS_AVX2_DISPATCH)
+static const char* find_byte_avx2(const char* p, const char* end, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+
+	while (end - p >= 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return p + lowest_set_bit_index(mask);
+
+		p += 32;
+	}
+
+	return find_byte_scalar(p, end, c);
+}
+#endif
+
+
+#if defined(ASCII_TOOLS_SSE2) && !defined(__AVX2__)
+static const char* find_byte_sse2(const char* p, const char* end, char c)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+
+	while (end - p >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return p + lowest_set_bit_index(mask);
+
+		p += 16;
+	}
+
+	return find_byte_scalar(p, end, c);
+}
+#endif
+
+
+#if defined(ASCII_TOOLS_NEON)
+static const char* find_byte_neon(const char* p, const char* end, char c)
+{
+	const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+
+	while (end - p >= 16)
+	{
+		uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)p), needle);
+
+		// narrow 16 bytes of 0x00/0xff to 16 nibbles
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+		if (mask)
+			return p + (__builtin_ctzll(mask) >> 2);
+
+		p += 16;
+	}
+
+	return find_byte_scalar(p, end, c);
+}
+#endif
+
+
+typedef const char* (*find_byte_fn)(const char* p, const char* end, char c);
+
+static find_byte_fn select_find_byte()
+{
+#if defined(__AVX2__)
+	return find_byte_avx2;
+#elif defined(ASCII_TOOLS_AVX2_DISPATCH)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? find_byte_avx2 : find_byte_sse2;
+#elif defined(ASCII_TOOLS_SSE2)
+	return find_byte_sse2;
+#elif defined(ASCII_TOOLS_NEON)
+	return find_byte_neon;
+#else
+	return find_byte_scalar;
+#endif
+}
+
+
+// returns end if there is no such byte
+static inline const char* find_byte(const char* p, const char* end, char c)
+{
+	static const find_byte_fn fn = select_find_byte();
+
+	return fn(p, end, c);
+}
+
+
+size_t lf_to_crlf(const char* src, size_t size, char* dst, bool& prev_cr)
+{
+	const char* p = src;
+	const char* end = src + size;
+	char* out = dst;
+
+	while (p < end)
+	{
+		const char* lf = find_byte(p, end, '\n');
+
+		size_t run = lf - p;
+		if (run)
+		{
+			memcpy(out, p, run);
+			out += run;
+
+			prev_cr = p[run - 1] == '\r';
+		}
+
+		if (lf == end)
+			break;
+
+		if (!prev_cr)
+			*out++ = '\r';
+
+		*out++ = '\n';
+
+		prev_cr = false;
+		p = lf + 1;
+	}
+
+	return out - dst;
+}
+
+
+size_t crlf_to_lf(const char* src, size_t size, char* dst, bool& pending_cr)
+{
+	const char* p = src;
+	const char* end = src + size;
+	char* out = dst;
+
+	if (pending_cr && size)
+	{
+		// CR of the previous chunk was not a part of CRLF
+		if (*p != '\n')
+			*out++ = '\r';
+
+		pending_cr = false;
+	}
+
+	while (p < end)
+	{
+		const char* cr = find_byte(p, end, '\r');
+
+		// output never overtakes input, but may overlap it
+		size_t run = cr - p;
+		if (run)
+		{
+			memmove(out, p, run);
+			out += run;
+		}
+
+		if (cr == end)
+			break;
+
+		if (cr + 1 == end)
+		{
+			// decided by the first byte of the next chunk
+			pending_cr = true;
+			break;
+		}
+
+		if (cr[1] == '\n')
+		{
+			*out++ = '\n';
+			p = cr + 2;
+		}
+		else
+		{
+			*out++ = '\r';
+			p = cr + 1;
+		}
+	}
+
+	return out - dst;
+}
+
+}
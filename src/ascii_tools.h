@@ -0,0 +1,34 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <stddef.h>
+
+//
+
+namespace ascii_tools
+{
+
+// Line endings conversion of TYPE A transfers.
+// Both functions look for line ends with SIMD compare (AVX2 / SSE2 / NEON,
+// scalar loop elsewhere) and copy the runs between them with memcpy,
+// so text without line ends is copied at memcpy speed.
+// Conversion may be split into chunks of any size, the state between
+// chunks is kept in the bool passed by reference (false at start).
+
+// LF -> CRLF, CRLF pairs of the source are left as is.
+// dst must have room for 2 * size bytes.
+size_t lf_to_crlf(const char* src, size_t size, char* dst, bool& prev_cr);
+
+// CRLF -> LF, lone CR is left as is.
+// dst may be src - 1 (in place conversion, one byte of room is needed
+// for CR kept from the previous chunk), returns the size of output.
+size_t crlf_to_lf(const char* src, size_t size, char* dst, bool& pending_cr);
+
+}
@@ -0,0 +1,368 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "deflate_tools.h"
+
+#include <string.h>
+#include <ctype.h>
+
+#ifdef FTPSERVER_WITH_ZLIB
+#	include <condition_variable>
+#	include <mutex>
+#endif
+
+//
+
+namespace deflate_tools
+{
+
+bool is_compressed_file_type(const std::string& file_name)
+{
+	static const char* compressed_extensions[] =
+	{
+		"gz", "tgz", "bz2", "tbz2", "xz", "txz", "lz", "lz4", "lzma", "zst", "z",
+		"zip", "7z", "rar", "cab", "jar", "apk", "deb", "rpm",
+		"jpg", "jpeg", "png", "gif", "webp", "heic",
+		"mp3", "ogg", "opus", "aac", "flac", "m4a",
+		"mp4", "mkv", "avi", "mov", "webm"
+	};
+
+	auto dot_pos = file_name.find_last_of('.');
+	if (dot_pos == std::string::npos || dot_pos + 1 == file_name.size())
+		return false;
+
+	std::string extension = file_name.substr(dot_pos + 1);
+	for (auto& c : extension)
+		c = (char)::tolower((unsigned char)c);
+
+	for (auto compressed_extension : compressed_extensions)
+	{
+		if (extension == compressed_extension)
+			return true;
+	}
+
+	return false;
+}
+
+#ifdef FTPSERVER_WITH_ZLIB
+
+// deflate window size
+#define DICTIONARY_SIZE		(32 * 1024)
+
+static bool deflate_block(int level,
+	const char* dictionary, size_t dictionary_size,
+	const char* data, size_t data_size,
+	bool final,
+	std::vector<char>& output)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	// raw deflate, zlib header and trailer are written by block_deflater_c
+	if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	if (dictionary_size)
+	{
+		deflateSetDictionary(&stream, (const Bytef*)dictionary, (uInt)dictionary_size);
+	}
+
+	// sync flush adds empty stored block to the bound
+	output.resize(deflateBound(&stream, (uLong)data_size) + 16);
+
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = (uInt)data_size;
+	stream.next_out = (Bytef*)output.data();
+	stream.avail_out = (uInt)output.size();
+
+	int rc = deflate(&stream, final ? Z_FINISH : Z_SYNC_FLUSH);
+
+	output.resize(output.size() - stream.avail_out);
+
+	deflateEnd(&stream);
+
+	return final ?
+		rc == Z_STREAM_END :
+		rc == Z_OK && stream.avail_in == 0;
+}
+
+
+// batches started and not collected yet, input beyond it waits in the queue
+#define MAX_BATCHES_IN_FLIGHT	2
+
+// batch is not smaller than this many blocks, so its hand-over (jobs
+// queued, output collected by the server loop) costs little per block
+#define MIN_BLOCKS_PER_BATCH	4
+
+struct block_deflater_c::batch_s
+{
+	struct block_result_s
+	{
+		std::vector<char> data;
+		uint32_t adler;
+		size_t input_size;
+		bool ok;
+	};
+
+	int level;
+	size_t block_size;
+	bool final;
+
+	// dictionary (tail of preceding input) followed by the blocks
+	std::vector<char> input;
+	size_t dictionary_size;
+
+	std::vector<block_result_s> results;
+
+	// workers share the batch, aborted transfer does not wait for them
+	std::mutex mutex;
+	std::condition_variable done_cv;
+	size_t blocks_left;
+};
+
+
+block_deflater_c::block_deflater_c(const std::shared_ptr<ftp_server::worker_pool_c>& workers, int level,
+	size_t block_size)
+	: m_workers(workers)
+	, m_level(level)
+	, m_block_size(block_size < DICTIONARY_SIZE ? DICTIONARY_SIZE : block_size)
+	, m_blocks_per_batch(workers->threads_count())
+	, m_header_written(false)
+	, m_finishing(false)
+	, m_adler(adler32(0L, Z_NULL, 0))
+{
+	if (m_blocks_per_batch < MIN_BLOCKS_PER_BATCH)
+		m_blocks_per_batch = MIN_BLOCKS_PER_BATCH;
+}
+
+
+bool block_deflater_c::write(const char* data, size_t data_size)
+{
+	if (m_finishing)
+		return false;
+
+	m_pending.insert(m_pending.end(), data, data + data_size);
+
+	// wait for a batch which keeps all threads busy
+	if (m_pending.size() < m_block_size * m_blocks_per_batch)
+		return true;
+
+	return start_batch(m_pending.size() / m_block_size, false);
+}
+
+
+bool block_deflater_c::finish()
+{
+	if (m_finishing)
+		return false;
+
+	m_finishing = true;
+
+	size_t blocks_count = (m_pending.size() + m_block_size - 1) / m_block_size;
+
+	// final block may be empty, it still marks the end of deflate stream
+	return start_batch(blocks_count ? blocks_count : 1, true);
+}
+
+
+bool block_deflater_c::can_write() const
+{
+	return m_batches.size() < MAX_BATCHES_IN_FLIGHT;
+}
+
+
+bool block_deflater_c::output_ready() const
+{
+	if (m_batches.empty())
+		return false;
+
+	auto& batch = *m_batches.front();
+
+	std::lock_guard<std::mutex> lock(batch.mutex);
+
+	return batch.blocks_left == 0;
+}
+
+
+bool block_deflater_c::collect(std::vector<char>& output, bool wait)
+{
+	while (!m_batches.empty())
+	{
+		auto batch = m_batches.front();
+
+		{
+			std::unique_lock<std::mutex> lock(batch->mutex);
+
+			if (batch->blocks_left != 0)
+			{
+				if (!wait)
+					return true;
+
+				batch->done_cv.wait(lock, [&]() { return batch->blocks_left == 0; });
+			}
+		}
+
+		m_batches.pop_front();
+
+		if (!m_header_written)
+		{
+			// deflate, 32K window, default compression
+			output.push_back((char)0x78);
+			output.push_back((char)0x9c);
+
+			m_header_written = true;
+		}
+
+		for (auto& result : batch->results)
+		{
+			if (!result.ok)
+				return false;
+
+			output.insert(output.end(), result.data.begin(), result.data.end());
+
+			m_adler = adler32_combine(m_adler, result.adler, (z_off_t)result.input_size);
+		}
+
+		if (batch->final)
+		{
+			uint8_t trailer[4] =
+			{
+				(uint8_t)(m_adler >> 24),
+				(uint8_t)(m_adler >> 16),
+				(uint8_t)(m_adler >> 8),
+				(uint8_t)m_adler
+			};
+
+			output.insert(output.end(), (const char*)trailer, (const char*)trailer + sizeof(trailer));
+		}
+	}
+
+	return true;
+}
+
+
+bool block_deflater_c::start_batch(size_t blocks_count, bool final)
+{
+	size_t consumed = blocks_count * m_block_size < m_pending.size() ?
+		blocks_count * m_block_size : m_pending.size();
+
+	auto batch = std::make_shared<batch_s>();
+	{
+		batch->level = m_level;
+		batch->block_size = m_block_size;
+		batch->final = final;
+
+		batch->input.reserve(m_dictionary.size() + consumed);
+		batch->input.assign(m_dictionary.begin(), m_dictionary.end());
+		batch->input.insert(batch->input.end(), m_pending.begin(), m_pending.begin() + consumed);
+		batch->dictionary_size = m_dictionary.size();
+
+		batch->results.resize(blocks_count);
+		batch->blocks_left = blocks_count;
+	}
+
+	// keep the window for the next batch
+	size_t window_size = batch->input.size() < DICTIONARY_SIZE ?
+		batch->input.size() : DICTIONARY_SIZE;
+	m_dictionary.assign(batch->input.end() - window_size, batch->input.end());
+
+	m_pending.erase(m_pending.begin(), m_pending.begin() + consumed);
+
+	for (size_t i = 0; i < blocks_count; ++i)
+	{
+		// jobs keep the batch, aborted transfer does not wait for them
+		if (!m_workers->post([batch, i]() { compress_block(batch, i); }))
+			return false;
+	}
+
+	m_batches.push_back(batch);
+
+	return true;
+}
+
+
+void block_deflater_c::compress_block(const std::shared_ptr<batch_s>& batch, size_t block_index)
+{
+	size_t offset = batch->dictionary_size + block_index * batch->block_size;
+	size_t size = batch->input.size() - offset < batch->block_size ?
+		batch->input.size() - offset : batch->block_size;
+
+	// blocks are not smaller than the window, the first one is primed with the dictionary
+	size_t dictionary_size = offset < DICTIONARY_SIZE ? offset : DICTIONARY_SIZE;
+
+	batch_s::block_result_s result;
+
+	result.input_size = size;
+	result.adler = adler32(adler32(0L, Z_NULL, 0),
+		(const Bytef*)batch->input.data() + offset, (uInt)size);
+	result.ok = deflate_block(batch->level,
+		batch->input.data() + offset - dictionary_size, dictionary_size,
+		batch->input.data() + offset, size,
+		batch->final && block_index == batch->results.size() - 1,
+		result.data);
+
+	std::lock_guard<std::mutex> lock(batch->mutex);
+
+	batch->results[block_index] = std::move(result);
+
+	if (--batch->blocks_left == 0)
+		batch->done_cv.notify_all();
+}
+
+
+inflater_c::inflater_c()
+	: m_initialized(false)
+	, m_finished(false)
+	, m_input(1024 * 64)
+{
+	memset(&m_stream, 0, sizeof(m_stream));
+
+	m_initialized = inflateInit(&m_stream) == Z_OK;
+}
+
+
+inflater_c::~inflater_c()
+{
+	if (m_initialized)
+	{
+		inflateEnd(&m_stream);
+	}
+}
+
+
+void inflater_c::input_ready(size_t data_size)
+{
+	m_stream.next_in = (Bytef*)m_input.data();
+	m_stream.avail_in = (uInt)data_size;
+}
+
+
+int inflater_c::inflate(char* output, size_t output_size)
+{
+	if (m_finished)
+		return 0;
+
+	m_stream.next_out = (Bytef*)output;
+	m_stream.avail_out = (uInt)output_size;
+
+	int rc = ::inflate(&m_stream, Z_NO_FLUSH);
+
+	if (rc == Z_STREAM_END)
+	{
+		m_finished = true;
+	}
+	else if (rc != Z_OK && rc != Z_BUF_ERROR)
+	{
+		return -1;
+	}
+
+	return (int)(output_size - m_stream.avail_out);
+}
+
+#endif
+
+}
@@ -0,0 +1,143 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// MODE Z needs zlib, define FTPSERVER_WITH_ZLIB and link with zlib to enable it
+#ifdef FTPSERVER_WITH_ZLIB
+#	include <zlib.h>
+
+#	include "worker_pool.h"
+#endif
+
+//
+
+namespace deflate_tools
+{
+
+// archives, images, video etc. - deflate would only waste cpu on them
+bool is_compressed_file_type(const std::string& file_name);
+
+#ifdef FTPSERVER_WITH_ZLIB
+
+// Produces zlib stream (RFC 1950) from input of arbitrary size.
+// Input is cut into independent raw deflate blocks (each one primed with
+// the last 32 KB of preceding input, ended with sync flush), a batch of
+// blocks is queued to the worker pool at once and their output is
+// simply concatenated. Adler-32 of blocks is combined for the trailer.
+// Caller never compresses itself: write() and finish() only start batches,
+// collect() takes the output of batches which are done, in order.
+class block_deflater_c
+{
+private:
+	block_deflater_c(const block_deflater_c&) = delete;
+	block_deflater_c& operator=(const block_deflater_c&) = delete;
+
+public:
+	// pool is shared by all deflaters, a batch has a block per its thread
+	block_deflater_c(const std::shared_ptr<ftp_server::worker_pool_c>& workers, int level,
+		size_t block_size = 1024 * 256);
+
+	// input is queued, full batch goes to workers
+	bool write(const char* data, size_t data_size);
+
+	// the rest of input goes to workers, stream trailer follows it
+	bool finish();
+
+	// appends compressed data of completed batches to output,
+	// wait - waits for all started ones; false - compression failed
+	bool collect(std::vector<char>& output, bool wait);
+
+	// false - enough batches are compressed already, collect them first
+	bool can_write() const;
+
+	// the oldest started batch is done, collect() returns something
+	bool output_ready() const;
+
+	bool finishing() const { return m_finishing; }
+
+	// finish() was called and everything is collected
+	bool finished() const { return m_finishing && m_batches.empty(); }
+
+private:
+	struct batch_s;
+
+	bool start_batch(size_t blocks_count, bool final);
+
+	static void compress_block(const std::shared_ptr<batch_s>& batch, size_t block_index);
+
+private:
+	std::shared_ptr<ftp_server::worker_pool_c> m_workers;
+
+	int m_level;
+
+	size_t m_block_size;
+
+	// a block per worker thread, MIN_BLOCKS_PER_BATCH at least
+	uint32_t m_blocks_per_batch;
+
+	bool m_header_written;
+	bool m_finishing;
+
+	uint32_t m_adler;
+
+	// input which is not handed over yet
+	std::vector<char> m_pending;
+
+	// tail of input handed over already
+	std::vector<char> m_dictionary;
+
+	// started, not collected yet, the oldest first
+	std::deque<std::shared_ptr<batch_s>> m_batches;
+};
+
+
+// Streaming inflate of zlib stream
+class inflater_c
+{
+private:
+	inflater_c(const inflater_c&) = delete;
+	inflater_c& operator=(const inflater_c&) = delete;
+
+public:
+	inflater_c();
+
+	~inflater_c();
+
+	bool initialized() const { return m_initialized; }
+
+	// buffer for compressed input, fill it and call input_ready()
+	char* input_buffer() { return m_input.data(); }
+	size_t input_buffer_size() const { return m_input.size(); }
+	void input_ready(size_t data_size);
+
+	bool has_input() const { return m_stream.avail_in > 0; }
+
+	bool finished() const { return m_finished; }
+
+	// returns produced bytes count or -1 on corrupted stream
+	int inflate(char* output, size_t output_size);
+
+private:
+	z_stream m_stream;
+
+	bool m_initialized;
+	bool m_finished;
+
+	std::vector<char> m_input;
+};
+
+#endif
+
+}
@@ -12,7 +12,11 @@
 #	include <limits.h>			// PATH_MAX
 #	include <libgen.h>			// dirname
 #	include <unistd.h>			// unlink
+#	include <fcntl.h>
+#	include <errno.h>
 #	include <sys/stat.h>
+#	include <sys/syscall.h>		// getdents64
+#	include <sys/sysmacros.h>	// makedev
 #elif defined(WIN32)
 #	include <Windows.h>
 #	include <direct.h>
@@ -23,6 +27,7 @@
 #	include <sys/syslimits.h>	// PATH_MAX
 #endif
 
+#include <atomic>
 #include <vector>
 #include <time.h>
 #include <stdio.h>
@@ -34,6 +39,9 @@
 #	define PATH_SLASH_TYPE	"/"
 #endif
 
+// one getdents64 call fills this much, a few thousand entries
+#define DIRECTORY_READ_BATCH_SIZE	(1024 * 128)
+
 //
 using namespace filesystem_tools::helpers::linked_list;
 
@@ -168,7 +176,7 @@ bool check_directory_exists(const std::string& path)
 		fixed_path.resize(fixed_path.size() - 1);
 	}
 #else
-	std::string& fixed_path = path;
+	const std::string& fixed_path = path;
 #endif
 
 	struct stat st;
@@ -214,6 +222,222 @@ bool strings_iequals(const std::string& s1, const std::string& s2)
 }
 
 
+bool has_glob_chars(const std::string& s)
+{
+	return s.find_first_of("*?[") != std::string::npos;
+}
+
+
+// "[...]" at pattern into set of bytes, pattern is moved past the class;
+// false for unterminated class (it is a plain '[' then)
+static bool parse_glob_class(const char*& pattern, std::bitset<256>& set)
+{
+	const char* p = pattern + 1;
+
+	bool negated = *p == '!' || *p == '^';
+	if (negated)
+		++p;
+
+	set.reset();
+
+	// ']' right after '[' is a member, not the end
+	const char* first = p;
+
+	while (*p && (*p != ']' || p == first))
+	{
+		unsigned char low = (unsigned char)*p;
+		unsigned char high = low;
+
+		if (p[1] == '-' && p[2] && p[2] != ']')
+		{
+			high = (unsigned char)p[2];
+			p += 2;
+		}
+
+		for (unsigned c = low; c <= high; ++c)
+			set.set(c);
+
+		++p;
+	}
+
+	if (*p != ']')
+		return false;
+
+	if (negated)
+		set.flip();
+
+	pattern = p + 1;
+
+	return true;
+}
+
+
+glob_matcher_c::glob_matcher_c()
+	: m_has_star(false)
+	, m_leading_dot(false)
+{
+}
+
+
+void glob_matcher_c::compile(const std::string& pattern)
+{
+	m_segments.clear();
+	m_has_star = false;
+	m_leading_dot = !pattern.empty() && pattern[0] == '.';
+
+	if (pattern.empty())
+		return;
+
+	segment_s segment;
+	segment.is_literal = true;
+
+	const char* p = pattern.c_str();
+
+	while (true)
+	{
+		if (*p == '*' || *p == 0)
+		{
+			m_segments.push_back(std::move(segment));
+
+			segment = segment_s();
+			segment.is_literal = true;
+
+			if (*p == 0)
+				break;
+
+			m_has_star = true;
+
+			// "**" is the same as "*"
+			while (*p == '*')
+				++p;
+
+			continue;
+		}
+
+		std::bitset<256> set;
+
+		if (*p == '?')
+		{
+			set.set();
+			++p;
+		}
+		else if (*p == '[' && parse_glob_class(p, set))
+		{
+		}
+		else
+		{
+			set.set((unsigned char)*p);
+
+			if (segment.is_literal)
+			{
+				segment.literal += *p++;
+				continue;
+			}
+
+			++p;
+		}
+
+		if (segment.is_literal)
+		{
+			// positions of the plain characters collected so far
+			for (char c : segment.literal)
+			{
+				std::bitset<256> literal_set;
+				literal_set.set((unsigned char)c);
+				segment.positions.push_back(literal_set);
+			}
+
+			segment.literal.clear();
+			segment.is_literal = false;
+		}
+
+		segment.positions.push_back(set);
+	}
+}
+
+
+bool glob_matcher_c::match_segment_at(const segment_s& segment, const char* s)
+{
+	if (segment.is_literal)
+		return memcmp(s, segment.literal.data(), segment.literal.size()) == 0;
+
+	for (size_t i = 0; i < segment.positions.size(); ++i)
+	{
+		if (!segment.positions[i].test((unsigned char)s[i]))
+			return false;
+	}
+
+	return true;
+}
+
+
+bool glob_matcher_c::match(const char* name, size_t name_len) const
+{
+	if (empty())
+		return true;
+
+	// hidden names are listed only on request
+	if (name_len > 0 && name[0] == '.' && !m_leading_dot)
+		return false;
+
+	if (!m_has_star)
+	{
+		auto& segment = m_segments.front();
+
+		return segment.length() == name_len && match_segment_at(segment, name);
+	}
+
+	// "a*b*c": "a" is anchored at the start, "c" at the end, "b" is found in between
+	auto& first = m_segments.front();
+	auto& last = m_segments.back();
+
+	if (first.length() + last.length() > name_len)
+		return false;
+
+	if (!match_segment_at(first, name) || !match_segment_at(last, name + name_len - last.length()))
+		return false;
+
+	size_t pos = first.length();
+	size_t end = name_len - last.length();
+
+	for (size_t i = 1; i + 1 < m_segments.size(); ++i)
+	{
+		auto& segment = m_segments[i];
+		size_t segment_len = segment.length();
+
+		bool found = false;
+
+		while (pos + segment_len <= end)
+		{
+			if (segment.is_literal)
+			{
+				// jump to the next place the first character fits
+				auto next = (const char*)memchr(name + pos, segment.literal[0], end - segment_len - pos + 1);
+				if (!next)
+					break;
+
+				pos = next - name;
+			}
+
+			if (match_segment_at(segment, name + pos))
+			{
+				found = true;
+				break;
+			}
+
+			++pos;
+		}
+
+		if (!found)
+			return false;
+
+		pos += segment_len;
+	}
+
+	return true;
+}
+
+
 bool remove_directory_r(const std::string& path, bool remove_files)
 {
 	if (path.empty())
@@ -304,6 +528,140 @@ bool remove_directory_r(const std::string& path, bool remove_files)
 #endif
 }
 
+
+// errno is kept on failure
+bool get_file_size(const std::string& path, uint64_t& size)
+{
+#ifdef WIN32
+	// stat of msvc has 32-bit st_size
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+#endif
+
+	size = (uint64_t)st.st_size;
+
+	return true;
+}
+
+
+#if defined(__linux__)
+// record of getdents64, glibc does not declare it
+struct linux_dirent64_s
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+
+directory_reader_c::directory_reader_c()
+	: m_fd(-1)
+	, m_batch_pos(0)
+	, m_batch_size(0)
+{
+}
+
+
+directory_reader_c::~directory_reader_c()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+
+bool directory_reader_c::open(const std::string& path)
+{
+	if (m_fd >= 0)
+		return false;	// already opened
+
+	m_fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (m_fd < 0)
+		return false;
+
+	m_batch.resize(DIRECTORY_READ_BATCH_SIZE);
+
+	return true;
+}
+
+
+bool directory_reader_c::next(const char*& name, unsigned char& d_type)
+{
+	if (m_batch_pos >= m_batch_size)
+	{
+		if (m_fd < 0)
+			return false;
+
+		long rc = syscall(SYS_getdents64, m_fd, m_batch.data(), m_batch.size());
+		if (rc <= 0)
+			return false;	// end of directory or error
+
+		m_batch_pos = 0;
+		m_batch_size = (size_t)rc;
+	}
+
+	auto entry = (const linux_dirent64_s*)(m_batch.data() + m_batch_pos);
+
+	m_batch_pos += entry->d_reclen;
+
+	name = entry->d_name;
+	d_type = entry->d_type;
+
+	return true;
+}
+
+
+bool directory_reader_c::stat_entry(const char* name, entry_stat_s& st)
+{
+#ifdef STATX_SIZE
+	// kernels before 4.11 do not have statx, fstatat does the same there;
+	// LIST -R workers stat at once, the flag is shared by them
+	static std::atomic<bool> statx_supported(true);
+
+	if (statx_supported.load(std::memory_order_relaxed))
+	{
+		struct statx stx;
+
+		// no sync with the server of network filesystems, cached attributes are good enough
+		if (statx(m_fd, name, AT_STATX_DONT_SYNC,
+			STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx) == 0)
+		{
+			st.size = (uint64_t)stx.stx_size;
+			st.mtime = (time_t)stx.stx_mtime.tv_sec;
+			st.device = (uint64_t)makedev(stx.stx_dev_major, stx.stx_dev_minor);	// same as st_dev
+			st.inode = (uint64_t)stx.stx_ino;
+			st.is_directory = S_ISDIR(stx.stx_mode);
+
+			return true;
+		}
+
+		if (errno != ENOSYS)
+			return false;
+
+		statx_supported.store(false, std::memory_order_relaxed);
+	}
+#endif
+
+	struct stat sb;
+	if (fstatat(m_fd, name, &sb, 0) != 0)
+		return false;
+
+	st.size = (uint64_t)sb.st_size;
+	st.mtime = sb.st_mtime;
+	st.device = (uint64_t)sb.st_dev;
+	st.inode = (uint64_t)sb.st_ino;
+	st.is_directory = S_ISDIR(sb.st_mode);
+
+	return true;
+}
+#endif
+
 }
 
 
@@ -351,10 +709,11 @@ bool directory_iterator_c::set_root(const std::string& absolute_path)
 }
 
 
-bool directory_iterator_c::change_dir(const std::string& relative_path)
+bool directory_iterator_c::change_dir(const std::string& relative_path, bool check_exists)
 {
 	// check directory exists first
-	if (!helpers::check_directory_exists(helpers::rebuild_path(absolute_path() + relative_path)))
+	if (check_exists
+		&& !helpers::check_directory_exists(helpers::rebuild_path(absolute_path() + relative_path)))
 	{
 		return false;
 	}
@@ -421,6 +780,52 @@ int directory_iterator_c::current_level() const
 }
 
 
+bool directory_iterator_c::get_entity_info(const std::string& path, entity_info_s& info)
+{
+	std::string target_path = path;
+
+	// stat of esp-idf (and msvc) fails on trailing slash
+	while (target_path.size() > 1 && (target_path.back() == '/' || target_path.back() == '\\'))
+		target_path.pop_back();
+
+#ifdef WIN32
+	struct _stat64 st;
+	if (_stat64(target_path.c_str(), &st) != 0)
+		return false;
+
+	bool is_directory = (st.st_mode & _S_IFDIR) != 0;
+	bool is_readonly = (st.st_mode & _S_IWRITE) == 0;
+#else
+	struct stat st;
+	if (stat(target_path.c_str(), &st) != 0)
+		return false;
+
+	bool is_directory = S_ISDIR(st.st_mode);
+	bool is_readonly = false;
+#endif
+
+	size_t name_pos = target_path.find_last_of("\\/");
+
+	info.name = name_pos == std::string::npos || target_path.size() == 1 ?
+		target_path : target_path.substr(name_pos + 1);
+	info.attributes = is_directory ? e_attribute_directory : e_attribute_0;
+	if (is_readonly)
+		info.attributes = (e_attributes)(info.attributes | e_attribute_readonly);
+	info.file_size_bytes = (uint64_t)st.st_size;
+	info.write_time_unix = st.st_mtime;
+	info.write_time = *localtime(&info.write_time_unix);
+#ifdef WIN32
+	info.device = 0;
+	info.inode = 0;
+#else
+	info.device = (uint64_t)st.st_dev;
+	info.inode = (uint64_t)st.st_ino;
+#endif
+
+	return true;
+}
+
+
 std::string directory_iterator_c::absolute_path()
 {
 	if (m_hierarchy.first_node == m_hierarchy.last_node)
@@ -476,4 +881,41 @@ std::string directory_iterator_c::relative_path()
 	return rel_path;
 }
 
+
+bool directory_iterator_c::resolve_path(const std::string& path, std::string& resolved_path)
+{
+	bool from_root = !path.empty() && (path[0] == '/' || path[0] == '\\');
+
+	auto dir_levels = helpers::split_path(from_root ? std::string() : relative_path());
+
+	for (auto& dir_level : helpers::split_path(path))
+	{
+		if (dir_level == ".")
+			continue;
+
+		if (dir_level == "..")
+		{
+			if (dir_levels.empty())
+				return false;
+
+			dir_levels.pop_back();
+			continue;
+		}
+
+		dir_levels.push_back(dir_level);
+	}
+
+	resolved_path = m_root_path;
+
+	for (size_t i = 0; i < dir_levels.size(); ++i)
+	{
+		if (i > 0)
+			resolved_path += PATH_SLASH_TYPE;
+
+		resolved_path += dir_levels[i];
+	}
+
+	return true;
+}
+
 }
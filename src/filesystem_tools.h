@@ -7,11 +7,20 @@
 
 #pragma once
 
+// 64-bit off_t for stat, fseeko, pread and sendfile of 32-bit linux builds,
+// has to be defined before the first system header
+#if defined(__linux__) && !defined(_FILE_OFFSET_BITS)
+#	define _FILE_OFFSET_BITS 64
+#endif
+
 // stl
 #include <time.h>
 #include <string>
 #include <vector>
+#include <bitset>
+#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 // os specific
 #ifdef WIN32
@@ -50,8 +59,94 @@ bool string_starts_with(const std::string& s1, const std::string& s2);
 
 bool strings_iequals(const std::string& s1, const std::string& s2);
 
+bool has_glob_chars(const std::string& s);
+
+// Glob of file names: "*", "?" and "[...]" ("[!...]" / "[^...]" negated,
+// "a-z" ranges), case sensitive; leading '.' of a name is matched only by
+// a literal '.', like shell does. Pattern is compiled once into segments
+// between stars, a name is checked by anchoring the first and the last
+// segment and finding the leftmost place of the others, so there is no
+// backtracking; segments of plain characters are compared with memcmp.
+class glob_matcher_c
+{
+public:
+	glob_matcher_c();
+
+	// empty pattern matches everything
+	void compile(const std::string& pattern);
+
+	bool empty() const { return m_segments.empty() && !m_has_star; }
+
+	bool match(const char* name, size_t name_len) const;
+	bool match(const std::string& name) const { return match(name.data(), name.size()); }
+
+private:
+	struct segment_s
+	{
+		// plain characters only
+		std::string literal;
+		bool is_literal;
+
+		// one set of allowed bytes per position, for segments with '?' / '[...]'
+		std::vector<std::bitset<256>> positions;
+
+		size_t length() const { return is_literal ? literal.size() : positions.size(); }
+	};
+
+	static bool match_segment_at(const segment_s& segment, const char* s);
+
+private:
+	std::vector<segment_s> m_segments;
+
+	bool m_has_star;
+	bool m_leading_dot;	// pattern starts with a literal '.'
+};
+
 bool remove_directory_r(const std::string& path, bool remove_files);
 
+bool get_file_size(const std::string& path, uint64_t& size);
+
+#if defined(__linux__)
+struct entry_stat_s
+{
+	uint64_t size;
+	time_t mtime;
+	uint64_t device;
+	uint64_t inode;
+	bool is_directory;
+};
+
+// Directory entries read straight from the kernel in big getdents64 batches,
+// entries are stat'ed relative to the directory fd (statx asks for type,
+// size, mtime and inode only), so no path string is built per entry.
+class directory_reader_c
+{
+private:
+	directory_reader_c(const directory_reader_c&) = delete;
+	directory_reader_c& operator=(const directory_reader_c&) = delete;
+
+public:
+	directory_reader_c();
+
+	~directory_reader_c();
+
+	bool open(const std::string& path);
+
+	// name stays valid until the next call, d_type is DT_UNKNOWN
+	// if the filesystem does not report it
+	bool next(const char*& name, unsigned char& d_type);
+
+	bool stat_entry(const char* name, entry_stat_s& st);
+
+private:
+	int m_fd;
+
+	std::vector<char> m_batch;
+	size_t m_batch_pos;
+	size_t m_batch_size;
+};
+#endif
+
 //
 
 namespace linked_list
@@ -248,8 +343,12 @@ public:
 	{
 		std::string name;
 		e_attributes attributes;
-		uint32_t file_size_bytes;
-		struct tm write_time;
+		uint64_t file_size_bytes;
+		struct tm write_time;		// local time
+		time_t write_time_unix;
+		// device and inode, 0 if the filesystem has no inode numbers (or not asked for)
+		uint64_t device;
+		uint64_t inode;
 	};
 
 public:
@@ -259,7 +358,8 @@ public:
 
 	bool set_root(const std::string& absolute_path);
 
-	bool change_dir(const std::string& relative_path);
+	// check_exists = false: the caller has checked the directory already
+	bool change_dir(const std::string& relative_path, bool check_exists = true);
 
 	void move_prev_dir();
 
@@ -267,15 +367,28 @@ public:
 
 	int current_level() const;
 
+	// single file or directory, name is the last component of the path
+	static bool get_entity_info(const std::string& path, entity_info_s& info);
+
 	std::string absolute_path();
 
 	std::string relative_path();
 
+	// path given by client (from the root if it starts with slash, else from the
+	// current directory) to absolute one, "." and ".." resolved;
+	// false - path leads above the root
+	bool resolve_path(const std::string& path, std::string& resolved_path);
+
 #ifdef WIN32
 	// callback prototype for example: bool(const entity_info_s&);
+	// with_details is ignored, FindNextFile returns size and time anyway;
+	// directories_unfiltered: directories not matching name_filter are passed too
 	template <typename CallbackT>
 	bool enum_files(CallbackT callback,
-		const std::string& abs_path)
+		const std::string& abs_path,
+		bool with_details = true,
+		const helpers::glob_matcher_c* name_filter = nullptr,
+		bool directories_unfiltered = false)
 	{
 		std::string enum_filter = abs_path.empty() ?
 			absolute_path() :
@@ -298,16 +411,28 @@ public:
 				continue;
 			}
 
+			if (name_filter
+				&& !(directories_unfiltered && (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				&& !name_filter->match(ffd.cFileName, strlen(ffd.cFileName)))
+			{
+				continue;
+			}
+
 			entity_info_s file_info;
 			{
 				file_info.attributes = (decltype(file_info.attributes))ffd.dwFileAttributes;
 				file_info.name = ffd.cFileName;
-				file_info.file_size_bytes = ((int64_t)ffd.nFileSizeHigh << 32) | (int64_t)ffd.nFileSizeLow;
+				file_info.file_size_bytes = ((uint64_t)ffd.nFileSizeHigh << 32) | (uint64_t)ffd.nFileSizeLow;
 
 				auto last_write_time = ((int64_t)ffd.ftLastWriteTime.dwHighDateTime << 32)
 					| (int64_t)ffd.ftLastWriteTime.dwLowDateTime;
 				auto write_time_total_seconds = helpers::convert_windows_time_to_unix_time(last_write_time);
 				file_info.write_time = *localtime(&write_time_total_seconds);
+				file_info.write_time_unix = write_time_total_seconds;
+
+				// file index needs a handle per file
+				file_info.device = 0;
+				file_info.inode = 0;
 			}
 
 			if (!callback(file_info))
@@ -315,13 +440,101 @@ public:
 		}
 		while (FindNextFileA(hfind, &ffd) != 0);
 
+		return true;
+	}
+#elif defined(__linux__)
+	// callback prototype for example: bool(const entity_info_s&);
+	// with_details = false: no stat at all, only names are filled
+	// (and directory attribute if the filesystem reports entry types);
+	// entries not matching name_filter are skipped before stat, but directories
+	// if directories_unfiltered (entries of unknown type and symlinks are stat'ed to tell)
+	template <typename CallbackT>
+	bool enum_files(CallbackT callback,
+		const std::string& abs_path,
+		bool with_details = true,
+		const helpers::glob_matcher_c* name_filter = nullptr,
+		bool directories_unfiltered = false)
+	{
+		helpers::directory_reader_c reader;
+
+		if (!reader.open(abs_path.empty() ? absolute_path() : abs_path))
+			return false;
+
+		// files of one directory often share mtime (unpacked archive, copy)
+		time_t last_mtime = 0;
+		struct tm last_write_time;
+		memset(&last_write_time, 0, sizeof(last_write_time));
+
+		const char* name = nullptr;
+		unsigned char d_type = DT_UNKNOWN;
+
+		while (reader.next(name, d_type))
+		{
+			bool filtered_out = name_filter && !name_filter->match(name, strlen(name));
+
+			if (filtered_out
+				&& !(directories_unfiltered && (d_type == DT_DIR || d_type == DT_LNK || d_type == DT_UNKNOWN)))
+			{
+				continue;
+			}
+
+			entity_info_s file_info;
+			{
+				file_info.name = name;
+				file_info.file_size_bytes = 0;
+				file_info.write_time = last_write_time;
+				file_info.write_time_unix = 0;
+				file_info.device = 0;
+				file_info.inode = 0;
+
+				bool is_directory = d_type == DT_DIR;
+
+				if (with_details)
+				{
+					helpers::entry_stat_s st;
+					if (!reader.stat_entry(name, st))
+					{
+						printf("stat failed for file %s\n", name);
+						continue;
+					}
+
+					is_directory = st.is_directory;
+
+					if (st.mtime != last_mtime)
+					{
+						// localtime_r does not check TZ on every call
+						localtime_r(&st.mtime, &last_write_time);
+						last_mtime = st.mtime;
+					}
+
+					file_info.file_size_bytes = st.size;
+					file_info.write_time = last_write_time;
+					file_info.write_time_unix = st.mtime;
+					file_info.device = st.device;
+					file_info.inode = st.inode;
+				}
+
+				if (filtered_out && !is_directory)
+					continue;
+
+				file_info.attributes = is_directory ?
+					e_attribute_directory : e_attribute_0;
+			}
+
+			if (!callback(file_info))
+				break;
+		}
+
 		return true;
 	}
 #else
 	// callback prototype for example: bool(const entity_info_s&);
 	template <typename CallbackT>
 	bool enum_files(CallbackT callback,
-		const std::string& abs_path)
+		const std::string& abs_path,
+		bool with_details = true,
+		const helpers::glob_matcher_c* name_filter = nullptr,
+		bool directories_unfiltered = false)
 	{
 		std::string target_path = abs_path.empty() ?
 			absolute_path() : abs_path;
@@ -343,21 +556,40 @@ public:
 
 		while ((entry = readdir(dp)))
 		{				
+			if (name_filter
+				&& !(directories_unfiltered && entry->d_type == DT_DIR)
+				&& !name_filter->match(entry->d_name, strlen(entry->d_name)))
+			{
+				continue;
+			}
+
 			entity_info_s file_info;
 			{
-				std::string full_file_path = helpers::rebuild_path(target_path) + entry->d_name;
+				file_info.name = entry->d_name;
+				file_info.file_size_bytes = 0;
+				memset(&file_info.write_time, 0, sizeof(file_info.write_time));
+				file_info.write_time_unix = 0;
+				file_info.device = 0;
+				file_info.inode = 0;
 
-				struct stat st;
-				if (stat(full_file_path.c_str(), &st) != 0)
+				if (with_details)
 				{
-					printf("stat failed for file %s\n",
-						full_file_path.c_str());
-					continue;
+					std::string full_file_path = helpers::rebuild_path(target_path) + entry->d_name;
+
+					struct stat st;
+					if (stat(full_file_path.c_str(), &st) != 0)
+					{
+						printf("stat failed for file %s\n",
+							full_file_path.c_str());
+						continue;
+					}
+
+					file_info.file_size_bytes = (decltype(file_info.file_size_bytes))st.st_size;
+					file_info.write_time = *localtime(&st.st_mtime);
+					file_info.write_time_unix = st.st_mtime;
+					file_info.device = (uint64_t)st.st_dev;
+					file_info.inode = (uint64_t)st.st_ino;
 				}
-
-				file_info.name = entry->d_name;
-				file_info.file_size_bytes = (decltype(file_info.file_size_bytes))st.st_size;
-				file_info.write_time = *localtime(&st.st_mtime);
 #if 0
 				file_info.attributes = (decltype(file_info.attributes))st.st_mode/* & _IFMT*/;
 #else
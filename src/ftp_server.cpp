@@ -19,10 +19,18 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
 #if defined(WIN32)
 #	include <io.h>
 #	include <direct.h>
 #	include <direct.h>
+#	include <ws2tcpip.h>
 
 #	define socklen_t int
 #elif defined(__linux__)
@@ -33,7 +41,10 @@
 #	include <arpa/inet.h>
 #	include <sys/ioctl.h>
 #	include <sys/socket.h>
+#	include <sys/sendfile.h>
+#	include <signal.h>
 #	include <netinet/in.h>
+#	include <linux/tcp.h>		// TCP_INFO with pacing rate
 #else // ESP32
 #	define MAX_PATH					260
 #	define INVALID_SOCK				-1
@@ -73,14 +84,6 @@ DECLARE_SMART_CLOSER(smart_fp, FILE, fclose);
 DECLARE_SMART_CLOSER(smart_dp, DIR, closedir);
 #endif
 
-#if defined(WIN32) || defined(__linux__)
-template <typename T>
-struct array_deleter_s
-{
-	void operator()(T* ptr) { if (*ptr != nullptr) delete[] *ptr; }
-};
-#endif
-
 class smart_socket
 {
 public:
@@ -108,1350 +111,5906 @@ private:
 	SOCKET m_socket;
 };
 
-//
-static const char* TAG = "FTP";
+// host part of IPv4 address (IPv4-mapped IPv6 addresses of dual-stack sockets too)
+static bool address_to_ipv4(const struct sockaddr_storage& addr, uint8_t* ip)
+{
+	if (addr.ss_family == AF_INET)
+	{
+		auto addr_v4 = (const struct sockaddr_in*)&addr;
+		memcpy(ip, &addr_v4->sin_addr, 4);
 
-//
+		return true;
+	}
+#ifdef FTPSERVER_IPV6_SUPPORT
+	else if (addr.ss_family == AF_INET6)
+	{
+		static const uint8_t v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
 
-namespace ftp_server
-{
+		auto addr_v6 = (const struct sockaddr_in6*)&addr;
+		auto bytes = (const uint8_t*)&addr_v6->sin6_addr;
 
-#define SELECT_SLEEP_DURATION	1000 * 500	// 500 ms
+		if (memcmp(bytes, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0)
+		{
+			memcpy(ip, bytes + sizeof(v4_mapped_prefix), 4);
 
+			return true;
+		}
+	}
+#endif
 
-ftp_server_c::ftp_server_c()
-	: m_native_encoding(e_encoding_utf8)
-{
+	return false;
 }
 
 
-ftp_server_c::~ftp_server_c()
+static bool addresses_same_host(const struct sockaddr_storage& addr1,
+	const struct sockaddr_storage& addr2)
 {
-	stop();
-}
+	uint8_t ip1[4], ip2[4];
 
+	bool is_ipv4_1 = address_to_ipv4(addr1, ip1);
+	bool is_ipv4_2 = address_to_ipv4(addr2, ip2);
 
-void ftp_server_c::set_homedir(const std::string& abs_path)
-{
-	m_home_dir = filesystem_tools::helpers::rebuild_path(abs_path);
-}
+	if (is_ipv4_1 || is_ipv4_2)
+	{
+		return is_ipv4_1 && is_ipv4_2 && memcmp(ip1, ip2, sizeof(ip1)) == 0;
+	}
 
+#ifdef FTPSERVER_IPV6_SUPPORT
+	if (addr1.ss_family == AF_INET6 && addr2.ss_family == AF_INET6)
+	{
+		return memcmp(&((const struct sockaddr_in6*)&addr1)->sin6_addr,
+			&((const struct sockaddr_in6*)&addr2)->sin6_addr,
+			sizeof(struct in6_addr)) == 0;
+	}
+#endif
 
-std::string ftp_server_c::homedir() const
-{
-	return m_home_dir;
+	return false;
 }
 
 
-bool ftp_server_c::start(uint16_t port)
+// PORT h1,h2,h3,h4,p1,p2
+static bool parse_port_argument(const std::string& value, struct sockaddr_storage& addr)
 {
-	if (!check_directory_exists(m_home_dir))
-	{
-		if (mkdir(m_home_dir.c_str()
-#ifndef WIN32
-			, 0777
-#endif
-			))
-		{
-			printf("Failed to create directory on path: %s\n",
-				m_home_dir.c_str());
+	unsigned int h[4], p[2];
+	char tail = 0;
 
-			return false;
-		}
+	if (sscanf(value.c_str(), "%u,%u,%u,%u,%u,%u%c",
+		&h[0], &h[1], &h[2], &h[3], &p[0], &p[1], &tail) != 6)
+	{
+		return false;
 	}
 
-#ifdef _WIN32
-	WSADATA wsaData;
-	WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
+	for (auto v : h)
+		if (v > 255) return false;
 
-	if (!initialize_sock_channel(m_listen_socket, port, true))
+	if (p[0] > 255 || p[1] > 255)
 		return false;
 
-	m_working = true;
+	memset(&addr, 0, sizeof(addr));
 
-	server_routine();
+	auto addr_v4 = (struct sockaddr_in*)&addr;
+	addr_v4->sin_family = AF_INET;
+	addr_v4->sin_port = htons((uint16_t)((p[0] << 8) | p[1]));
+
+	uint8_t* ip = (uint8_t*)&addr_v4->sin_addr;
+	for (int i = 0; i < 4; ++i)
+		ip[i] = (uint8_t)h[i];
 
 	return true;
 }
 
 
-void ftp_server_c::stop()
+// EPRT <d>proto<d>address<d>port<d> (RFC 2428), returns false on syntax error,
+// unsupported_protocol is set for well formed command with unknown protocol
+static bool parse_eprt_argument(const std::string& value,
+	struct sockaddr_storage& addr,
+	bool& unsupported_protocol)
 {
-	m_working = false;
+	unsupported_protocol = false;
 
-	// todo: wait for thread finished
+	if (value.size() < 7)
+		return false;
 
-	if (m_listen_socket)
+	char delimiter = value[0];
+	if (delimiter < 33 || delimiter > 126)
+		return false;
+
+	size_t proto_end = value.find(delimiter, 1);
+	if (proto_end == std::string::npos)
+		return false;
+
+	size_t addr_end = value.find(delimiter, proto_end + 1);
+	if (addr_end == std::string::npos)
+		return false;
+
+	size_t port_end = value.find(delimiter, addr_end + 1);
+	if (port_end == std::string::npos || port_end != value.size() - 1)
+		return false;
+
+	auto proto = value.substr(1, proto_end - 1);
+	auto host = value.substr(proto_end + 1, addr_end - proto_end - 1);
+	auto port_str = value.substr(addr_end + 1, port_end - addr_end - 1);
+
+	char* port_str_end = nullptr;
+	unsigned long port = strtoul(port_str.c_str(), &port_str_end, 10);
+	if (port_str.empty() || *port_str_end || port == 0 || port > 0xffff)
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+
+	if (proto == "1")
 	{
-		closesocket(m_listen_socket);
-		m_listen_socket = 0;
+		auto addr_v4 = (struct sockaddr_in*)&addr;
+		addr_v4->sin_family = AF_INET;
+		addr_v4->sin_port = htons((uint16_t)port);
+
+		return inet_pton(AF_INET, host.c_str(), &addr_v4->sin_addr) == 1;
+	}
+#ifdef FTPSERVER_IPV6_SUPPORT
+	else if (proto == "2")
+	{
+		auto addr_v6 = (struct sockaddr_in6*)&addr;
+		addr_v6->sin6_family = AF_INET6;
+		addr_v6->sin6_port = htons((uint16_t)port);
+
+		return inet_pton(AF_INET6, host.c_str(), &addr_v6->sin6_addr) == 1;
 	}
+#endif
+
+	unsupported_protocol = true;
+
+	return false;
 }
 
 
-#if defined(WIN32)
-void ftp_server_c::server_routine()
+static uint16_t address_port(const struct sockaddr_storage& addr)
 {
-	fd_set master_read_fds;
-	fd_set master_exception_fds;
-
-	FD_ZERO(&master_read_fds);
-	FD_ZERO(&master_exception_fds);
+#ifdef FTPSERVER_IPV6_SUPPORT
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((const struct sockaddr_in6*)&addr)->sin6_port);
+#endif
 
-	FD_SET(m_listen_socket, &master_read_fds);
-	FD_SET(m_listen_socket, &master_exception_fds);
+	return ntohs(((const struct sockaddr_in*)&addr)->sin_port);
+}
 
-	struct timeval tv = { 0, SELECT_SLEEP_DURATION };
 
-	while (m_working)
-	{
-		fd_set read_fds;
-		fd_set exception_fds;
+static bool set_socket_blocking(SOCKET sock, bool blocking)
+{
+#ifdef WIN32
+	u_long non_blocking_mode = blocking ? 0 : 1;
+	return ioctlsocket(sock, FIONBIO, &non_blocking_mode) != SOCKET_ERROR;
+#else
+	int flags = fcntl(sock, F_GETFL);
+	return fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) != -1;
+#endif
+}
 
-		memcpy(&read_fds, &master_read_fds, sizeof(fd_set));
-		memcpy(&exception_fds, &master_exception_fds, sizeof(fd_set));
 
-		int retval = select(0, &read_fds, NULL, &exception_fds, &tv);
-		if (retval > 0)
-		{
-			for (uint32_t i = 0; i < read_fds.fd_count; ++i)
-			{
-				auto& client_socket = read_fds.fd_array[i];
+// REST / ALLO argument, decimal only
+static bool parse_uint64_argument(const std::string& value, uint64_t& offset)
+{
+	if (value.empty() || value.size() > 20)
+		return false;
 
-				if (client_socket == m_listen_socket)
-				{
-					sockaddr_in client_addr;
-					int addr_len = sizeof(client_addr);
-					SOCKET connected_client_sock = accept(m_listen_socket, (sockaddr*)&client_addr, &addr_len);
+	uint64_t result = 0;
 
-					if (connected_client_sock == INVALID_SOCKET)
-					{
-						// todo: log error
+	for (auto c : value)
+	{
+		if (c < '0' || c > '9')
+			return false;
 
-						continue;
-					}
-					else
-					{
-						FD_SET(connected_client_sock, &master_read_fds);
-						FD_SET(connected_client_sock, &master_exception_fds);
+		uint64_t digit = (uint64_t)(c - '0');
+		if (result > (UINT64_MAX - digit) / 10)
+			return false;
 
-						handle_connection(connected_client_sock);
-					}
-				}
-				else
-				{
-					char data_buf[2048] = { 0 };
-					size_t m_data_buf_sz = sizeof(data_buf);
+		result = result * 10 + digit;
+	}
 
-					auto client_connection = find_connection_by_socket(client_socket);
-					if (!client_connection)
-					{
-						// impossible situation
-						continue;
-					}
+	offset = result;
 
-					bool remove_connection_flag = false;
+	return true;
+}
 
-					if (FD_ISSET(client_socket, &read_fds))
-					{
-						// receive incoming data
-						int rc = recv(client_socket, data_buf, m_data_buf_sz, 0);
 
-						//
-						int last_err = WSAGetLastError();
-						if (rc > 0)
-						{
-							handle_incoming_data(client_connection.get(), (uint8_t*)data_buf, rc);
-						}
-						else if (rc == 0 || (rc == SOCKET_ERROR && last_err == WSAECONNRESET))
-						{
-							// client disconnected
-							remove_connection_flag = true;
-						}
-						else if (rc == SOCKET_ERROR)
-						{
-							remove_connection_flag = true;
+static bool get_file_size(FILE* file, uint64_t& size)
+{
+#if defined(WIN32)
+	struct _stat64 st;
+	if (_fstat64(_fileno(file), &st))
+		return false;
+#else
+	struct stat st;
+	if (fstat(fileno(file), &st))
+		return false;
+#endif
 
-							// todo: log error
-						}
-					}
-					else if (FD_ISSET(client_socket, &exception_fds))
-					{
-						remove_connection_flag = true;
+	size = (uint64_t)st.st_size;
 
-						// todo: log error
-					}
+	return true;
+}
 
-					if (remove_connection_flag)
-					{
-						remove_client_connection(client_socket);
 
-						FD_CLR(client_socket, &master_read_fds);
-						FD_CLR(client_socket, &master_exception_fds);
-					}
-				}
-			}
-		}
-		else if (retval == SOCKET_ERROR)
-		{
-			// todo: log error
-		}
-	}
+static bool seek_file(FILE* file, uint64_t offset)
+{
+#if defined(WIN32)
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#elif defined(__linux__)
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#else	// ESP32
+	return fseek(file, (long)offset, SEEK_SET) == 0;
+#endif
 }
-#elif 1 /* work both good for linux & esp32 */ //defined (__linux__)
-void ftp_server_c::server_routine()
+
+
+// pread() analogue, returns bytes count or -1
+static int64_t read_file_at(FILE* file, uint64_t offset, char* buf, size_t size)
 {
-	fd_set master_set, working_set;
+#if defined(WIN32)
+	HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(file));
 
-	FD_ZERO(&master_set);
-	FD_SET(m_listen_socket, &master_set);
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
 
-	SOCKET max_sd = m_listen_socket;
+	DWORD read_sz = 0;
+	if (!ReadFile(file_handle, buf, (DWORD)size, &read_sz, &overlapped))
+		return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
 
-	struct sockaddr_storage source_addr;
-	socklen_t addr_len = sizeof(source_addr);
+	return (int64_t)read_sz;
+#elif defined(__linux__)
+	return (int64_t)pread(fileno(file), buf, size, (off_t)offset);
+#else	// ESP32, every transfer has its own FILE
+	if (!seek_file(file, offset))
+		return -1;
 
-	struct timeval timeout;
-	{
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 1000 * 500;	// 500 ms
-	}
+	size_t read_sz = fread(buf, 1, size, file);
+	if (read_sz == 0 && ferror(file))
+		return -1;
 
-	while (m_working)
-	{
-		memcpy(&working_set, &master_set, sizeof(master_set));
+	return (int64_t)read_sz;
+#endif
+}
 
-		auto rc = select(max_sd + 1, &working_set, NULL, NULL, &timeout);
 
-		// reset timeout (select could change it)
-		{
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 1000 * 500;	// 500 ms
-		}
+// pwrite() analogue, returns true if everything is written
+static bool write_file_at(FILE* file, uint64_t offset, const char* buf, size_t size)
+{
+#if defined(WIN32)
+	HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(file));
 
-		if (rc == 0)
-		{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD written = 0;
+	return WriteFile(file_handle, buf, (DWORD)size, &written, &overlapped) && written == (DWORD)size;
+#elif defined(__linux__)
+	while (size > 0)
+	{
+		auto written = pwrite(fileno(file), buf, size, (off_t)offset);
+		if (written < 0 && errno == EINTR)
 			continue;
-		}
-		else if (rc < 0)
-		{
-			ESP_LOGE(TAG, "select() failed");
-			break;
-		}
 
-		int desc_ready = rc;
-		for (SOCKET sock = 0; sock <= max_sd && desc_ready > 0; ++sock)
-		{
-			if (FD_ISSET(sock, &working_set))
-			{
-				desc_ready -= 1;
+		if (written <= 0)
+			return false;
 
-				if (sock == m_listen_socket)
-				{
-					// accept a new connections
-					SOCKET client_socket = accept
-					(
-						m_listen_socket,
-						(struct sockaddr*)&source_addr,
-						&addr_len
-					);
+		buf += written;
+		size -= written;
+		offset += written;
+	}
 
-					if (client_socket < 0)
-					{
-						if (errno != EWOULDBLOCK)
-						{
-							ESP_LOGE(TAG, "Error when accepting connection: %s",
-								strerror(errno));
-						}
+	return true;
+#else	// ESP32
+	return seek_file(file, offset) && fwrite(buf, size, 1, file) == 1;
+#endif
+}
+
+
+static bool replace_file(const std::string& from_path, const std::string& to_path)
+{
+#if defined(WIN32)
+	return MoveFileExA(from_path.c_str(), to_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#elif defined(__linux__)
+	// atomic, readers see either old file or complete new one
+	return rename(from_path.c_str(), to_path.c_str()) == 0;
+#else	// ESP32, FAT rename fails if target exists
+	unlink(to_path.c_str());
+	return rename(from_path.c_str(), to_path.c_str()) == 0;
+#endif
+}
+
+
+static bool socket_would_block()
+{
+#if defined(WIN32)
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+
+// only for log messages
+static void address_to_string(const struct sockaddr_storage& addr, char* buf, size_t buf_sz)
+{
+	uint8_t ip[4];
+
+	if (address_to_ipv4(addr, ip))
+	{
+		snprintf(buf, buf_sz, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+	}
+#ifdef FTPSERVER_IPV6_SUPPORT
+	else if (addr.ss_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, (void*)&((const struct sockaddr_in6*)&addr)->sin6_addr, buf, buf_sz);
+	}
+#endif
+	else
+	{
+		snprintf(buf, buf_sz, "unknown");
+	}
+}
+
+//
+static const char* TAG = "FTP";
+
+
+// socket tuning is best effort, failure leaves the system default
+static void set_socket_option(SOCKET sock, int level, int option, int value, const char* option_name)
+{
+	if (setsockopt(sock, level, option, (const char*)&value, sizeof(value)) != 0)
+	{
+		ESP_LOGD(TAG, "Failed to set %s = %d for socket %d (err: %s)",
+			option_name, value, sock, strerror(errno));
+	}
+}
+
+
+static void set_socket_cork(SOCKET sock, bool cork)
+{
+#ifdef TCP_CORK
+	set_socket_option(sock, IPPROTO_TCP, TCP_CORK, cork ? 1 : 0, "TCP_CORK");
+#endif
+}
+
+//
+
+namespace ftp_server
+{
+
+#define SELECT_SLEEP_DURATION	1000 * 500	// 500 ms
+
+// how many ports to try if port from the pool is occupied by somebody else
+#define PASSIVE_BIND_ATTEMPTS	8
+
+// background transfer moves up to a quantum (times user's weight) per round
+// of the scheduler, then lets other sockets go
+#if defined(WIN32) || defined(__linux__)
+#	define BACKGROUND_TRANSFER_QUANTUM		(1024 * 256)
+#else // ESP32
+#	define BACKGROUND_TRANSFER_QUANTUM		(1024 * 4)
+#endif
+
+// share of the heaviest user, bigger weights are cut to it
+#define BACKGROUND_TRANSFER_MAX_WEIGHT		1000
+
+// transfer chunk size, tuned within the limits where TCP_INFO is available
+#if defined(WIN32) || defined(__linux__)
+#	define TRANSFER_CHUNK_DEFAULT_SIZE		(1024 * 256)
+#	define TRANSFER_CHUNK_MIN_SIZE			(1024 * 16)
+#	define TRANSFER_CHUNK_MAX_SIZE			(1024 * 1024 * 4)
+#else // ESP32
+#	define TRANSFER_CHUNK_DEFAULT_SIZE		1024
+#	define TRANSFER_CHUNK_MIN_SIZE			1024
+#	define TRANSFER_CHUNK_MAX_SIZE			1024
+#endif
+
+// chunk size is tuned again after this many chunks
+#define TRANSFER_CHUNKS_PER_TUNE			8
+
+// MODE Z download waiting for compression workers is looked at this often
+#define DEFLATE_POLL_INTERVAL_US			2000
+
+// facts of MLSD / MLST in the order they are shown (FEAT, OPTS MLST)
+struct mlst_fact_name_s
+{
+	const char* name;
+	uint32_t bit;
+};
+
+static const mlst_fact_name_s g_mlst_facts[] =
+{
+	{ "size",	e_mlst_fact_size },
+	{ "modify",	e_mlst_fact_modify },
+	{ "type",	e_mlst_fact_type },
+	{ "perm",	e_mlst_fact_perm },
+	{ "unique",	e_mlst_fact_unique }
+};
+
+// LIST output buffer takes a chunk plus the line which crossed it
+#define LIST_LINE_RESERVE_SIZE				1024
+
+// LIST -R: listings rendered ahead of the sent one take this much at most,
+// workers wait for the sender beyond it
+#if defined(WIN32) || defined(__linux__)
+#	define RECURSIVE_LIST_BUFFER_SIZE		(1024 * 1024 * 8)
+#else
+#	define RECURSIVE_LIST_BUFFER_SIZE		(1024 * 16)
+#endif
+
+// transfer_statistics() keeps this many transfers which are over
+#define RECENT_TRANSFERS_STATISTICS_COUNT	32
+
+// TLS handshake of control (AUTH TLS) or data connection must complete within this
+#define TLS_HANDSHAKE_TIMEOUT_SEC			10
+
+// control connection data not handled yet (a partial line or commands queued
+// behind a deferred transfer) is dropped beyond this
+#define CONTROL_BUFFER_MAX_SIZE				4096
+
+
+ftp_server_c::ftp_server_c()
+	: m_session_rate_limit(FTPSERVER_DEFAULT_SESSION_RATE_LIMIT)
+	, m_session_rate_burst(0)
+	, m_passive_listeners_pool_size(FTPSERVER_DEFAULT_PASSIVE_LISTENERS_POOL_SIZE)
+	, m_data_channel_timeout_sec(FTPSERVER_DEFAULT_DATA_CHANNEL_TIMEOUT_SEC)
+	, m_max_data_channels_per_session(FTPSERVER_DEFAULT_MAX_DATA_CHANNELS_PER_SESSION)
+	, m_block_restart_marker_interval(FTPSERVER_DEFAULT_BLOCK_RESTART_MARKER_INTERVAL)
+	, m_deflate_level(FTPSERVER_DEFAULT_DEFLATE_LEVEL)
+	, m_active_connect_timeout_sec(FTPSERVER_DEFAULT_ACTIVE_CONNECT_TIMEOUT_SEC)
+	, m_active_mode_source_port(0)
+	, m_partial_upload_timeout_sec(FTPSERVER_DEFAULT_PARTIAL_UPLOAD_TIMEOUT_SEC)
+	, m_recursive_list_max_depth(FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_DEPTH)
+	, m_recursive_list_max_entries(FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_ENTRIES)
+	, m_recursive_list_threads(FTPSERVER_DEFAULT_RECURSIVE_LIST_THREADS)
+	, m_native_encoding(e_encoding_utf8)
+{
+	m_default_user_profile = std::make_shared<user_profile_s>();
+
+	m_socket_profiles[e_socket_profile_control].no_delay = FTPSERVER_DEFAULT_CONTROL_NO_DELAY;
+	m_socket_profiles[e_socket_profile_control].quick_ack = FTPSERVER_DEFAULT_CONTROL_QUICK_ACK;
+
+	m_listing_cache.set_memory_budget(FTPSERVER_DEFAULT_LISTING_CACHE_SIZE);
+	m_listing_cache.set_ttl(FTPSERVER_DEFAULT_LISTING_CACHE_TTL_SEC);
+
+	m_metadata_cache.set_capacity(FTPSERVER_DEFAULT_METADATA_CACHE_ENTRIES);
+	m_metadata_cache.set_ttl(FTPSERVER_DEFAULT_METADATA_CACHE_TTL_MS, FTPSERVER_DEFAULT_METADATA_CACHE_NEGATIVE_TTL_MS);
+
+	m_data_channel_ports_pool.set_range
+	(
+		FTPSERVER_DEFAULT_PASSIVE_FIRST_PORT,
+		FTPSERVER_DEFAULT_PASSIVE_LAST_PORT
+	);
+}
+
+
+ftp_server_c::~ftp_server_c()
+{
+	stop();
+}
+
+
+void ftp_server_c::set_homedir(const std::string& abs_path)
+{
+	m_home_dir = filesystem_tools::helpers::rebuild_path(abs_path);
+}
+
+
+std::string ftp_server_c::homedir() const
+{
+	return m_home_dir;
+}
+
+
+bool ftp_server_c::set_passive_ports_range(uint16_t first_port, uint16_t last_port)
+{
+	if (m_working)
+		return false;	// ports are in use already
+
+	return m_data_channel_ports_pool.set_range(first_port, last_port);
+}
+
+
+void ftp_server_c::set_global_rate_limit(uint64_t bytes_per_sec, uint64_t burst_bytes)
+{
+	m_global_rate_limiter.set_rate(bytes_per_sec, burst_bytes);
+}
+
+
+void ftp_server_c::set_user_rate_limit(const std::string& user_name, uint64_t bytes_per_sec, uint64_t burst_bytes)
+{
+	configure_user_profile(user_name)->rate_limiter.set_rate(bytes_per_sec, burst_bytes);
+}
+
+
+void ftp_server_c::set_session_rate_limit(uint64_t bytes_per_sec, uint64_t burst_bytes)
+{
+	m_session_rate_limit = bytes_per_sec;
+	m_session_rate_burst = burst_bytes;
+}
+
+
+void ftp_server_c::set_user_transfer_weight(const std::string& user_name, uint32_t weight)
+{
+	if (weight == 0)
+		weight = 1;
+	else if (weight > BACKGROUND_TRANSFER_MAX_WEIGHT)
+		weight = BACKGROUND_TRANSFER_MAX_WEIGHT;
+
+	configure_user_profile(user_name)->transfer_weight = weight;
+}
+
+
+bool ftp_server_c::add_fxp_host(const std::string& address)
+{
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+
+	auto addr_v4 = (struct sockaddr_in*)&addr;
+	if (inet_pton(AF_INET, address.c_str(), &addr_v4->sin_addr) == 1)
+	{
+		addr_v4->sin_family = AF_INET;
+	}
+#ifdef FTPSERVER_IPV6_SUPPORT
+	else if (inet_pton(AF_INET6, address.c_str(), &((struct sockaddr_in6*)&addr)->sin6_addr) == 1)
+	{
+		addr.ss_family = AF_INET6;
+	}
+#endif
+	else
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_fxp_hosts_mutex);
+
+	m_fxp_hosts.push_back(addr);
+
+	return true;
+}
+
+
+void ftp_server_c::clear_fxp_hosts()
+{
+	std::lock_guard<std::mutex> lock(m_fxp_hosts_mutex);
+
+	m_fxp_hosts.clear();
+}
+
+
+bool ftp_server_c::start(uint16_t port)
+{
+	if (!check_directory_exists(m_home_dir))
+	{
+		if (mkdir(m_home_dir.c_str()
+#ifndef WIN32
+			, 0777
+#endif
+			))
+		{
+			printf("Failed to create directory on path: %s\n",
+				m_home_dir.c_str());
+
+			return false;
+		}
+	}
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+#ifdef __linux__
+	// client which drops data connection must not kill the server (send/sendfile)
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if (!initialize_sock_channel(m_listen_socket, port, true, m_socket_profiles[e_socket_profile_listener]))
+		return false;
+
+	fill_passive_listeners_pool();
+
+	m_working = true;
+
+	server_routine();
+
+	free_passive_listeners_pool();
+
+	return true;
+}
+
+
+void ftp_server_c::stop()
+{
+	m_working = false;
+
+	// todo: wait for thread finished
+
+	if (m_listen_socket)
+	{
+		closesocket(m_listen_socket);
+		m_listen_socket = 0;
+	}
+}
+
+
+#if defined(WIN32)
+void ftp_server_c::server_routine()
+{
+	fd_set master_read_fds;
+	fd_set master_exception_fds;
+
+	FD_ZERO(&master_read_fds);
+	FD_ZERO(&master_exception_fds);
+
+	FD_SET(m_listen_socket, &master_read_fds);
+	FD_SET(m_listen_socket, &master_exception_fds);
+
+	struct timeval tv = { 0, SELECT_SLEEP_DURATION };
+
+	while (m_working)
+	{
+		check_data_channels_timeouts();
+
+		fd_set read_fds;
+		fd_set exception_fds;
+
+		memcpy(&read_fds, &master_read_fds, sizeof(fd_set));
+		memcpy(&exception_fds, &master_exception_fds, sizeof(fd_set));
+
+		// passive listeners, active mode data connects in progress (windows reports failed
+		// connect as exception) and background transfers
+		fd_set connect_fds;
+		FD_ZERO(&connect_fds);
+
+		struct timeval timeout = tv;
+		{
+			SOCKET max_sd = 0;
+			prepare_data_channels_fds(&read_fds, &connect_fds, &exception_fds, max_sd);
+			prepare_background_transfers_fds(&read_fds, &connect_fds, max_sd, timeout);
+#ifdef FTPSERVER_WITH_OPENSSL
+			prepare_tls_handshakes_fds(&read_fds, &connect_fds, max_sd);
+#endif
+		}
+
+		int retval = select(0, &read_fds, &connect_fds, &exception_fds, &timeout);
+		if (retval > 0)
+		{
+			handle_data_channels_fds(&read_fds, &connect_fds, &exception_fds);
+
+			// commands go first, a transfer never delays them for more than one round
+			for (uint32_t i = 0; i < read_fds.fd_count; ++i)
+			{
+				auto& client_socket = read_fds.fd_array[i];
+
+				if (client_socket == m_listen_socket)
+				{
+					sockaddr_in client_addr;
+					int addr_len = sizeof(client_addr);
+					SOCKET connected_client_sock = accept(m_listen_socket, (sockaddr*)&client_addr, &addr_len);
+
+					if (connected_client_sock == INVALID_SOCKET)
+					{
+						// todo: log error
+
+						continue;
 					}
 					else
 					{
-						FD_SET(client_socket, &master_set);
-						if (client_socket > max_sd)
-							max_sd = client_socket;
+						FD_SET(connected_client_sock, &master_read_fds);
+						FD_SET(connected_client_sock, &master_exception_fds);
+
+						handle_connection(connected_client_sock);
+					}
+				}
+				else
+				{
+					char data_buf[2048] = { 0 };
+					size_t m_data_buf_sz = sizeof(data_buf);
+
+					auto client_connection = find_connection_by_socket(client_socket);
+					if (!client_connection)
+					{
+						// data socket of a background upload
+						continue;
+					}
+
+#ifdef FTPSERVER_WITH_OPENSSL
+					// AUTH TLS handshake reads the socket (handle_tls_handshakes_fds())
+					if (client_connection->control_handshake().in_progress())
+						continue;
+#endif
+
+					bool remove_connection_flag = false;
+
+					if (FD_ISSET(client_socket, &read_fds))
+					{
+						// receive incoming data
+						int rc = recv_from_client(client_socket, data_buf, m_data_buf_sz);
+
+						//
+						int last_err = WSAGetLastError();
+						if (rc > 0)
+						{
+							handle_control_data(client_connection.get(), data_buf, rc);
+
+#ifdef FTPSERVER_WITH_OPENSSL
+							// records decrypted already do not make the socket readable
+							while (client_connection->control_tls() &&
+								client_connection->control_tls()->pending() > 0)
+							{
+								rc = recv_from_client(client_socket, data_buf, m_data_buf_sz);
+								if (rc <= 0)
+									break;
+
+								handle_control_data(client_connection.get(), data_buf, rc);
+							}
+#endif
+						}
+						else if (rc == 0 || (rc == SOCKET_ERROR && last_err == WSAECONNRESET))
+						{
+							// client disconnected
+							remove_connection_flag = true;
+						}
+						else if (rc == SOCKET_ERROR)
+						{
+							remove_connection_flag = true;
+
+							// todo: log error
+						}
+					}
+					else if (FD_ISSET(client_socket, &exception_fds))
+					{
+						remove_connection_flag = true;
+
+						// todo: log error
+					}
+
+					if (remove_connection_flag)
+					{
+						remove_client_connection(client_socket);
+
+						FD_CLR(client_socket, &master_read_fds);
+						FD_CLR(client_socket, &master_exception_fds);
+					}
+				}
+			}
+
+#ifdef FTPSERVER_WITH_OPENSSL
+			handle_tls_handshakes_fds(&read_fds, &connect_fds);
+#endif
+			handle_background_transfers_fds(&read_fds, &connect_fds);
+		}
+		else if (retval == SOCKET_ERROR)
+		{
+			// todo: log error
+		}
+	}
+}
+#elif 1 /* work both good for linux & esp32 */ //defined (__linux__)
+void ftp_server_c::server_routine()
+{
+	fd_set master_set, working_set;
+
+	FD_ZERO(&master_set);
+	FD_SET(m_listen_socket, &master_set);
+
+	SOCKET max_sd = m_listen_socket;
+
+	struct sockaddr_storage source_addr;
+	socklen_t addr_len = sizeof(source_addr);
+
+	struct timeval timeout;
+	{
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 1000 * 500;	// 500 ms
+	}
+
+	while (m_working)
+	{
+		check_data_channels_timeouts();
+
+		memcpy(&working_set, &master_set, sizeof(master_set));
+
+		// passive listeners, active mode data connects in progress and background transfers
+		fd_set connect_set, connect_error_set;
+		FD_ZERO(&connect_set);
+		FD_ZERO(&connect_error_set);
+
+		SOCKET max_select_sd = max_sd;
+		prepare_data_channels_fds(&working_set, &connect_set, &connect_error_set, max_select_sd);
+		prepare_background_transfers_fds(&working_set, &connect_set, max_select_sd, timeout);
+#ifdef FTPSERVER_WITH_OPENSSL
+		prepare_tls_handshakes_fds(&working_set, &connect_set, max_select_sd);
+#endif
+
+		auto rc = select(max_select_sd + 1, &working_set, &connect_set, &connect_error_set, &timeout);
+
+		// reset timeout (select could change it)
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 1000 * 500;	// 500 ms
+		}
+
+		if (rc == 0)
+		{
+			continue;
+		}
+		else if (rc < 0)
+		{
+			ESP_LOGE(TAG, "select() failed");
+			break;
+		}
+
+		handle_data_channels_fds(&working_set, &connect_set, &connect_error_set);
+
+		// commands go first, a transfer never delays them for more than one round
+		for (SOCKET sock = 0; sock <= max_sd; ++sock)
+		{
+			// background upload sockets are left for handle_background_transfers_fds()
+			if (FD_ISSET(sock, &working_set) && FD_ISSET(sock, &master_set))
+			{
+				if (sock == m_listen_socket)
+				{
+					// accept a new connections
+					SOCKET client_socket = accept
+					(
+						m_listen_socket,
+						(struct sockaddr*)&source_addr,
+						&addr_len
+					);
+
+					if (client_socket < 0)
+					{
+						if (errno != EWOULDBLOCK)
+						{
+							ESP_LOGE(TAG, "Error when accepting connection: %s",
+								strerror(errno));
+						}
+					}
+					else
+					{
+						FD_SET(client_socket, &master_set);
+						if (client_socket > max_sd)
+							max_sd = client_socket;
+
+						handle_connection(client_socket);
+					}
+				}
+				else
+				{
+					if (sock != INVALID_SOCK)
+					{
+#ifdef FTPSERVER_WITH_OPENSSL
+						// AUTH TLS handshake reads the socket (handle_tls_handshakes_fds())
+						auto handshaking_connection = find_connection_by_socket(sock);
+						if (handshaking_connection && handshaking_connection->control_handshake().in_progress())
+							continue;
+#endif
+
+						char data_buf[128] = { 0 };
+						size_t data_buf_sz = sizeof(data_buf);
+
+						int rc = recv_from_client(sock, data_buf, data_buf_sz);
+
+						if (rc < 0)
+						{
+							if (errno == EINPROGRESS ||
+								errno == EAGAIN ||
+								errno == EWOULDBLOCK)
+							{
+								continue;
+							}
+
+							if (errno == ENOTCONN)
+							{
+								ESP_LOGI(TAG, "Connection %d closed", sock);
+							}
+							else
+							{
+								ESP_LOGE(TAG, "Error occurred during receiving (sock: %d, err: %s). Close connection",
+									sock, strerror(errno));
+							}
+
+							remove_client_connection(sock);
+
+							FD_CLR(sock, &master_set);
+							if (sock == max_sd)
+							{
+								while (!FD_ISSET(max_sd, &master_set))
+									max_sd -= 1;
+							}
+						}
+						else if (rc > 0)
+						{
+							auto client_connection = find_connection_by_socket(sock);
+							if (!client_connection)
+							{
+								// impossible situation
+								continue;
+							}
+
+#ifdef TCP_QUICKACK
+							// kernel falls back to delayed ACK on its own, arm it again
+							if (m_socket_profiles[e_socket_profile_control].quick_ack)
+								set_socket_option(sock, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+#endif
+
+							handle_control_data(client_connection.get(), data_buf, rc);
+
+#ifdef FTPSERVER_WITH_OPENSSL
+							// records decrypted already do not make the socket readable
+							while (client_connection->control_tls() &&
+								client_connection->control_tls()->pending() > 0)
+							{
+								rc = recv_from_client(sock, data_buf, data_buf_sz);
+								if (rc <= 0)
+									break;
+
+								handle_control_data(client_connection.get(), data_buf, rc);
+							}
+#endif
+						}
+					}
+				}
+			}
+		}
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		handle_tls_handshakes_fds(&working_set, &connect_set);
+#endif
+		handle_background_transfers_fds(&working_set, &connect_set);
+	}
+}
+#elif 0 // works on esp32, but load cpu, old code
+void ftp_server_c::server_routine()
+{
+	const size_t max_socks = CONFIG_MAX_SOCKETS - 1;
+	static SOCKET client_sockets[CONFIG_MAX_SOCKETS - 1];
+
+	struct sockaddr_storage source_addr;
+	socklen_t addr_len = sizeof(source_addr);
+
+	// prepare a list of file descriptors to hold client's sockets, mark all of them as invalid, i.e. available
+	for (int i = 0; i < max_socks; ++i)
+	{
+		client_sockets[i] = INVALID_SOCK;
+	}
+
+	while (m_working)
+	{
+		// find a free socket
+		int free_sock_index = 0;
+		for (free_sock_index = 0; free_sock_index < max_socks; ++free_sock_index)
+		{
+			if (client_sockets[free_sock_index] == INVALID_SOCK)
+ 				break;
+		}
+
+		// accept a new connection only if we have a free socket
+		if (free_sock_index < max_socks)
+		{
+			auto& free_socket = client_sockets[free_sock_index];
+
+			// accept a new connections
+			free_socket = accept
+			(
+				m_listen_socket,
+				(struct sockaddr*)&source_addr,
+				&addr_len
+			);
+
+			if (free_socket < 0)
+			{
+				if (errno != EWOULDBLOCK)
+				{
+					ESP_LOGE(TAG, "Error when accepting connection: %s",
+						strerror(errno));
+				}
+			}
+			else
+			{
+				handle_connection(free_socket);
+			}
+		}
+
+		// receive data
+		for (int i = 0; i < max_socks; ++i)
+		{
+			auto& client_socket = client_sockets[i];
+
+			if (client_socket != INVALID_SOCK)
+			{
+				char data_buf[128] = { 0 };
+				size_t data_buf_sz = sizeof(data_buf);
+
+				int rc = recv(client_socket, data_buf, data_buf_sz, 0);
+
+				if (rc < 0)
+				{
+					if (errno == EINPROGRESS ||
+						errno == EAGAIN ||
+						errno == EWOULDBLOCK)
+					{
+						continue;
+					}
+
+					if (errno == ENOTCONN)
+					{
+						ESP_LOGI(TAG, "Connection %d closed", client_socket);
+					}
+					else
+					{
+						ESP_LOGE(TAG, "Error occurred during receiving (sock: %d, err: %s). Close connection",
+							client_socket, strerror(errno));
+					}
+
+					remove_client_connection(client_socket);
+
+					client_socket = INVALID_SOCK;
+				}
+				else if (rc > 0)
+				{
+					auto client_connection = find_connection_by_socket(client_socket);
+					if (!client_connection)
+					{
+						// impossible situation
+						continue;
+					}
+
+					handle_incoming_data(client_connection.get(), (uint8_t*)data_buf, rc);
+				}
+			}
+		}
+	}
+}
+#endif
+
+
+void ftp_server_c::remove_client_connection(SOCKET sock)
+{
+	if (sock == 0)
+		return;
+
+	closesocket(sock);
+
+	auto it = m_client_connections.begin();
+	while (it != m_client_connections.end())
+	{
+		auto& client_connection = *it;
+
+		if (client_connection->command_socket() == sock)
+		{
+			close_all_data_channels(client_connection.get());
+
+			// uploaded ranges count even if the session is gone
+			for (auto& background_transfer : client_connection->background_transfers())
+			{
+				complete_background_transfer(*background_transfer);
+			}
+
+			it = m_client_connections.erase(it);
+			break;
+		}
+
+		++it;
+	}
+
+	// ranged uploads the session left unfinished
+	check_partial_uploads_timeouts();
+};
+
+
+ftp_server_c::ftp_client_connection_t ftp_server_c::find_connection_by_socket(SOCKET sock)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		if (client_connection->command_socket() == sock)
+		{
+			return client_connection;
+		}
+	}
+
+	return ftp_client_connection_t();
+}
+
+
+void ftp_server_c::handle_connection(SOCKET client_socket)
+{
+	struct sockaddr_storage peer_addr;
+	get_peer_address(client_socket, peer_addr);
+
+	char peer_addr_str[64] = "";
+	address_to_string(peer_addr, peer_addr_str, sizeof(peer_addr_str));
+
+	ESP_LOGI
+	(
+		TAG, "New client connected (sock: %d, ip: %s)",
+		client_socket,
+		peer_addr_str
+	);
+
+	// set socket non-blocking mode
+#ifdef WIN32
+	u_long non_blocking_mode = 1;
+	if (ioctlsocket(client_socket, FIONBIO, &non_blocking_mode) == SOCKET_ERROR)
+	{
+		ESP_LOGE
+		(
+			TAG, "Failed to set non blocking mode for socket %d (err: %s)",
+			client_socket,
+			strerror(errno)
+		);
+
+		return;
+	}
+#else
+	{
+		int flags = fcntl(client_socket, F_GETFL);
+		if (fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) == -1)
+		{
+			ESP_LOGE
+			(
+				TAG, "Failed to set non blocking mode for socket %d (err: %s)",
+				client_socket,
+				strerror(errno)
+			);
+
+			return;
+		}
+	}
+#endif
+
+	apply_socket_profile(client_socket, m_socket_profiles[e_socket_profile_control], false);
+
+	auto client_connection = std::make_shared<ftp_client_connection_c>(client_socket);
+	client_connection->set_ftp_root_directory(m_home_dir);
+	client_connection->set_encoding(m_native_encoding);
+	client_connection->set_deflate_level(m_deflate_level);
+	client_connection->rate_limiter().set_rate(m_session_rate_limit, m_session_rate_burst);
+
+	{
+		// the client can not claim it, only the host it connects from counts
+		std::lock_guard<std::mutex> lock(m_fxp_hosts_mutex);
+
+		for (auto& fxp_host : m_fxp_hosts)
+		{
+			if (addresses_same_host(peer_addr, fxp_host))
+			{
+				client_connection->set_fxp_allowed(true);
+				break;
+			}
+		}
+	}
+
+	// send initial message
+	send_to_client(client_connection.get(), "220 lwftp ready\r\n");
+
+	m_client_connections.emplace_back(std::move(client_connection));
+}
+
+
+uint16_t ftp_server_c::get_first_free_port()
+{
+	return m_data_channel_ports_pool.allocate();
+}
+
+
+void ftp_server_c::mark_port_as_free(uint16_t port_number)
+{
+	m_data_channel_ports_pool.release(port_number);
+}
+
+
+bool ftp_server_c::get_local_address(SOCKET sock, struct sockaddr_storage& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+
+	socklen_t addr_size = (socklen_t)sizeof(addr);
+
+	return getsockname(sock, (struct sockaddr*)&addr, &addr_size) == 0;
+}
+
+
+bool ftp_server_c::get_peer_address(SOCKET sock, struct sockaddr_storage& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+
+	socklen_t addr_size = (socklen_t)sizeof(addr);
+
+	return getpeername(sock, (struct sockaddr*)&addr, &addr_size) == 0;
+}
+
+
+void ftp_server_c::fill_passive_listeners_pool()
+{
+	while (m_passive_listeners_pool.size() < m_passive_listeners_pool_size)
+	{
+		passive_listener_s listener;
+		if (!open_passive_listener(listener.sock, listener.port))
+		{
+			ESP_LOGE(TAG, "Failed to prepare passive listener (prepared: %d)",
+				(int)m_passive_listeners_pool.size());
+
+			break;
+		}
+
+		m_passive_listeners_pool.push_back(listener);
+	}
+}
+
+
+void ftp_server_c::free_passive_listeners_pool()
+{
+	for (auto& listener : m_passive_listeners_pool)
+	{
+		closesocket(listener.sock);
+		mark_port_as_free(listener.port);
+	}
+
+	m_passive_listeners_pool.clear();
+}
+
+
+bool ftp_server_c::open_passive_listener(SOCKET& sock, uint16_t& port)
+{
+	for (int attempt = 0; attempt < PASSIVE_BIND_ATTEMPTS; ++attempt)
+	{
+		port = get_first_free_port();
+		if (port == 0)
+		{
+			break;	// pool exhausted
+		}
+
+		// accepted data connections inherit buffer sizes of the listener
+		if (initialize_sock_channel(sock, port, true, m_socket_profiles[e_socket_profile_data]))
+		{
+			return true;
+		}
+
+		// port is occupied by somebody else, try next one
+		mark_port_as_free(port);
+	}
+
+	sock = 0;
+	port = 0;
+
+	return false;
+}
+
+
+void ftp_server_c::drain_passive_listener(SOCKET sock)
+{
+	// drop connections which were late for the previous transfer
+	while (true)
+	{
+		SOCKET stale_sock = accept(sock, NULL, NULL);
+		if (stale_sock == INVALID_SOCKET || (int)stale_sock < 0)
+			break;
+
+		closesocket(stale_sock);
+	}
+}
+
+
+bool ftp_server_c::open_passive_data_channel(ftp_client_connection_c* client_connection,
+	uint16_t& port)
+{
+	close_persistent_data_connection(client_connection);
+
+	SOCKET new_channel = 0;
+
+	if (!m_passive_listeners_pool.empty())
+	{
+		// prepared listener, nothing to bind
+		auto& listener = m_passive_listeners_pool.back();
+		{
+			new_channel = listener.sock;
+			port = listener.port;
+		}
+		m_passive_listeners_pool.pop_back();
+
+		drain_passive_listener(new_channel);
+	}
+	else if (!open_passive_listener(new_channel, port))
+	{
+		ESP_LOGE(TAG, "No free passive port for sock %d",
+			client_connection->command_socket());
+
+		return false;
+	}
+
+	data_channel_s data_channel;
+	{
+		data_channel.sock = new_channel;
+		data_channel.port = port;
+		data_channel.mode = e_data_channel_mode_passive;
+		data_channel.open_time = time(NULL);
+		data_channel.connect_pending = false;
+		data_channel.data_sock = 0;
+	}
+	add_data_channel(client_connection, data_channel);
+
+	return true;
+}
+
+
+bool ftp_server_c::open_active_data_channel(ftp_client_connection_c* client_connection,
+	const struct sockaddr_storage& client_addr)
+{
+	close_persistent_data_connection(client_connection);
+
+	SOCKET sock = socket(client_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET)
+	{
+		ESP_LOGE(TAG, "Failed to create active data socket (err: %s)",
+			strerror(errno));
+
+		return false;
+	}
+
+	set_socket_blocking(sock, false);
+
+	// buffers must be set before connect() to take part in the window scale
+	apply_socket_profile(sock, m_socket_profiles[e_socket_profile_data], false);
+
+	socklen_t client_addr_len = sizeof(struct sockaddr_in);
+#ifdef FTPSERVER_IPV6_SUPPORT
+	if (client_addr.ss_family == AF_INET6)
+		client_addr_len = sizeof(struct sockaddr_in6);
+#endif
+
+	if (m_active_mode_source_port)
+	{
+		int reuse_addr = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
+
+		struct sockaddr_storage source_addr;
+		get_local_address(client_connection->command_socket(), source_addr);
+
+		if (source_addr.ss_family != client_addr.ss_family)
+		{
+			// IPv4 client of dual-stack control connection
+			memset(&source_addr, 0, sizeof(source_addr));
+			source_addr.ss_family = client_addr.ss_family;
+		}
+
+#ifdef FTPSERVER_IPV6_SUPPORT
+		if (source_addr.ss_family == AF_INET6)
+			((struct sockaddr_in6*)&source_addr)->sin6_port = htons(m_active_mode_source_port);
+		else
+#endif
+			((struct sockaddr_in*)&source_addr)->sin_port = htons(m_active_mode_source_port);
+
+		if (bind(sock, (struct sockaddr*)&source_addr, client_addr_len) != 0)
+		{
+			ESP_LOGE(TAG, "Failed to bind active data socket to port %d (err: %s)",
+				m_active_mode_source_port, strerror(errno));
+		}
+	}
+
+	// connection is established by the server loop, transfer command is deferred until then
+	int rc = connect(sock, (const struct sockaddr*)&client_addr, client_addr_len);
+
+	bool pending = false;
+	if (rc != 0)
+	{
+#ifdef WIN32
+		pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		pending = errno == EINPROGRESS;
+#endif
+
+		if (!pending)
+		{
+			ESP_LOGE(TAG, "Active data connect failed (sock: %d, err: %s)",
+				client_connection->command_socket(), strerror(errno));
+
+			closesocket(sock);
+
+			return false;
+		}
+	}
+
+	data_channel_s data_channel;
+	{
+		data_channel.sock = sock;
+		data_channel.port = 0;
+		data_channel.mode = e_data_channel_mode_active;
+		data_channel.open_time = time(NULL);
+		data_channel.connect_pending = pending;
+		data_channel.data_sock = 0;
+	}
+	add_data_channel(client_connection, data_channel);
+
+	return true;
+}
+
+
+void ftp_server_c::add_data_channel(ftp_client_connection_c* client_connection,
+	const data_channel_s& data_channel)
+{
+	auto& data_channels = client_connection->data_channels();
+
+	while (!data_channels.empty() && data_channels.size() >= m_max_data_channels_per_session)
+	{
+		release_data_channel(data_channels.front());
+		data_channels.pop_front();
+	}
+
+	data_channels.push_back(data_channel);
+}
+
+
+void ftp_server_c::prepare_data_channels_fds(fd_set* accept_set, fd_set* connect_set, fd_set* error_set,
+	SOCKET& max_sd)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		for (auto& data_channel : client_connection->data_channels())
+		{
+			auto sock = data_channel.sock;
+
+			if (data_channel.connect_pending)
+			{
+				FD_SET(sock, connect_set);
+				FD_SET(sock, error_set);
+			}
+			else if (data_channel.mode == e_data_channel_mode_passive && sock && !data_channel.data_sock)
+			{
+				// every passive channel of the session is watched: a client which
+				// abandoned one PASV connects to the later one
+				FD_SET(sock, accept_set);
+			}
+			else
+			{
+				continue;
+			}
+
+			if (sock > max_sd)
+				max_sd = sock;
+		}
+	}
+}
+
+
+void ftp_server_c::handle_data_channels_fds(fd_set* accept_set, fd_set* connect_set, fd_set* error_set)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		for (auto& data_channel : client_connection->data_channels())
+		{
+			auto sock = data_channel.sock;
+
+			if (data_channel.connect_pending)
+			{
+				if (FD_ISSET(sock, connect_set) || FD_ISSET(sock, error_set))
+				{
+					finish_data_connect(client_connection.get(), data_channel);
+				}
+			}
+			else if (data_channel.mode == e_data_channel_mode_passive && sock && !data_channel.data_sock
+				&& FD_ISSET(sock, accept_set))
+			{
+				accept_data_channel(client_connection.get(), data_channel);
+			}
+		}
+	}
+
+	check_deferred_commands();
+}
+
+
+bool ftp_server_c::finish_data_connect(ftp_client_connection_c* client_connection,
+	data_channel_s& data_channel)
+{
+	int sock_error = 0;
+	socklen_t sock_error_len = sizeof(sock_error);
+
+	data_channel.connect_pending = false;
+
+	if (getsockopt(data_channel.sock, SOL_SOCKET, SO_ERROR, (char*)&sock_error, &sock_error_len) != 0
+		|| sock_error != 0)
+	{
+		ESP_LOGE(TAG, "Active data connect failed (sock: %d, err: %s)",
+			client_connection->command_socket(), strerror(sock_error));
+
+		// channel stays in the queue, the transfer which expects it gets 425
+		closesocket(data_channel.sock);
+		data_channel.sock = 0;
+
+		return false;
+	}
+
+	return true;
+}
+
+
+bool ftp_server_c::accept_data_channel(ftp_client_connection_c* client_connection,
+	data_channel_s& data_channel)
+{
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len = sizeof(peer_addr);
+	SOCKET data_sock = accept(data_channel.sock, (struct sockaddr*)&peer_addr, &peer_addr_len);
+
+	if (data_sock == INVALID_SOCKET || (int)data_sock < 0)
+		return false;
+
+	// data connection must come from the same host as the control one,
+	// unless the user may run transfers between servers
+	struct sockaddr_storage control_peer_addr;
+	get_peer_address(client_connection->command_socket(), control_peer_addr);
+
+	if (!addresses_same_host(peer_addr, control_peer_addr))
+	{
+		if (!client_connection->fxp_allowed())
+		{
+			ESP_LOGE(TAG, "Rejected data connection from foreign host (sock: %d)",
+				client_connection->command_socket());
+
+			closesocket(data_sock);
+			return false;
+		}
+
+		char peer_addr_str[64] = "";
+		address_to_string(peer_addr, peer_addr_str, sizeof(peer_addr_str));
+
+		ESP_LOGI(TAG, "FXP data connection from %s (sock: %d)",
+			peer_addr_str,
+			client_connection->command_socket());
+	}
+
+	// transfer loops expect blocking socket
+	set_socket_blocking(data_sock, true);
+
+	// not every option is inherited from the listener
+	apply_socket_profile(data_sock, m_socket_profiles[e_socket_profile_data], false);
+
+	data_channel.data_sock = data_sock;
+
+	return true;
+}
+
+
+bool ftp_server_c::data_connection_ready(ftp_client_connection_c* client_connection)
+{
+	if (client_connection->resuming_command() || client_connection->persistent_data_socket())
+		return true;
+
+	auto& data_channels = client_connection->data_channels();
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// transfer command has replied already, its channel is the front one
+	if (client_connection->awaiting_data_tls())
+		return data_channels.empty() || !data_channels.front().tls.in_progress();
+#endif
+
+	if (data_channels.empty())
+		return true;
+
+	if (data_channels.front().mode == e_data_channel_mode_active)
+		return !data_channels.front().connect_pending;
+
+	bool listening = false;
+
+	for (auto& data_channel : data_channels)
+	{
+		if (data_channel.mode != e_data_channel_mode_passive)
+			continue;
+
+		if (data_channel.data_sock)
+			return true;
+
+		if (data_channel.sock)
+			listening = true;
+	}
+
+	return !listening;
+}
+
+
+void ftp_server_c::check_deferred_commands()
+{
+	auto now = time(NULL);
+
+	// commands may change the connections list, so it is not walked while they run
+	std::vector<ftp_client_connection_t> ready_connections;
+
+	for (auto& client_connection : m_client_connections)
+	{
+		if (client_connection->deferred_command().empty())
+			continue;
+
+		bool timed_out = m_data_channel_timeout_sec
+			&& now - client_connection->deferred_time() >= (time_t)m_data_channel_timeout_sec;
+
+		if (timed_out || data_connection_ready(client_connection.get()))
+			ready_connections.push_back(client_connection);
+	}
+
+	for (auto& client_connection : ready_connections)
+	{
+		resume_deferred_command(client_connection.get());
+	}
+}
+
+
+void ftp_server_c::resume_deferred_command(ftp_client_connection_c* client_connection)
+{
+	auto line = client_connection->take_deferred_command();
+
+	// command replies 425 if its connection has not come
+	client_connection->set_resuming_command(true);
+	handle_incoming_data(client_connection, (uint8_t*)&line[0], line.size());
+	client_connection->set_resuming_command(false);
+
+	// commands which were sent behind it
+	handle_control_data(client_connection, "", 0);
+}
+
+
+SOCKET ftp_server_c::open_data_connection(ftp_client_connection_c* client_connection)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	client_connection->set_data_tls(tls_handshake_s());
+#endif
+
+	auto persistent_data_sock = client_connection->persistent_data_socket();
+	if (persistent_data_sock)
+	{
+		// block mode, connection of previous transfer (handed over to the transfer)
+		client_connection->assign_persistent_data_socket(0);
+
+		return persistent_data_sock;
+	}
+
+	auto& data_channels = client_connection->data_channels();
+	if (data_channels.empty())
+		return INVALID_SOCKET;
+
+	if (data_channels.front().mode == e_data_channel_mode_active)
+	{
+		return take_connected_socket(client_connection);
+	}
+
+	return take_accepted_connection(client_connection);
+}
+
+
+SOCKET ftp_server_c::take_connected_socket(ftp_client_connection_c* client_connection)
+{
+	auto& data_channel = client_connection->data_channels().front();
+
+	// failed or timed out
+	SOCKET sock = data_channel.sock;
+	if (sock == 0 || data_channel.connect_pending)
+		return INVALID_SOCKET;
+
+	// socket is handed over to the transfer
+	data_channel.sock = 0;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	client_connection->set_data_tls(data_channel.tls);
+	data_channel.tls.session.reset();
+#endif
+
+	set_socket_blocking(sock, true);
+
+	return sock;
+}
+
+
+SOCKET ftp_server_c::take_accepted_connection(ftp_client_connection_c* client_connection)
+{
+	// channel of this transfer goes first, close_data_channel() releases it
+	if (!front_accepted_connection(client_connection))
+		return INVALID_SOCKET;
+
+	auto& data_channel = client_connection->data_channels().front();
+
+	SOCKET data_sock = data_channel.data_sock;
+	data_channel.data_sock = 0;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	client_connection->set_data_tls(data_channel.tls);
+	data_channel.tls.session.reset();
+#endif
+
+	return data_sock;
+}
+
+
+bool ftp_server_c::front_accepted_connection(ftp_client_connection_c* client_connection)
+{
+	auto& data_channels = client_connection->data_channels();
+
+	// oldest channel with a connection wins, segmented clients connect in PASV order
+	auto it = data_channels.begin();
+	while (it != data_channels.end()
+		&& !(it->mode == e_data_channel_mode_passive && it->data_sock))
+	{
+		++it;
+	}
+
+	if (it == data_channels.end())
+		return false;
+
+	if (it != data_channels.begin())
+	{
+		auto data_channel = *it;
+		data_channels.erase(it);
+		data_channels.push_front(data_channel);
+	}
+
+	return true;
+}
+
+
+void ftp_server_c::release_data_channel(data_channel_s& data_channel)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	// close_notify goes before the socket is closed
+	data_channel.tls.session.reset();
+#endif
+
+	if (data_channel.data_sock)
+	{
+		// connection no transfer has taken
+		closesocket(data_channel.data_sock);
+	}
+
+	if (data_channel.sock && data_channel.port
+		&& data_channel.mode == e_data_channel_mode_passive
+		&& m_passive_listeners_pool.size() < m_passive_listeners_pool_size)
+	{
+		// listener is still bound, give it back to the pool
+		drain_passive_listener(data_channel.sock);
+
+		passive_listener_s listener;
+		{
+			listener.sock = data_channel.sock;
+			listener.port = data_channel.port;
+		}
+		m_passive_listeners_pool.push_back(listener);
+
+		return;
+	}
+
+	if (data_channel.sock)
+	{
+		closesocket(data_channel.sock);
+	}
+
+	if (data_channel.port)
+	{
+		mark_port_as_free(data_channel.port);
+	}
+}
+
+
+void ftp_server_c::close_data_channel(ftp_client_connection_c* client_connection)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	// transfer waits for the handshake on the front channel, it runs again and closes it then
+	if (client_connection->awaiting_data_tls())
+		return;
+#endif
+
+	auto& data_channels = client_connection->data_channels();
+
+	if (data_channels.empty())
+		return;
+
+	release_data_channel(data_channels.front());
+	data_channels.pop_front();
+}
+
+
+void ftp_server_c::close_all_data_channels(ftp_client_connection_c* client_connection)
+{
+	auto& data_channels = client_connection->data_channels();
+
+	for (auto& data_channel : data_channels)
+	{
+		release_data_channel(data_channel);
+	}
+
+	data_channels.clear();
+}
+
+
+void ftp_server_c::close_persistent_data_connection(ftp_client_connection_c* client_connection)
+{
+	auto data_sock = client_connection->persistent_data_socket();
+	if (data_sock)
+	{
+		closesocket(data_sock);
+
+		client_connection->assign_persistent_data_socket(0);
+	}
+}
+
+
+void ftp_server_c::check_data_channels_timeouts()
+{
+	auto now = time(NULL);
+
+	for (auto& client_connection : m_client_connections)
+	{
+		auto& data_channels = client_connection->data_channels();
+
+		auto it = data_channels.begin();
+		while (it != data_channels.end())
+		{
+			if (it->connect_pending)
+			{
+				if (m_active_connect_timeout_sec
+					&& now - it->open_time >= (time_t)m_active_connect_timeout_sec)
+				{
+					ESP_LOGE(TAG, "Active data connect timed out (sock: %d)",
+						client_connection->command_socket());
+
+					// like failed connect, the transfer which expects it gets 425
+					it->connect_pending = false;
+					closesocket(it->sock);
+					it->sock = 0;
+				}
+
+				++it;
+				continue;
+			}
+
+			if (m_data_channel_timeout_sec && now - it->open_time >= (time_t)m_data_channel_timeout_sec)
+			{
+				ESP_LOGI(TAG, "Data channel of sock %d timed out (port: %d)",
+					client_connection->command_socket(),
+					it->port);
+
+				release_data_channel(*it);
+				it = data_channels.erase(it);
+
+				continue;
+			}
+
+			++it;
+		}
+	}
+
+	// transfer commands which waited for the connections above get 425
+	check_deferred_commands();
+}
+
+
+void ftp_server_c::translate_path(ftp_client_connection_c* client_connection,
+	std::string& path,
+	e_encoding source_encoding,
+	e_encoding dest_encoding)
+{
+	if (client_connection->current_encoding() == m_native_encoding)
+		return;
+
+	if (source_encoding == e_encoding_win1251 && dest_encoding == e_encoding_utf8)
+	{
+		std::string utf8_path;
+		utf8_path.resize(MAX_PATH);
+		convert_windows1251_to_utf8(path.c_str(), &utf8_path[0]);
+
+		path = utf8_path;
+	}
+	else if (source_encoding == e_encoding_utf8 && dest_encoding == e_encoding_win1251)
+	{
+		std::string win1251_path;
+		win1251_path.resize(MAX_PATH);
+		convert_utf8_to_windows1251(path.c_str(), &win1251_path[0], win1251_path.size());
+
+		path = win1251_path;
+	}
+}
+
+
+bool ftp_server_c::initialize_sock_channel(SOCKET& sock,
+	uint16_t port,
+	bool non_blocking_sock,
+	const socket_profile_s& profile)
+{
+	struct sockaddr_storage server_address;
+	memset(&server_address, 0, sizeof(server_address));
+
+	socklen_t server_address_len = 0;
+
+	// Create a socket that we will listen upon.
+	// Dual-stack IPv6 socket accepts IPv4 clients as well (as IPv4-mapped addresses).
+#ifdef FTPSERVER_IPV6_SUPPORT
+	sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+	bool ipv6_sock = (sock != INVALID_SOCKET);
+	if (!ipv6_sock)
+	{
+		// host without IPv6
+		sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	}
+#else
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+#endif
+
+	if (sock == INVALID_SOCKET)
+	{
+		ESP_LOGE(TAG, "Failed to initialize socket channel (sock result: %d, err: %s)",
+			sock,
+			strerror(errno));
+
+		return false;
+	}
+
+#ifdef WIN32
+	if (non_blocking_sock)
+	{
+		// set non-blocking mode
+		u_long non_blocking_mode = 1;
+		if (ioctlsocket(sock, FIONBIO, &non_blocking_mode) == SOCKET_ERROR)
+		{
+			return false;
+		}
+	}
+#else
+	int flags = fcntl(sock, F_GETFL);
+	if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		ESP_LOGE(TAG, "Unable to set socket %d non blocking: %s",
+			sock,
+			strerror(errno));
+	}
+#endif
+
+	// bind our server socket to a port.
+#ifdef FTPSERVER_IPV6_SUPPORT
+	if (ipv6_sock)
+	{
+		int v6_only = 0;
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(v6_only));
+
+		auto server_address_v6 = (struct sockaddr_in6*)&server_address;
+		server_address_v6->sin6_family = AF_INET6;
+		server_address_v6->sin6_addr = in6addr_any;
+		server_address_v6->sin6_port = htons(port);
+
+		server_address_len = sizeof(struct sockaddr_in6);
+	}
+	else
+#endif
+	{
+		auto server_address_v4 = (struct sockaddr_in*)&server_address;
+		server_address_v4->sin_family = AF_INET;
+		server_address_v4->sin_addr.s_addr = htonl(INADDR_ANY);
+		server_address_v4->sin_port = htons(port);
+
+		server_address_len = sizeof(struct sockaddr_in);
+	}
+
+	int rc = bind(sock, (struct sockaddr *)&server_address, server_address_len);
+	if (rc == INVALID_SOCKET)
+	{
+		ESP_LOGE(TAG, "bind sock %d failed (bind result: %d, err: %s)",
+			sock, rc, strerror(errno));
+
+		closesocket(sock);
+
+		return false;
+	}
+
+	// window scale of accepted connections is fixed by the buffers set before listen()
+	apply_socket_profile(sock, profile, true);
+
+	// flag the socket as listening for new connections.
+	rc = listen(sock, 5);
+	if (rc == INVALID_SOCKET)
+	{
+		ESP_LOGE(TAG, "listen sock %d failed (listen result: %d, err: %s",
+			sock, rc, strerror(errno));
+
+		closesocket(sock);
+
+		return false;
+	}
+
+	return true;
+}
+
+
+void ftp_server_c::apply_socket_profile(SOCKET sock, const socket_profile_s& profile, bool listener)
+{
+#ifdef TCP_NODELAY
+	if (profile.no_delay)
+		set_socket_option(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+#endif
+
+#ifdef TCP_QUICKACK
+	if (profile.quick_ack && !listener)
+		set_socket_option(sock, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+#endif
+
+	if (profile.send_buffer)
+		set_socket_option(sock, SOL_SOCKET, SO_SNDBUF, profile.send_buffer, "SO_SNDBUF");
+
+	if (profile.recv_buffer)
+		set_socket_option(sock, SOL_SOCKET, SO_RCVBUF, profile.recv_buffer, "SO_RCVBUF");
+
+#ifdef TCP_NOTSENT_LOWAT
+	if (profile.not_sent_lowat)
+		set_socket_option(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile.not_sent_lowat, "TCP_NOTSENT_LOWAT");
+#endif
+
+#ifdef SO_BUSY_POLL
+	if (profile.busy_poll_us)
+		set_socket_option(sock, SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll_us, "SO_BUSY_POLL");
+#endif
+
+	if (!listener)
+		return;
+
+#ifdef TCP_DEFER_ACCEPT
+	if (profile.defer_accept_sec)
+		set_socket_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile.defer_accept_sec, "TCP_DEFER_ACCEPT");
+#endif
+
+#ifdef TCP_FASTOPEN
+	if (profile.fast_open_queue)
+		set_socket_option(sock, IPPROTO_TCP, TCP_FASTOPEN, profile.fast_open_queue, "TCP_FASTOPEN");
+#endif
+}
+
+
+bool ftp_server_c::send_to_client(SOCKET client_socket,
+	const char* data, size_t data_size)
+{
+	// printf("send data '%s' (data_size: %d) to sock %d\n",
+	// 	data,
+	// 	data_size,
+	// 	(int)client_socket);
+
+	while (data_size > 0)
+	{
+		int written = send(client_socket, data, data_size, 0);
+
+		if (written < 0 && errno != EINPROGRESS)
+		{
+			ESP_LOGE(TAG, "Failed to send data (sock: %d, written: %d, err: %s)",
+				client_socket, written, strerror(errno));
+
+			return false;
+		}
+
+		data_size -= written;
+	}
+
+	return true;
+}
+
+
+bool ftp_server_c::send_to_client(ftp_client_connection_c* client_connection,
+	const char* data)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	auto& control_tls = client_connection->control_tls();
+	if (control_tls)
+	{
+		size_t data_size = strlen(data);
+
+		while (data_size > 0)
+		{
+			int written = control_tls->send(data, data_size);
+
+			if (written <= 0)
+			{
+				ESP_LOGE(TAG, "Failed to send reply over TLS (sock: %d)",
+					client_connection->command_socket());
+
+				return false;
+			}
+
+			data += written;
+			data_size -= written;
+		}
+
+		return true;
+	}
+#endif
+
+	return send_to_client(client_connection->command_socket(), data, strlen(data));
+}
+
+
+int ftp_server_c::recv_from_client(SOCKET client_socket, char* buf, size_t buf_sz)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	auto client_connection = find_connection_by_socket(client_socket);
+	if (client_connection && client_connection->control_tls())
+	{
+		return client_connection->control_tls()->recv(buf, buf_sz);
+	}
+#endif
+
+	return recv(client_socket, buf, buf_sz, 0);
+}
+
+
+bool ftp_server_c::send_to_data_connection(data_transfer_s& transfer,
+	const char* data, size_t data_size)
+{
+	if (direct_socket_send(transfer))
+		return send_to_client(transfer.sock, data, data_size);
+
+	while (data_size > 0)
+	{
+		int written = send_data_chunk(transfer, data, data_size);
+
+		if (written <= 0)
+		{
+			ESP_LOGE(TAG, "Failed to send data over TLS (sock: %d)", transfer.sock);
+
+			return false;
+		}
+
+		data += written;
+		data_size -= written;
+	}
+
+	return true;
+}
+
+
+int ftp_server_c::send_data_chunk(data_transfer_s& transfer,
+	const char* data, size_t data_size)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	if (!direct_socket_send(transfer))
+		return transfer.tls->send(data, data_size);
+#endif
+
+	return send(transfer.sock, data, data_size, 0);
+}
+
+
+int ftp_server_c::recv_data_chunk(data_transfer_s& transfer, char* buf, size_t buf_sz)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	if (transfer.tls)
+		return transfer.tls->recv(buf, buf_sz);
+#endif
+
+	return recv(transfer.sock, buf, buf_sz, 0);
+}
+
+
+bool ftp_server_c::recv_data_exact(data_transfer_s& transfer, char* buf, size_t size)
+{
+	while (size > 0)
+	{
+		auto received = recv_data_chunk(transfer, buf, size);
+		if (received <= 0)
+			return false;
+
+		buf += received;
+		size -= received;
+	}
+
+	return true;
+}
+
+
+bool ftp_server_c::direct_socket_send(const data_transfer_s& transfer) const
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	return !transfer.tls || transfer.tls->kernel_send();
+#else
+	(void)transfer;
+
+	return true;
+#endif
+}
+
+
+#ifdef FTPSERVER_WITH_OPENSSL
+bool ftp_server_c::set_tls_certificate(const std::string& cert_file, const std::string& key_file)
+{
+	auto tls_context = std::make_shared<tls_tools::tls_context_c>();
+
+	if (!tls_context->load_certificate(cert_file, key_file))
+	{
+		ESP_LOGE(TAG, "Failed to load TLS certificate %s (err: %s)",
+			cert_file.c_str(),
+			tls_tools::tls_context_c::last_error().c_str());
+
+		return false;
+	}
+
+	m_tls_context = tls_context;
+
+	return true;
+}
+
+
+void ftp_server_c::tls_handshake(SOCKET sock, tls_handshake_s& handshake)
+{
+	handshake.state = handshake.session->handshake();
+
+	if (handshake.state == tls_tools::e_handshake_failed)
+	{
+		ESP_LOGE(TAG, "TLS handshake failed (sock: %d, err: %s)",
+			sock,
+			tls_tools::tls_context_c::last_error().c_str());
+	}
+}
+
+
+void ftp_server_c::prepare_tls_handshakes_fds(fd_set* read_set, fd_set* write_set, SOCKET& max_sd)
+{
+	auto now = time(NULL);
+
+	// false if the handshake has run out of time
+	auto watch = [&](SOCKET sock, tls_handshake_s& handshake) -> bool
+	{
+		if (now >= handshake.deadline)
+		{
+			ESP_LOGE(TAG, "TLS handshake timed out (sock: %d)", sock);
+
+			handshake.state = tls_tools::e_handshake_failed;
+			return false;
+		}
+
+		FD_SET(sock, handshake.state == tls_tools::e_handshake_want_read ? read_set : write_set);
+
+		if (sock > max_sd)
+			max_sd = sock;
+
+		return true;
+	};
+
+	for (auto& client_connection : m_client_connections)
+	{
+		auto& control_handshake = client_connection->control_handshake();
+
+		if (control_handshake.in_progress()
+			&& !watch(client_connection->command_socket(), control_handshake))
+		{
+			finish_control_handshake(client_connection.get());
+		}
+
+		for (auto& data_channel : client_connection->data_channels())
+		{
+			if (!data_channel.tls.in_progress())
+				continue;
+
+			// deferred transfer command gets 425 when it runs again
+			watch(data_channel.mode == e_data_channel_mode_active ? data_channel.sock : data_channel.data_sock,
+				data_channel.tls);
+		}
+	}
+}
+
+
+void ftp_server_c::handle_tls_handshakes_fds(fd_set* read_set, fd_set* write_set)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		auto& control_handshake = client_connection->control_handshake();
+
+		if (control_handshake.in_progress())
+		{
+			auto sock = client_connection->command_socket();
+
+			if (FD_ISSET(sock, read_set) || FD_ISSET(sock, write_set))
+			{
+				tls_handshake(sock, control_handshake);
+
+				if (!control_handshake.in_progress())
+					finish_control_handshake(client_connection.get());
+			}
+		}
+
+		for (auto& data_channel : client_connection->data_channels())
+		{
+			if (!data_channel.tls.in_progress())
+				continue;
+
+			auto sock = data_channel.mode == e_data_channel_mode_active ? data_channel.sock : data_channel.data_sock;
+
+			if (FD_ISSET(sock, read_set) || FD_ISSET(sock, write_set))
+				tls_handshake(sock, data_channel.tls);
+		}
+	}
+
+	// transfers whose data connections are secured (or failed to be)
+	check_deferred_commands();
+}
+
+
+void ftp_server_c::finish_control_handshake(ftp_client_connection_c* client_connection)
+{
+	auto& handshake = client_connection->control_handshake();
+
+	auto session = handshake.session;
+	handshake.session.reset();
+
+	SOCKET command_socket = client_connection->command_socket();
+
+	if (handshake.state != tls_tools::e_handshake_done)
+	{
+		// state of the connection is unknown, server loop drops it on next recv
+#ifdef WIN32
+		shutdown(command_socket, SD_BOTH);
+#else
+		shutdown(command_socket, SHUT_RDWR);
+#endif
+		return;
+	}
+
+	client_connection->set_control_tls(session);
+
+	ESP_LOGI(TAG, "Control connection secured (sock: %d, %s, %s)",
+		command_socket,
+		session->protocol_name(),
+		session->cipher_name());
+}
+
+
+bool ftp_server_c::secure_data_connection(ftp_client_connection_c* client_connection)
+{
+	if (!client_connection->data_protection() || client_connection->persistent_data_socket())
+		return false;
+
+	auto& data_channels = client_connection->data_channels();
+	if (data_channels.empty())
+		return false;
+
+	// handshake runs on the connection open_data_connection() takes, its channel goes first
+	SOCKET sock = 0;
+
+	if (data_channels.front().mode == e_data_channel_mode_active)
+	{
+		if (!data_channels.front().connect_pending)
+			sock = data_channels.front().sock;
+	}
+	else if (front_accepted_connection(client_connection))
+	{
+		sock = data_channels.front().data_sock;
+	}
+
+	// nothing to secure, the transfer gets 425
+	if (!sock)
+		return false;
+
+	auto& handshake = data_channels.front().tls;
+
+	if (!handshake.session)
+	{
+		// client is the TLS client of data connection as well (RFC 4217),
+		// it starts the handshake when it gets the reply
+		handshake.session = std::make_shared<tls_tools::tls_session_c>(*m_tls_context, (int)sock, true);
+		handshake.state = tls_tools::e_handshake_want_read;
+		handshake.deadline = time(NULL) + TLS_HANDSHAKE_TIMEOUT_SEC;
+
+		set_socket_blocking(sock, false);
+	}
+
+	if (!handshake.in_progress())
+		return false;
+
+	if (client_connection->transfer_replied())
+	{
+		// command waited as long as a data channel may, it gets 425
+		handshake.state = tls_tools::e_handshake_failed;
+		return false;
+	}
+
+	client_connection->set_awaiting_data_tls(true);
+
+	return true;
+}
+#endif
+
+
+bool ftp_server_c::send_system_error(ftp_client_connection_c* client_connection)
+{
+	char buf[200];
+#ifdef WIN32
+	sprintf(buf, "550 %s\r\n", sys_errlist[errno]);
+#else
+	sprintf(buf, "550 %s\r\n", strerror(errno));
+#endif
+
+	return send_to_client(client_connection, buf);
+}
+
+
+bool ftp_server_c::send_transfer_starting(ftp_client_connection_c* client_connection,
+	const char* opening_reply)
+{
+	bool reply_sent = false;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// command runs again after the handshake of its data connection
+	reply_sent = client_connection->transfer_replied();
+#endif
+
+	if (!reply_sent)
+	{
+		if (client_connection->persistent_data_socket())
+		{
+			send_to_client(client_connection, "125 Data connection already open; transfer starting\r\n");
+		}
+		else
+		{
+			send_to_client(client_connection, opening_reply);
+		}
+	}
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	if (secure_data_connection(client_connection))
+		return false;
+#endif
+
+	return true;
+}
+
+
+bool ftp_server_c::begin_data_transfer(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer, SOCKET data_sock, bool compressible)
+{
+	transfer.sock = data_sock;
+	transfer.transmission_mode = client_connection->transmission_mode();
+
+	transfer.data_type = client_connection->data_transfer_mode();
+	transfer.ascii_cr_state = false;
+
+	// counted from REST offset, so restart markers are file offsets
+	transfer.bytes_transferred = client_connection->restart_offset();
+	transfer.next_restart_marker = transfer.bytes_transferred + m_block_restart_marker_interval;
+
+	transfer.block_bytes_left = 0;
+	transfer.block_descriptor = 0;
+	transfer.eof = false;
+
+	// tuned before the first chunk
+	transfer.chunk_size = TRANSFER_CHUNK_DEFAULT_SIZE;
+	transfer.next_chunk_tune = transfer.bytes_transferred;
+
+	transfer.rtt_us = 0;
+	transfer.window_bytes = 0;
+	transfer.pacing_rate = 0;
+
+#ifdef FTPSERVER_WITH_ZLIB
+	if (transfer.transmission_mode == e_transmission_mode_deflate)
+	{
+		if (!m_deflate_workers)
+		{
+			m_deflate_workers = std::make_shared<worker_pool_c>();
+		}
+
+		transfer.deflater = std::make_shared<deflate_tools::block_deflater_c>
+		(
+			m_deflate_workers,
+			compressible ? client_connection->deflate_level() : 0
+		);
+
+		transfer.inflater = std::make_shared<deflate_tools::inflater_c>();
+	}
+#else
+	(void)compressible;
+#endif
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	transfer.tls.reset();
+
+	if (client_connection->data_protection())
+	{
+		// handshake was done by the server loop (see secure_data_connection())
+		auto handshake = client_connection->take_data_tls();
+
+		if (!handshake.session || handshake.state != tls_tools::e_handshake_done)
+			return false;
+
+		auto& session = handshake.session;
+
+		// handshake ran on non-blocking socket, transfer loops expect blocking one
+		set_socket_blocking(data_sock, true);
+
+		ESP_LOGD(TAG, "Data connection secured (sock: %d, %s, %s, kernel tls: %s)",
+			client_connection->command_socket(),
+			session->protocol_name(),
+			session->cipher_name(),
+			session->kernel_send() ? "yes" : "no");
+
+		transfer.tls = session;
+	}
+#endif
+
+	start_transfer_statistics(client_connection, transfer);
+
+	return true;
+}
+
+
+bool ftp_server_c::send_data_block(data_transfer_s& transfer, uint8_t descriptor,
+	const char* data, size_t data_size)
+{
+	uint8_t header[3] =
+	{
+		descriptor,
+		(uint8_t)(data_size >> 8),
+		(uint8_t)(data_size & 0xff)
+	};
+
+	if (!send_to_data_connection(transfer, (const char*)header, sizeof(header)))
+		return false;
+
+	return data_size == 0 || send_to_data_connection(transfer, data, data_size);
+}
+
+
+void ftp_server_c::tune_transfer_chunk_size(data_transfer_s& transfer, bool upload)
+{
+#if defined(__linux__)
+	struct tcp_info info;
+	memset(&info, 0, sizeof(info));
+
+	socklen_t info_sz = sizeof(info);
+	if (getsockopt(transfer.sock, IPPROTO_TCP, TCP_INFO, &info, &info_sz) == 0)
+	{
+		uint64_t chunk_sz = 0;
+
+		if (upload)
+		{
+			transfer.rtt_us = info.tcpi_rcv_rtt;
+			transfer.window_bytes = info.tcpi_rcv_space;
+
+			// room for what the peer may send before it hears from us
+			chunk_sz = (uint64_t)info.tcpi_rcv_space * 2;
+		}
+		else
+		{
+			transfer.rtt_us = info.tcpi_rtt;
+			transfer.window_bytes = info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+
+			// older kernels do not fill pacing rate in, ~0 means "not paced"
+			bool paced = info_sz >= offsetof(struct tcp_info, tcpi_pacing_rate) + sizeof(info.tcpi_pacing_rate)
+				&& info.tcpi_pacing_rate != ~0ULL;
+			transfer.pacing_rate = paced ? info.tcpi_pacing_rate : 0;
+
+			// bandwidth-delay product: one window in flight, one queued behind it
+			uint64_t window = transfer.window_bytes;
+			uint64_t paced_window = transfer.pacing_rate * transfer.rtt_us / 1000000;
+			if (paced_window > window)
+				window = paced_window;
+
+			chunk_sz = window * 2;
+
+			if (info.tcpi_retransmits || info.tcpi_lost || info.tcpi_backoff)
+			{
+				// lossy peer: send less ahead of it, however big the window was
+				if (chunk_sz > transfer.chunk_size / 2)
+					chunk_sz = transfer.chunk_size / 2;
+			}
+			else if ((uint64_t)info.tcpi_unacked * 2 < info.tcpi_snd_cwnd)
+			{
+				// window is not filled, bigger chunks keep the pipe busy
+				if (chunk_sz < (uint64_t)transfer.chunk_size * 2)
+					chunk_sz = (uint64_t)transfer.chunk_size * 2;
+			}
+		}
+
+		if (chunk_sz < TRANSFER_CHUNK_MIN_SIZE)
+			chunk_sz = TRANSFER_CHUNK_MIN_SIZE;
+		else if (chunk_sz > TRANSFER_CHUNK_MAX_SIZE)
+			chunk_sz = TRANSFER_CHUNK_MAX_SIZE;
+
+		// whole pages
+		transfer.chunk_size = (size_t)((chunk_sz + 4095) & ~(uint64_t)4095);
+	}
+#endif
+
+	transfer.next_chunk_tune = transfer.bytes_transferred
+		+ (uint64_t)transfer.chunk_size * TRANSFER_CHUNKS_PER_TUNE;
+
+	update_transfer_statistics(transfer, upload);
+}
+
+
+void ftp_server_c::start_transfer_statistics(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer)
+{
+	auto statistics = new transfer_statistics_s();
+	{
+		statistics->command_socket = client_connection->command_socket();
+		statistics->user_name = client_connection->user_name();
+		statistics->upload = false;
+		statistics->active = true;
+		statistics->start_time = time(NULL);
+		statistics->bytes_transferred = transfer.bytes_transferred;
+		statistics->chunk_size = transfer.chunk_size;
+		statistics->rtt_us = 0;
+		statistics->window_bytes = 0;
+		statistics->pacing_rate = 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_transfers_statistics_mutex);
+
+		m_active_transfers_statistics.push_back(statistics);
+	}
+
+	// background transfer keeps a copy of the transfer, the sample ends with the last one
+	transfer.statistics.reset(statistics, [this](transfer_statistics_s* statistics)
+	{
+		end_transfer_statistics(statistics);
+	});
+}
+
+
+void ftp_server_c::update_transfer_statistics(const data_transfer_s& transfer, bool upload)
+{
+	if (!transfer.statistics)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_transfers_statistics_mutex);
+
+	auto& statistics = *transfer.statistics;
+	{
+		statistics.upload = upload;
+		statistics.bytes_transferred = transfer.bytes_transferred;
+		statistics.chunk_size = transfer.chunk_size;
+		statistics.rtt_us = transfer.rtt_us;
+		statistics.window_bytes = transfer.window_bytes;
+		statistics.pacing_rate = transfer.pacing_rate;
+	}
+}
+
+
+void ftp_server_c::end_transfer_statistics(transfer_statistics_s* statistics)
+{
+	std::lock_guard<std::mutex> lock(m_transfers_statistics_mutex);
+
+	auto it = std::find(m_active_transfers_statistics.begin(), m_active_transfers_statistics.end(), statistics);
+	if (it != m_active_transfers_statistics.end())
+	{
+		m_active_transfers_statistics.erase(it);
+	}
+
+	statistics->active = false;
+
+	m_recent_transfers_statistics.push_front(*statistics);
+
+	if (m_recent_transfers_statistics.size() > RECENT_TRANSFERS_STATISTICS_COUNT)
+		m_recent_transfers_statistics.pop_back();
+
+	delete statistics;
+}
+
+
+std::vector<transfer_statistics_s> ftp_server_c::transfer_statistics()
+{
+	std::lock_guard<std::mutex> lock(m_transfers_statistics_mutex);
+
+	std::vector<transfer_statistics_s> statistics;
+	statistics.reserve(m_active_transfers_statistics.size() + m_recent_transfers_statistics.size());
+
+	for (auto active_statistics : m_active_transfers_statistics)
+	{
+		statistics.push_back(*active_statistics);
+	}
+
+	statistics.insert(statistics.end(),
+		m_recent_transfers_statistics.begin(), m_recent_transfers_statistics.end());
+
+	return statistics;
+}
+
+
+// buffer follows the chunk size, shrinking releases the memory
+static void resize_chunk_buffer(std::vector<char>& buf, size_t size)
+{
+	if (buf.size() != size)
+	{
+		std::vector<char>(size).swap(buf);
+	}
+}
+
+
+bool ftp_server_c::send_transfer_data(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer, const char* data, size_t data_size)
+{
+	// file bytes are charged, not the converted or compressed ones
+	wait_transfer_rate(client_connection);
+	consume_transfer_rate(client_connection, data_size);
+
+	if (transfer.data_type == e_data_transfer_mode_ascii)
+	{
+		// network form of text is CRLF
+		transfer.ascii_buf.resize(data_size * 2);
+
+		data_size = ascii_tools::lf_to_crlf(data, data_size,
+			transfer.ascii_buf.data(), transfer.ascii_cr_state);
+		data = transfer.ascii_buf.data();
+	}
+
+	if (transfer.transmission_mode == e_transmission_mode_stream)
+	{
+		if (!send_to_data_connection(transfer, data, data_size))
+			return false;
+
+		transfer.bytes_transferred += data_size;
+
+		return true;
+	}
+
+#ifdef FTPSERVER_WITH_ZLIB
+	if (transfer.transmission_mode == e_transmission_mode_deflate)
+	{
+		auto& deflater = *transfer.deflater;
+
+		if (!deflater.write(data, data_size))
+			return false;
+
+		transfer.bytes_transferred += data_size;
+
+		// sent from the command handler (LIST), workers are waited for only
+		// when they are behind by too much
+		transfer.compressed_buf.clear();
+
+		if (!deflater.collect(transfer.compressed_buf, !deflater.can_write()))
+			return false;
+
+		return transfer.compressed_buf.empty()
+			|| send_to_data_connection(transfer, transfer.compressed_buf.data(), transfer.compressed_buf.size());
+	}
+#endif
+
+	// headers go out in the same segments as the payload
+	bool cork = m_socket_profiles[e_socket_profile_data].cork;
+	if (cork)
+		set_socket_cork(transfer.sock, true);
+
+	bool ok = true;
+
+	while (data_size > 0)
+	{
+		size_t block_sz = data_size > 0xffff ? 0xffff : data_size;
+
+		if (m_block_restart_marker_interval)
+		{
+			if (transfer.bytes_transferred >= transfer.next_restart_marker)
+			{
+				// marker is the offset, so it can be passed to REST as is
+				char marker[24];
+				int marker_sz = sprintf(marker, "%llu",
+					(unsigned long long)transfer.bytes_transferred);
+
+				if (!send_data_block(transfer, e_block_descriptor_restart_marker, marker, marker_sz))
+				{
+					ok = false;
+					break;
+				}
+
+				transfer.next_restart_marker = transfer.bytes_transferred + m_block_restart_marker_interval;
+			}
+
+			// block must end exactly at the next marker
+			uint64_t bytes_to_marker = transfer.next_restart_marker - transfer.bytes_transferred;
+			if (block_sz > bytes_to_marker)
+				block_sz = (size_t)bytes_to_marker;
+		}
+
+		if (!send_data_block(transfer, 0, data, block_sz))
+		{
+			ok = false;
+			break;
+		}
+
+		transfer.bytes_transferred += block_sz;
+
+		data += block_sz;
+		data_size -= block_sz;
+	}
+
+	if (cork)
+		set_socket_cork(transfer.sock, false);
+
+	return ok;
+}
+
+
+bool ftp_server_c::finish_data_transfer(data_transfer_s& transfer)
+{
+	update_transfer_statistics(transfer, false);
+
+	if (transfer.transmission_mode == e_transmission_mode_stream)
+	{
+		// closing of data connection is the end of file
+		return true;
+	}
+
+#ifdef FTPSERVER_WITH_ZLIB
+	if (transfer.transmission_mode == e_transmission_mode_deflate)
+	{
+		transfer.compressed_buf.clear();
+
+		if (!transfer.deflater->finish() || !transfer.deflater->collect(transfer.compressed_buf, true))
+			return false;
+
+		return send_to_data_connection(transfer, transfer.compressed_buf.data(), transfer.compressed_buf.size());
+	}
+#endif
+
+	return send_data_block(transfer, e_block_descriptor_eof, nullptr, 0);
+}
+
+
+bool ftp_server_c::send_transfer_file(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer, FILE* file, uint64_t offset, uint64_t file_size)
+{
+#if defined(__linux__)
+	// kernel copies the file straight to the socket (and encrypts it with kTLS)
+	if (transfer.transmission_mode == e_transmission_mode_stream
+		&& transfer.data_type == e_data_transfer_mode_binary
+		&& direct_socket_send(transfer))
+	{
+		off_t file_offset = (off_t)offset;
+
+		while ((uint64_t)file_offset < file_size)
+		{
+			uint64_t left = file_size - (uint64_t)file_offset;
+
+			wait_transfer_rate(client_connection);
+
+			auto sent = sendfile(transfer.sock, fileno(file), &file_offset,
+				left > 0x40000000 ? 0x40000000 : (size_t)left);
+
+			if (sent < 0 && errno == EINTR)
+				continue;
+
+			if (sent < 0)
+				return false;
+
+			// file was truncated meanwhile
+			if (sent == 0)
+				break;
+
+			transfer.bytes_transferred += sent;
+
+			consume_transfer_rate(client_connection, (size_t)sent);
+		}
+
+		return true;
+	}
+#endif
+
+	if (offset && !seek_file(file, offset))
+		return false;
+
+#if defined(WIN32) || defined(__linux__)
+	std::vector<char> dynamic_buf;
+#else	// ESP32
+	char buf[256];
+	size_t buf_sz = sizeof(buf);
+#endif
+
+	while (true)
+	{
+#if defined(WIN32) || defined(__linux__)
+		if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+		{
+			tune_transfer_chunk_size(transfer, false);
+		}
+
+		resize_chunk_buffer(dynamic_buf, transfer.chunk_size);
+
+		char* buf = dynamic_buf.data();
+		size_t buf_sz = dynamic_buf.size();
+#endif
+
+		auto data_sz = fread(buf, 1, buf_sz, file);
+
+		if (data_sz == 0)
+			return !ferror(file);
+
+		if (!send_transfer_data(client_connection, transfer, buf, data_sz))
+		{
+			printf("Failed to send data to sock %d\n",
+				(int)transfer.sock);
+
+			return false;
+		}
+	}
+}
+
+
+int ftp_server_c::recv_transfer_data(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer, char* buf, size_t buf_sz)
+{
+	wait_transfer_rate(client_connection);
+
+	if (transfer.data_type != e_data_transfer_mode_ascii)
+	{
+		int received = recv_transfer_payload(client_connection, transfer, buf, buf_sz);
+
+		if (received > 0)
+			consume_transfer_rate(client_connection, (size_t)received);
+
+		return received;
+	}
+
+	while (true)
+	{
+		// first byte is kept for CR of the previous chunk
+		int received = recv_transfer_payload(client_connection, transfer, buf + 1, buf_sz - 1);
+
+		if (received < 0)
+			return received;
+
+		consume_transfer_rate(client_connection, (size_t)received);
+
+		if (received == 0)
+		{
+			if (!transfer.ascii_cr_state)
+				return 0;
+
+			// lone CR at the end of file
+			transfer.ascii_cr_state = false;
+			buf[0] = '\r';
+
+			return 1;
+		}
+
+		size_t converted = ascii_tools::crlf_to_lf(buf + 1, received, buf, transfer.ascii_cr_state);
+
+		// chunk of a single CR is decided by the next one
+		if (converted > 0)
+			return (int)converted;
+	}
+}
+
+
+int ftp_server_c::recv_transfer_payload(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer, char* buf, size_t buf_sz)
+{
+	if (transfer.transmission_mode == e_transmission_mode_stream)
+	{
+		int received = recv_data_chunk(transfer, buf, buf_sz);
+
+		if (received > 0)
+			transfer.bytes_transferred += received;
+
+		return received;
+	}
+
+#ifdef FTPSERVER_WITH_ZLIB
+	if (transfer.transmission_mode == e_transmission_mode_deflate)
+	{
+		auto& inflater = *transfer.inflater;
+
+		if (!inflater.initialized())
+			return -1;
+
+		while (!inflater.finished())
+		{
+			if (!inflater.has_input())
+			{
+				int received = recv_data_chunk(transfer,
+					inflater.input_buffer(), inflater.input_buffer_size());
+
+				// connection closed in the middle of compressed stream
+				if (received <= 0)
+					return -1;
+
+				inflater.input_ready(received);
+			}
+
+			int inflated = inflater.inflate(buf, buf_sz);
+			if (inflated < 0)
+				return -1;
+
+			if (inflated > 0)
+			{
+				transfer.bytes_transferred += inflated;
+				return inflated;
+			}
+		}
+
+		return 0;
+	}
+#endif
+
+	while (true)
+	{
+		if (transfer.eof)
+			return 0;
+
+		if (transfer.block_bytes_left == 0)
+		{
+			// previous block was the last one
+			if (transfer.block_descriptor & e_block_descriptor_eof)
+			{
+				transfer.eof = true;
+				continue;
+			}
+
+			uint8_t header[3];
+			if (!recv_data_exact(transfer, (char*)header, sizeof(header)))
+				return -1;	// connection closed before EOF block
+
+			transfer.block_descriptor = header[0];
+			transfer.block_bytes_left = ((uint32_t)header[1] << 8) | header[2];
+
+			if (transfer.block_descriptor & e_block_descriptor_restart_marker)
+			{
+				char marker[64];
+				size_t marker_sz = transfer.block_bytes_left < sizeof(marker) - 1 ?
+					transfer.block_bytes_left : sizeof(marker) - 1;
+
+				if (!recv_data_exact(transfer, marker, marker_sz))
+					return -1;
+
+				transfer.block_bytes_left -= (uint32_t)marker_sz;
+
+				// markers are short, the tail of a too long one is dropped
+				while (transfer.block_bytes_left > 0)
+				{
+					char tail[64];
+					size_t tail_sz = transfer.block_bytes_left < sizeof(tail) ?
+						transfer.block_bytes_left : sizeof(tail);
+
+					if (!recv_data_exact(transfer, tail, tail_sz))
+						return -1;
+
+					transfer.block_bytes_left -= (uint32_t)tail_sz;
+				}
+
+				marker[marker_sz] = 0;
+
+				// let the sender know where to restart from
+				char reply[128];
+				snprintf(reply, sizeof(reply), "110 MARK %s = %llu\r\n",
+					marker, (unsigned long long)transfer.bytes_transferred);
+
+				send_to_client(client_connection, reply);
+			}
+
+			continue;
+		}
+
+		size_t chunk_sz = buf_sz < transfer.block_bytes_left ?
+			buf_sz : transfer.block_bytes_left;
+
+		int received = recv_data_chunk(transfer, buf, chunk_sz);
+		if (received <= 0)
+			return -1;
+
+		transfer.block_bytes_left -= received;
+		transfer.bytes_transferred += received;
+
+		return received;
+	}
+}
+
+
+bool ftp_server_c::keep_data_connection(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer)
+{
+	if (transfer.transmission_mode != e_transmission_mode_block)
+		return false;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// TLS session ends with the transfer, next one handshakes on a new connection
+	if (transfer.tls)
+		return false;
+#endif
+
+	client_connection->assign_persistent_data_socket(transfer.sock);
+
+	return true;
+}
+
+
+void ftp_server_c::start_background_transfer(ftp_client_connection_c* client_connection,
+	const background_transfer_t& background_transfer)
+{
+	set_socket_blocking(background_transfer->transfer.sock, false);
+
+	// buffer is allocated by the first chunk, sendfile() does not need it at all
+
+	client_connection->background_transfers().push_back(background_transfer);
+}
+
+
+void ftp_server_c::prepare_background_transfers_fds(fd_set* read_set, fd_set* write_set, SOCKET& max_sd,
+	struct timeval& timeout)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		if (client_connection->background_transfers().empty())
+			continue;
+
+		// rate limits are checked once per round, a transfer let in moves its
+		// whole quantum, so the first one of the round does not eat the tokens
+		// of a shared (user or global) limit and starve the others
+		if (!transfer_rate_available(client_connection.get()))
+		{
+			// wake up when the session may send again
+			uint32_t wait_us = transfer_rate_wait_time(client_connection.get());
+
+			if ((uint64_t)wait_us < (uint64_t)timeout.tv_sec * 1000000 + timeout.tv_usec)
+			{
+				timeout.tv_sec = wait_us / 1000000;
+				timeout.tv_usec = wait_us % 1000000;
+			}
+
+			continue;
+		}
+
+		for (auto& background_transfer : client_connection->background_transfers())
+		{
+			auto sock = background_transfer->transfer.sock;
+
+#ifdef FTPSERVER_WITH_ZLIB
+			if (background_transfer->compression_wait
+				&& !background_transfer->transfer.deflater->output_ready())
+			{
+				// writable socket would wake the loop at once
+				if ((uint64_t)DEFLATE_POLL_INTERVAL_US < (uint64_t)timeout.tv_sec * 1000000 + timeout.tv_usec)
+				{
+					timeout.tv_sec = 0;
+					timeout.tv_usec = DEFLATE_POLL_INTERVAL_US;
+				}
+
+				continue;
+			}
+#endif
+
+			FD_SET(sock, background_transfer->upload ? read_set : write_set);
+
+			if (sock > max_sd)
+				max_sd = sock;
+		}
+	}
+}
+
+
+void ftp_server_c::handle_background_transfers_fds(fd_set* read_set, fd_set* write_set)
+{
+	for (auto& client_connection : m_client_connections)
+	{
+		auto& background_transfers = client_connection->background_transfers();
+
+		int64_t quantum = (int64_t)BACKGROUND_TRANSFER_QUANTUM * client_connection->transfer_weight();
+
+		auto it = background_transfers.begin();
+		while (it != background_transfers.end())
+		{
+			auto& background_transfer = *it;
+			auto sock = background_transfer->transfer.sock;
+
+			bool ready = background_transfer->upload ?
+				FD_ISSET(sock, read_set) : FD_ISSET(sock, write_set);
+
+			if (!ready)
+			{
+				++it;
+				continue;
+			}
+
+			bool keep_going = true;
+
+			background_transfer->deficit += quantum;
+
+			if (background_transfer->upload)
+			{
+				keep_going = continue_background_upload(client_connection.get(), *background_transfer);
+			}
+			else
+			{
+				keep_going = continue_background_transfer(client_connection.get(), *background_transfer);
+			}
+
+			// transfer which stopped before its quantum ran out (socket is full
+			// or empty, rate limit) does not save the rest up, debt is kept
+			if (background_transfer->deficit > 0)
+				background_transfer->deficit = 0;
+
+			if (!keep_going)
+			{
+				finish_background_transfer(client_connection.get(), *background_transfer);
+
+				// closes data connection, end of file in stream mode
+				it = background_transfers.erase(it);
+
+				continue;
+			}
+
+			++it;
+		}
+	}
+}
+
+
+bool ftp_server_c::continue_background_transfer(ftp_client_connection_c* client_connection,
+	background_transfer_s& background_transfer)
+{
+	auto& transfer = background_transfer.transfer;
+
+#ifdef FTPSERVER_WITH_ZLIB
+	if (transfer.transmission_mode == e_transmission_mode_deflate)
+		return continue_background_deflate(client_connection, background_transfer);
+#endif
+
+	while (background_transfer.deficit > 0)
+	{
+		if (background_transfer.pending_size == 0)
+		{
+			if (background_transfer.file_offset >= background_transfer.file_end)
+				return false;
+
+			if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+			{
+				tune_transfer_chunk_size(transfer, false);
+			}
+
+			uint64_t left = background_transfer.file_end - background_transfer.file_offset;
+			if (left > (uint64_t)background_transfer.deficit)
+				left = (uint64_t)background_transfer.deficit;
+
+			size_t chunk_sz = left > transfer.chunk_size ?
+				transfer.chunk_size : (size_t)left;
+
+#if defined(__linux__)
+			if (transfer.data_type == e_data_transfer_mode_binary && direct_socket_send(transfer))
+			{
+				off_t file_offset = (off_t)background_transfer.file_offset;
+
+				auto sent = sendfile(transfer.sock, fileno(background_transfer.file), &file_offset, chunk_sz);
+
+				if (sent < 0)
+					return socket_would_block();
+
+				// file was truncated meanwhile
+				if (sent == 0)
+					background_transfer.file_end = background_transfer.file_offset;
+
+				background_transfer.file_offset += sent;
+				transfer.bytes_transferred += sent;
+
+				background_transfer.deficit -= sent;
+
+				consume_transfer_rate(client_connection, (size_t)sent);
+
+				continue;
+			}
+#endif
+
+			resize_chunk_buffer(background_transfer.buf, transfer.chunk_size);
+
+			auto read_sz = read_file_at(background_transfer.file, background_transfer.file_offset,
+				background_transfer.buf.data(), chunk_sz);
+
+			if (read_sz < 0)
+				return false;
+
+			if (read_sz == 0)
+			{
+				background_transfer.file_end = background_transfer.file_offset;
+				return false;
+			}
+
+			background_transfer.file_offset += read_sz;
+
+			// file bytes are charged, not the converted ones
+			consume_transfer_rate(client_connection, (size_t)read_sz);
+
+			background_transfer.pending_data = background_transfer.buf.data();
+			background_transfer.pending_size = (size_t)read_sz;
+
+			if (transfer.data_type == e_data_transfer_mode_ascii)
+			{
+				transfer.ascii_buf.resize((size_t)read_sz * 2);
+
+				background_transfer.pending_size = ascii_tools::lf_to_crlf(
+					background_transfer.buf.data(), (size_t)read_sz,
+					transfer.ascii_buf.data(), transfer.ascii_cr_state);
+				background_transfer.pending_data = transfer.ascii_buf.data();
+			}
+		}
+
+		int sent = send_data_chunk(transfer, background_transfer.pending_data, background_transfer.pending_size);
+
+		if (sent < 0)
+			return socket_would_block();
+
+		background_transfer.pending_data += sent;
+		background_transfer.pending_size -= sent;
+
+		transfer.bytes_transferred += sent;
+
+		// TYPE A may send more than was read, the debt is paid next round
+		background_transfer.deficit -= sent;
+	}
+
+	return true;
+}
+
+
+bool ftp_server_c::continue_background_upload(ftp_client_connection_c* client_connection,
+	background_transfer_s& background_transfer)
+{
+	auto& transfer = background_transfer.transfer;
+
+	while (background_transfer.deficit > 0)
+	{
+		if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+		{
+			tune_transfer_chunk_size(transfer, true);
+		}
+
+		resize_chunk_buffer(background_transfer.buf, transfer.chunk_size);
+
+		size_t chunk_sz = (uint64_t)background_transfer.deficit < background_transfer.buf.size() ?
+			(size_t)background_transfer.deficit : background_transfer.buf.size();
+
+		int received = recv_data_chunk(transfer, background_transfer.buf.data(), chunk_sz);
+
+		if (received == 0)
+		{
+			// closing of data connection is the end of file
+			transfer.eof = true;
+			return false;
+		}
+
+		if (received < 0)
+			return socket_would_block();
+
+		if (!write_file_at(background_transfer.file, background_transfer.file_offset,
+			background_transfer.buf.data(), (size_t)received))
+		{
+			ESP_LOGE(TAG, "Failed to write uploaded data (sock: %d, err: %s)",
+				client_connection->command_socket(), strerror(errno));
+
+			return false;
+		}
+
+		background_transfer.file_offset += received;
+		transfer.bytes_transferred += received;
+
+		background_transfer.deficit -= received;
+
+		consume_transfer_rate(client_connection, (size_t)received);
+	}
+
+	return true;
+}
+
+
+#ifdef FTPSERVER_WITH_ZLIB
+bool ftp_server_c::continue_background_deflate(ftp_client_connection_c* client_connection,
+	background_transfer_s& background_transfer)
+{
+	auto& transfer = background_transfer.transfer;
+	auto& deflater = *transfer.deflater;
+
+	background_transfer.compression_wait = false;
+
+	while (background_transfer.deficit > 0)
+	{
+		if (background_transfer.pending_size == 0)
+		{
+			transfer.compressed_buf.clear();
+
+			if (!deflater.collect(transfer.compressed_buf, false))
+				return false;
+
+			if (!transfer.compressed_buf.empty())
+			{
+				background_transfer.pending_data = transfer.compressed_buf.data();
+				background_transfer.pending_size = transfer.compressed_buf.size();
+			}
+			else if (deflater.finished())
+			{
+				return false;
+			}
+			else if (!deflater.can_write() || deflater.finishing())
+			{
+				// workers are busy, the loop comes back when a batch is done
+				background_transfer.compression_wait = true;
+				return true;
+			}
+			else if (background_transfer.file_offset >= background_transfer.file_end)
+			{
+				if (!deflater.finish())
+					return false;
+
+				continue;
+			}
+			else
+			{
+				uint64_t left = background_transfer.file_end - background_transfer.file_offset;
+
+				size_t chunk_sz = left > transfer.chunk_size ?
+					transfer.chunk_size : (size_t)left;
+
+				resize_chunk_buffer(background_transfer.buf, transfer.chunk_size);
+
+				auto read_sz = read_file_at(background_transfer.file, background_transfer.file_offset,
+					background_transfer.buf.data(), chunk_sz);
+
+				if (read_sz < 0)
+					return false;
+
+				if (read_sz == 0)
+				{
+					// file was truncated meanwhile
+					background_transfer.file_end = background_transfer.file_offset;
+					continue;
+				}
+
+				background_transfer.file_offset += read_sz;
+
+				// file bytes are charged, not the compressed ones
+				consume_transfer_rate(client_connection, (size_t)read_sz);
+
+				const char* data = background_transfer.buf.data();
+				size_t data_size = (size_t)read_sz;
+
+				if (transfer.data_type == e_data_transfer_mode_ascii)
+				{
+					transfer.ascii_buf.resize((size_t)read_sz * 2);
+
+					data_size = ascii_tools::lf_to_crlf(background_transfer.buf.data(), (size_t)read_sz,
+						transfer.ascii_buf.data(), transfer.ascii_cr_state);
+					data = transfer.ascii_buf.data();
+				}
+
+				if (!deflater.write(data, data_size))
+					return false;
+
+				transfer.bytes_transferred += data_size;
+
+				// samples the connection for transfer_statistics() as well
+				if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+					tune_transfer_chunk_size(transfer, false);
+
+				continue;
+			}
+		}
+
+		int sent = send_data_chunk(transfer, background_transfer.pending_data, background_transfer.pending_size);
+
+		if (sent < 0)
+			return socket_would_block();
+
+		background_transfer.pending_data += sent;
+		background_transfer.pending_size -= sent;
+
+		// compressed bytes take the socket's share
+		background_transfer.deficit -= sent;
+	}
+
+	return true;
+}
+#endif
+
+
+bool ftp_server_c::complete_background_transfer(background_transfer_s& background_transfer)
+{
+	if (background_transfer.completed)
+		return false;
+
+	background_transfer.completed = true;
+
+	if (background_transfer.file)
+	{
+		fclose(background_transfer.file);
+		background_transfer.file = nullptr;
+	}
+
+	if (!background_transfer.upload)
+	{
+#ifdef FTPSERVER_WITH_ZLIB
+		// stream is complete with its trailer only
+		if (background_transfer.transfer.transmission_mode == e_transmission_mode_deflate
+			&& !background_transfer.transfer.deflater->finished())
+		{
+			return false;
+		}
+#endif
+
+		return background_transfer.pending_size == 0
+			&& background_transfer.file_offset >= background_transfer.file_end;
+	}
+
+	if (background_transfer.partial_upload)
+	{
+		// written part is valid even if the connection broke
+		complete_upload_range(background_transfer.partial_upload,
+			background_transfer.range_begin, background_transfer.file_offset);
+	}
+
+	invalidate_cached_path(background_transfer.file_path);
+
+	return background_transfer.transfer.eof;
+}
+
+
+ftp_server_c::user_profile_t ftp_server_c::find_user_profile(const std::string& user_name)
+{
+	std::lock_guard<std::mutex> lock(m_user_profiles_mutex);
+
+	// names come from clients, only the ones the owner configured have a profile
+	auto it = m_user_profiles.find(user_name);
+	if (it == m_user_profiles.end())
+		return m_default_user_profile;
+
+	return it->second;
+}
+
+
+ftp_server_c::user_profile_t ftp_server_c::configure_user_profile(const std::string& user_name)
+{
+	std::lock_guard<std::mutex> lock(m_user_profiles_mutex);
+
+	auto& user_profile = m_user_profiles[user_name];
+	if (!user_profile)
+	{
+		user_profile = std::make_shared<user_profile_s>();
+	}
+
+	return user_profile;
+}
+
+
+bool ftp_server_c::transfer_rate_available(ftp_client_connection_c* client_connection)
+{
+	auto user_rate_limiter = client_connection->user_rate_limiter();
+
+	return client_connection->rate_limiter().available()
+		&& (!user_rate_limiter || user_rate_limiter->available())
+		&& m_global_rate_limiter.available();
+}
+
+
+void ftp_server_c::consume_transfer_rate(ftp_client_connection_c* client_connection, size_t bytes)
+{
+	client_connection->rate_limiter().consume(bytes);
+
+	auto user_rate_limiter = client_connection->user_rate_limiter();
+	if (user_rate_limiter)
+	{
+		user_rate_limiter->consume(bytes);
+	}
+
+	m_global_rate_limiter.consume(bytes);
+}
+
+
+uint32_t ftp_server_c::transfer_rate_wait_time(ftp_client_connection_c* client_connection)
+{
+	uint32_t wait_us = client_connection->rate_limiter().wait_time_us();
+
+	auto user_rate_limiter = client_connection->user_rate_limiter();
+	if (user_rate_limiter)
+	{
+		uint32_t user_wait_us = user_rate_limiter->wait_time_us();
+		if (user_wait_us > wait_us)
+			wait_us = user_wait_us;
+	}
+
+	uint32_t global_wait_us = m_global_rate_limiter.wait_time_us();
+	if (global_wait_us > wait_us)
+		wait_us = global_wait_us;
+
+	return wait_us;
+}
+
+
+void ftp_server_c::wait_transfer_rate(ftp_client_connection_c* client_connection)
+{
+	while (!transfer_rate_available(client_connection))
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(
+			transfer_rate_wait_time(client_connection)));
+	}
+}
+
+
+ftp_server_c::partial_upload_t ftp_server_c::find_partial_upload(const std::string& target_path,
+	uint64_t allocation_size)
+{
+	check_partial_uploads_timeouts();
+
+	auto it = m_partial_uploads.find(target_path);
+	if (it != m_partial_uploads.end())
+	{
+		auto partial_upload = it->second;
+
+		if (allocation_size != 0 && allocation_size == partial_upload->expected_size)
+		{
+			partial_upload->last_activity = time(NULL);
+			return partial_upload;
+		}
+
+		// plain STOR or upload of another file to the same path
+		abandon_partial_upload(partial_upload);
+	}
+
+	if (allocation_size == 0)
+		return partial_upload_t();
+
+	auto partial_upload = std::make_shared<partial_upload_s>();
+	{
+		partial_upload->target_path = target_path;
+		partial_upload->part_path = target_path + ".part";
+		partial_upload->expected_size = allocation_size;
+		partial_upload->writers = 0;
+		partial_upload->last_activity = time(NULL);
+	}
+
+	m_partial_uploads[target_path] = partial_upload;
+
+	return partial_upload;
+}
+
+
+void ftp_server_c::abandon_partial_upload(const partial_upload_t& partial_upload)
+{
+	auto it = m_partial_uploads.find(partial_upload->target_path);
+	if (it != m_partial_uploads.end() && it->second == partial_upload)
+		m_partial_uploads.erase(it);
+
+	// writers still in progress finish into the part file, it is left to them
+	if (partial_upload->writers == 0)
+	{
+		remove(partial_upload->part_path.c_str());
+		invalidate_cached_path(partial_upload->part_path);
+	}
+
+	ESP_LOGI(TAG, "Ranged upload of %s is abandoned", partial_upload->target_path.c_str());
+}
+
+
+void ftp_server_c::check_partial_uploads_timeouts()
+{
+	if (m_partial_upload_timeout_sec == 0)
+		return;
+
+	auto now = time(NULL);
+
+	auto it = m_partial_uploads.begin();
+	while (it != m_partial_uploads.end())
+	{
+		auto partial_upload = (it++)->second;
+
+		if (partial_upload->writers == 0
+			&& now - partial_upload->last_activity >= (time_t)m_partial_upload_timeout_sec)
+		{
+			abandon_partial_upload(partial_upload);
+		}
+	}
+}
+
+
+void ftp_server_c::complete_upload_range(const partial_upload_t& partial_upload,
+	uint64_t range_begin, uint64_t range_end)
+{
+	if (range_end > partial_upload->expected_size)
+	{
+		// file turned out longer than ALLO said
+		partial_upload->expected_size = range_end;
+	}
+
+	partial_upload->ranges.add(range_begin, range_end);
+	partial_upload->last_activity = time(NULL);
+
+	if (partial_upload->writers > 0)
+		partial_upload->writers -= 1;
+
+	auto it = m_partial_uploads.find(partial_upload->target_path);
+	if (it == m_partial_uploads.end() || it->second != partial_upload)
+	{
+		// replaced by plain STOR or expired while this range was written
+		if (partial_upload->writers == 0 && it == m_partial_uploads.end())
+			remove(partial_upload->part_path.c_str());
+
+		return;
+	}
+
+	if (partial_upload->writers > 0
+		|| !partial_upload->ranges.covers(0, partial_upload->expected_size))
+	{
+		return;
+	}
+
+	if (replace_file(partial_upload->part_path, partial_upload->target_path))
+	{
+		ESP_LOGI(TAG, "Ranged upload of %s is complete (%llu bytes)",
+			partial_upload->target_path.c_str(),
+			(unsigned long long)partial_upload->expected_size);
+	}
+	else
+	{
+		ESP_LOGE(TAG, "Failed to publish %s (err: %s)",
+			partial_upload->target_path.c_str(), strerror(errno));
+	}
+
+	m_partial_uploads.erase(it);
+}
+
+
+void ftp_server_c::finish_background_transfer(ftp_client_connection_c* client_connection,
+	background_transfer_s& background_transfer)
+{
+	auto& transfer = background_transfer.transfer;
+
+	update_transfer_statistics(transfer, background_transfer.upload);
+
+	ESP_LOGD(TAG, "Transfer over (sock: %d, bytes: %llu, chunk: %u, rtt: %u us, window: %u, pacing: %llu B/s)",
+		client_connection->command_socket(),
+		(unsigned long long)transfer.bytes_transferred,
+		(unsigned)transfer.chunk_size,
+		(unsigned)transfer.rtt_us,
+		(unsigned)transfer.window_bytes,
+		(unsigned long long)transfer.pacing_rate);
+
+	if (complete_background_transfer(background_transfer))
+	{
+		send_to_client(client_connection, "226 Transfer Complete\r\n");
+	}
+	else
+	{
+		ESP_LOGE(TAG, "Background transfer failed (sock: %d, offset: %llu)",
+			client_connection->command_socket(),
+			(unsigned long long)background_transfer.file_offset);
+
+		send_to_client(client_connection, "426 Connection closed; transfer aborted\r\n");
+	}
+}
+
+
+void ftp_server_c::handle_control_data(ftp_client_connection_c* client_connection,
+	const char* data, size_t data_size)
+{
+	auto& command_buffer = client_connection->command_buffer();
+	command_buffer.append(data, data_size);
+
+	size_t line_begin = 0;
+
+	// deferred transfer command goes first, the rest waits for it
+	while (line_begin < command_buffer.size() && client_connection->deferred_command().empty())
+	{
+		size_t line_end = command_buffer.find('\n', line_begin);
+		if (line_end == std::string::npos)
+			break;
+
+		// handle_incoming_data takes "<command> [<value>]\r\n\0"
+		size_t text_end = line_end;
+		if (text_end > line_begin && command_buffer[text_end - 1] == '\r')
+			--text_end;
+
+		std::string line = command_buffer.substr(line_begin, text_end - line_begin);
+		line += "\r\n";
+
+		line_begin = line_end + 1;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		bool plain_control = !client_connection->control_tls();
+#endif
+
+		handle_incoming_data(client_connection, (uint8_t*)&line[0], line.size());
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		if (plain_control && client_connection->control_handshake().session)
+		{
+			// AUTH TLS: commands sent in clear text behind it must not run as protected ones
+			line_begin = command_buffer.size();
+			break;
+		}
+#endif
+	}
+
+	command_buffer.erase(0, line_begin);
+
+	if (command_buffer.size() > CONTROL_BUFFER_MAX_SIZE)
+	{
+		ESP_LOGE(TAG, "More than %d bytes of commands not handled (sock: %d), dropped",
+			CONTROL_BUFFER_MAX_SIZE, (int)client_connection->command_socket());
+
+		command_buffer.clear();
+
+		send_to_client(client_connection, "500 Command line too long\r\n");
+	}
+}
+
+
+void ftp_server_c::handle_incoming_data(ftp_client_connection_c* client_connection,
+	uint8_t* data, size_t data_size)
+{
+//#ifdef _DEBUG
+	printf("received command: %s\n", data);
+//#endif
+
+	uint8_t* str_ptr = data;
+
+	std::string command_name;
+	std::string command_value;
+
+	bool single_command = false;
+
+	// read command tag
+	{
+		uint8_t* str_begin = data;
+		while (*str_ptr)
+		{
+			if (!*str_ptr || *str_ptr == ' ')
+			{
+				command_name = std::string(str_begin, str_ptr);
+				++str_ptr;
+				break;
+			}
+
+			if (*str_ptr == '\r')
+			{
+				single_command = true;
+
+				command_name = std::string(str_begin, str_ptr);
+				break;
+			}
+
+			++str_ptr;
+		}
+	}
+
+	// commands are case insensitive
+	for (auto& c : command_name)
+	{
+		c = (char)::toupper((unsigned char)c);
+	}
+
+	// read command value
+	if (!single_command)
+	{
+		uint8_t* str_begin = str_ptr;
+		while (*str_ptr)
+		{
+			if (!*str_ptr || *str_ptr == '\r')
+			{
+				command_value = std::string(str_begin, str_ptr);
+				++str_ptr;
+				break;
+			}
+
+			++str_ptr;
+		}
+	}
+
+	auto command = determine_command(command_name);
+
+	if (is_transfer_command(command) && !data_connection_ready(client_connection))
+	{
+		// server loop runs it again when the connection is there, REST and ALLO are kept for it
+		client_connection->defer_command(std::string((const char*)data));
+		return;
+	}
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// transfer runs again after the handshake of its data connection
+	client_connection->set_transfer_replied(client_connection->awaiting_data_tls());
+	client_connection->set_awaiting_data_tls(false);
+#endif
+
+	handle_command
+	(
+		client_connection,
+		command,
+		command_value
+	);
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	client_connection->set_transfer_replied(false);
+
+	if (client_connection->awaiting_data_tls())
+	{
+		// transfer has replied, it goes on when its data connection is secured
+		client_connection->defer_command(std::string((const char*)data));
+		return;
+	}
+#endif
+
+	// REST and ALLO apply to the next transfer command only,
+	// data channel may be prepared between them and the transfer
+	switch (command)
+	{
+	case e_ftpcmd_rest:
+	case e_ftpcmd_allo:
+	case e_ftpcmd_pasv:
+	case e_ftpcmd_epsv:
+	case e_ftpcmd_port:
+	case e_ftpcmd_eprt:
+		break;
+	default:
+		client_connection->set_restart_offset(0);
+		client_connection->set_allocation_size(0);
+		break;
+	}
+}
+
+
+ftp_server_c::e_command_types ftp_server_c::determine_command(const std::string& command_name)
+{
+	if (command_name == "USER")
+	{
+		// Authentication username.
+		return e_ftpcmd_user;
+	}
+	else if (command_name == "PASS")
+	{
+		// Authentication password.
+		return e_ftpcmd_pass;
+	}
+	else if (command_name == "OPTS")
+	{
+		// Select options for a feature (for example OPTS UTF8 ON).
+		return e_ftpcmd_opts;
+	}
+	else if (command_name == "PWD")
+	{
+		// Print working directory. Returns the current directory of the host.
+		return e_ftpcmd_pwd;
+	}
+	else if (command_name == "TYPE")
+	{
+		// 	Sets the transfer mode (ASCII/Binary).
+		return e_ftpcmd_type;
+	}
+	else if (command_name == "CWD")
+	{
+		// Change working directory.
+		return e_ftpcmd_cwd;
+	}
+	else if (command_name == "PASV")
+	{
+		// Enter passive mode.
+		return e_ftpcmd_pasv;
+	}
+	else if (command_name == "LIST")
+	{
+		// Enter passive mode.
+		return e_ftpcmd_list;
+	}
+	else if (command_name == "SYST")
+	{
+		// Enter passive mode.
+		return e_ftpcmd_syst;
+	}
+	else if (command_name == "FEAT")
+	{
+		// Get the feature list implemented by the server.
+		return e_ftpcmd_feat;
+	}
+	else if (command_name == "HELP")
+	{
+		// Returns usage documentation on a command if specified, else a general help document is returned.
+		return e_ftpcmd_help;
+	}
+	else if (command_name == "NOOP")
+	{
+		// No operation (dummy packet; used mostly on keepalives).
+		return e_ftpcmd_noop;
+	}
+	else if (command_name == "DELE")
+	{
+		// Delete file.
+		return e_ftpcmd_delete;
+	}
+	else if (command_name == "CDUP")
+	{
+		// Change to Parent Directory.
+		return e_ftpcmd_cdup;
+	}
+	else if (command_name == "RETR")
+	{
+		// Retrieve a copy of the file.
+		return e_ftpcmd_retr;
+	}
+	else if (command_name == "SIZE")
+	{
+		// Return the size of a file.
+		return e_ftpcmd_size;
+	}
+	else if (command_name == "MKD")
+	{
+		// Make directory.
+		return e_ftpcmd_mkd;
+	}
+	else if (command_name == "RNFR")
+	{
+		// Rename from.
+		return e_ftpcmd_rnfr;
+	}
+	else if (command_name == "RNTO")
+	{
+		// Rename from.
+		return e_ftpcmd_rnto;
+	}
+	else if (command_name == "RMD")
+	{
+		// Remove a directory.
+		return e_ftpcmd_rmd;
+	}
+	else if (command_name == "STOR")
+	{
+		// Accept the data and to store the data as a file at the server site.
+		return e_ftpcmd_stor;
+	}
+	else if (command_name == "APPE")
+	{
+		// Append to the file, create it if it does not exist.
+		return e_ftpcmd_appe;
+	}
+	else if (command_name == "ALLO")
+	{
+		// Size of the file the next STOR is going to send.
+		return e_ftpcmd_allo;
+	}
+	else if (command_name == "REST")
+	{
+		// Restart the next transfer from the given offset.
+		return e_ftpcmd_rest;
+	}
+	else if (command_name == "EPSV")
+	{
+		// Enter extended passive mode (RFC 2428).
+		return e_ftpcmd_epsv;
+	}
+	else if (command_name == "MODE")
+	{
+		// Sets the transfer mode (Stream, Block, or Compressed).
+		return e_ftpcmd_mode;
+	}
+	else if (command_name == "PORT")
+	{
+		// Specifies an address and port to which the server should connect.
+		return e_ftpcmd_port;
+	}
+	else if (command_name == "EPRT")
+	{
+		// Specifies an extended address and port to which the server should connect (RFC 2428).
+		return e_ftpcmd_eprt;
+	}
+	else if (command_name == "SITE")
+	{
+		// Server specific commands (SITE RATE).
+		return e_ftpcmd_site;
+	}
+	else if (command_name == "AUTH")
+	{
+		// Switch control connection to TLS (RFC 4217).
+		return e_ftpcmd_auth;
+	}
+	else if (command_name == "PBSZ")
+	{
+		// Protection buffer size, always 0 for TLS.
+		return e_ftpcmd_pbsz;
+	}
+	else if (command_name == "PROT")
+	{
+		// Data channel protection level: C(lear) or P(rivate).
+		return e_ftpcmd_prot;
+	}
+	else if (command_name == "MLSD")
+	{
+		// Machine readable listing of a directory (RFC 3659).
+		return e_ftpcmd_mlsd;
+	}
+	else if (command_name == "NLST")
+	{
+		// Returns a list of file names in a specified directory.
+		return e_ftpcmd_nlst;
+	}
+	else if (command_name == "MLST")
+	{
+		// Machine readable facts of a single file over control connection (RFC 3659).
+		return e_ftpcmd_mlst;
+	}
+
+	return e_ftpcmd_unknown;
+}
+
+
+bool ftp_server_c::is_transfer_command(e_command_types command)
+{
+	switch (command)
+	{
+	case e_ftpcmd_list:
+	case e_ftpcmd_mlsd:
+	case e_ftpcmd_nlst:
+	case e_ftpcmd_retr:
+	case e_ftpcmd_stor:
+	case e_ftpcmd_appe:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+void ftp_server_c::handle_command(ftp_client_connection_c* client_connection,
+	e_command_types command,
+	const std::string& command_value)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	if (m_tls_required)
+	{
+		// nothing but negotiation goes over clear control connection
+		if (!client_connection->control_tls()
+			&& command != e_ftpcmd_auth
+			&& command != e_ftpcmd_feat
+			&& command != e_ftpcmd_noop
+			&& command != e_ftpcmd_unknown)
+		{
+			send_to_client(client_connection, "530 TLS is required, use AUTH TLS first\r\n");
+			return;
+		}
+
+		if (!client_connection->data_protection() && is_transfer_command(command))
+		{
+			send_to_client(client_connection, "521 Data connections must be protected, use PROT P\r\n");
+			return;
+		}
+	}
+#endif
+
+	switch (command)
+	{
+	case e_command_types::e_ftpcmd_user:
+	{
+		client_connection->set_user_name(command_value);
+		client_connection->set_user_profile(find_user_profile(command_value));
+
+		send_to_client(client_connection, "331 pretend login accepted\r\n");
+	}
+	break;
+	case e_command_types::e_ftpcmd_pass:
+	{
+		send_to_client(client_connection, "230 fake user logged in\r\n");
+	}
+	break;
+	case e_command_types::e_ftpcmd_opts:
+	{
+		if (strings_iequals(command_value, "utf8 on"))
+		{
+			client_connection->set_encoding(e_encoding_utf8);
+		}
+		else if (strings_iequals(command_value.substr(0, 6), "MODE Z"))
+		{
+#ifdef FTPSERVER_WITH_ZLIB
+			// OPTS MODE Z LEVEL <n>
+			std::string options = command_value.substr(6);
+			for (auto& c : options)
+			{
+				c = (char)::toupper((unsigned char)c);
+			}
+
+			int level = -1;
+			char tail = 0;
+
+			if (sscanf(options.c_str(), " LEVEL %d %c", &level, &tail) != 1
+				|| level < 0 || level > 9)
+			{
+				send_to_client(client_connection, "501 Invalid MODE Z options\r\n");
+				break;
+			}
+
+			client_connection->set_deflate_level(level);
+#else
+			send_to_client(client_connection, "501 MODE Z is not supported\r\n");
+			break;
+#endif
+		}
+		else if (strings_iequals(command_value.substr(0, 4), "MLST"))
+		{
+			// OPTS MLST fact;fact;... unknown facts are ignored, none - no facts
+			uint32_t facts = 0;
+			std::string reply = "200 MLST OPTS ";
+
+			size_t pos = command_value.find(' ');
+			std::string facts_list = pos == std::string::npos ? std::string() : command_value.substr(pos + 1);
+
+			for (auto& fact : g_mlst_facts)
+			{
+				bool selected = false;
+
+				for (size_t begin = 0; begin < facts_list.size() && !selected; )
+				{
+					size_t end = facts_list.find(';', begin);
+					if (end == std::string::npos)
+						end = facts_list.size();
+
+					selected = strings_iequals(facts_list.substr(begin, end - begin), fact.name);
+
+					begin = end + 1;
+				}
+
+				if (selected)
+				{
+					facts |= fact.bit;
+					reply += fact.name;
+					reply += ";";
+				}
+			}
+
+			client_connection->set_mlst_facts(facts);
+
+			reply += "\r\n";
+			send_to_client(client_connection, reply.c_str());
+			break;
+		}
+
+		send_to_client(client_connection, "200 ok\r\n");
+	}
+	break;
+	case e_command_types::e_ftpcmd_pwd:
+	{
+		auto& directory_iterator = client_connection->get_directory_iterator();
+
+		auto current_directory_relative_path = "/" + directory_iterator.relative_path();
+
+		translate_path
+		(
+			client_connection,
+			current_directory_relative_path,
+			m_native_encoding,
+			client_connection->current_encoding()
+		);
+
+
+		char buf[MAX_PATH + 32] = "";
+		sprintf(buf, "257 \"%s\"\r\n", current_directory_relative_path.c_str());
+		send_to_client(client_connection, buf);
+	}
+	break;
+	case e_command_types::e_ftpcmd_type:
+	{
+		// "A", "A N", "I", "L 8"; format controls other than non print are not supported
+		if (strings_iequals(command_value, "A") || strings_iequals(command_value, "A N"))
+		{
+			client_connection->set_data_transfer_mode(e_data_transfer_mode_ascii);
 
-						handle_connection(client_socket);
-					}
-				}
-				else
-				{
-					if (sock != INVALID_SOCK)
-					{
-						char data_buf[128] = { 0 };
-						size_t data_buf_sz = sizeof(data_buf);
+			send_to_client(client_connection, "200 Type set to A\r\n");
+		}
+		else if (strings_iequals(command_value, "I") || strings_iequals(command_value, "L 8"))
+		{
+			client_connection->set_data_transfer_mode(e_data_transfer_mode_binary);
 
-						int rc = recv(sock, data_buf, data_buf_sz, 0);
+			send_to_client(client_connection, "200 Type set to I\r\n");
+		}
+		else if (!command_value.empty()
+			&& (::toupper((unsigned char)command_value[0]) == 'A' || ::toupper((unsigned char)command_value[0]) == 'E'
+				|| ::toupper((unsigned char)command_value[0]) == 'L'))
+		{
+			send_to_client(client_connection, "504 Type not supported\r\n");
+		}
+		else
+		{
+			send_to_client(client_connection, "501 Unknown type\r\n");
+		}
+	}
+	break;
+	case e_command_types::e_ftpcmd_cwd:
+	{
+		auto& directory_iterator = client_connection->get_directory_iterator();
 
-						if (rc < 0)
-						{
-							if (errno == EINPROGRESS ||
-								errno == EAGAIN ||
-								errno == EWOULDBLOCK)
-							{
-								continue;
-							}
+		auto current_path = directory_iterator.absolute_path();
 
-							if (errno == ENOTCONN)
-							{
-								ESP_LOGI(TAG, "Connection %d closed", sock);
-							}
-							else
-							{
-								ESP_LOGE(TAG, "Error occurred during receiving (sock: %d, err: %s). Close connection",
-									sock, strerror(errno));
-							}
+		if (command_value[0] == '/')
+		{
+			directory_iterator.move_to_root();
+		}
 
-							remove_client_connection(sock);
+		std::string translated_path;
 
-							FD_CLR(sock, &master_set);
-							if (sock == max_sd)
-							{
-								while (!FD_ISSET(max_sd, &master_set))
-									max_sd -= 1;
-							}
-						}
-						else if (rc > 0)
-						{
-							auto client_connection = find_connection_by_socket(sock);
-							if (!client_connection)
-							{
-								// impossible situation
-								continue;
-							}
+		if (client_connection->current_encoding() == e_encoding_utf8)
+		{
+			translated_path.resize(MAX_PATH);
+			convert_utf8_to_windows1251(command_value.c_str(), &translated_path[0], translated_path.size());
+		}
+		else
+		{
+			translated_path = command_value;
+		}
 
-							handle_incoming_data(client_connection.get(), (uint8_t*)data_buf, rc);
-						}
-					}
-				}
-			}
+		// existence of the target comes from the cache, change_dir does not stat it again
+		auto target_path = filesystem_tools::helpers::rebuild_path(
+			directory_iterator.absolute_path() + translated_path.c_str());
+
+		metadata_cache_c::path_info_s info;
+		bool target_exists = m_metadata_cache.get(target_path, info) && info.is_directory;
+
+		if (target_exists && directory_iterator.change_dir(translated_path, false))
+		{
+			char buf[MAX_PATH + 32] = "";
+			sprintf(buf, "250 CWD command successful\r\n");
+			send_to_client(client_connection, buf);
+
+			printf("current path: %s, next dir: %s, real path: %s\n",
+				current_path.c_str(), translated_path.c_str(),
+				directory_iterator.absolute_path().c_str());
+		}
+		else
+		{
+			send_to_client(client_connection, "550 Could not change directory\r\n");
+			return;
 		}
 	}
-}
-#elif 0 // works on esp32, but load cpu, old code
-void ftp_server_c::server_routine()
-{
-	const size_t max_socks = CONFIG_MAX_SOCKETS - 1;
-	static SOCKET client_sockets[CONFIG_MAX_SOCKETS - 1];
+	break;
+	case e_command_types::e_ftpcmd_pasv:
+	{
+		if (client_connection->epsv_all())
+		{
+			send_to_client(client_connection, "501 Only EPSV is allowed after EPSV ALL\r\n");
+			break;
+		}
 
-	struct sockaddr_storage source_addr;
-	socklen_t addr_len = sizeof(source_addr);
+		// reply contains IPv4 address only
+		struct sockaddr_storage local_addr;
+		uint8_t ip[4];
 
-	// prepare a list of file descriptors to hold client's sockets, mark all of them as invalid, i.e. available
-	for (int i = 0; i < max_socks; ++i)
-	{
-		client_sockets[i] = INVALID_SOCK;
+		if (!get_local_address(client_connection->command_socket(), local_addr)
+			|| !address_to_ipv4(local_addr, ip))
+		{
+			send_to_client(client_connection, "425 PASV is not supported for IPv6, use EPSV\r\n");
+			break;
+		}
+
+		// create passive channel
+		uint16_t port = 0;
+		if (open_passive_data_channel(client_connection, port))
+		{
+			char buf[62] = "";
+			sprintf(buf, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n",
+				ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff);
+
+			send_to_client(client_connection, buf);
+		}
+		else
+		{
+			send_to_client(client_connection, "425 Can't open passive connection\r\n");
+		}
 	}
+	break;
+	case e_ftpcmd_epsv:
+	{
+		if (strings_iequals(command_value, "ALL"))
+		{
+			client_connection->set_epsv_all(true);
 
-	while (m_working)
+			send_to_client(client_connection, "200 EPSV ALL command successful\r\n");
+			break;
+		}
+
+		// optional argument is network protocol: 1 - IPv4, 2 - IPv6
+		if (!command_value.empty() && command_value != "1"
+#ifdef FTPSERVER_IPV6_SUPPORT
+			&& command_value != "2"
+#endif
+			)
+		{
+#ifdef FTPSERVER_IPV6_SUPPORT
+			send_to_client(client_connection, "522 Network protocol not supported, use (1,2)\r\n");
+#else
+			send_to_client(client_connection, "522 Network protocol not supported, use (1)\r\n");
+#endif
+			break;
+		}
+
+		// reply has no address, client connects to the control connection host
+		uint16_t port = 0;
+		if (open_passive_data_channel(client_connection, port))
+		{
+			char buf[62] = "";
+			sprintf(buf, "229 Entering Extended Passive Mode (|||%d|)\r\n", port);
+
+			send_to_client(client_connection, buf);
+		}
+		else
+		{
+			send_to_client(client_connection, "425 Can't open passive connection\r\n");
+		}
+	}
+	break;
+	case e_ftpcmd_mode:
 	{
-		// find a free socket
-		int free_sock_index = 0;
-		for (free_sock_index = 0; free_sock_index < max_socks; ++free_sock_index)
+		if (strings_iequals(command_value, "S"))
 		{
-			if (client_sockets[free_sock_index] == INVALID_SOCK)
- 				break;
+			client_connection->set_transmission_mode(e_transmission_mode_stream);
+
+			// stream mode transfer ends with closing of data connection
+			close_persistent_data_connection(client_connection);
+
+			send_to_client(client_connection, "200 Mode set to S\r\n");
 		}
+		else if (strings_iequals(command_value, "B"))
+		{
+			client_connection->set_transmission_mode(e_transmission_mode_block);
 
-		// accept a new connection only if we have a free socket
-		if (free_sock_index < max_socks)
+			send_to_client(client_connection, "200 Mode set to B\r\n");
+		}
+#ifdef FTPSERVER_WITH_ZLIB
+		else if (strings_iequals(command_value, "Z"))
 		{
-			auto& free_socket = client_sockets[free_sock_index];
+			client_connection->set_transmission_mode(e_transmission_mode_deflate);
 
-			// accept a new connections
-			free_socket = accept
-			(
-				m_listen_socket,
-				(struct sockaddr*)&source_addr,
-				&addr_len
-			);
+			// deflate stream ends with closing of data connection
+			close_persistent_data_connection(client_connection);
 
-			if (free_socket < 0)
+			send_to_client(client_connection, "200 Mode set to Z\r\n");
+		}
+#endif
+		else
+		{
+			send_to_client(client_connection, "504 Command not implemented for that parameter\r\n");
+		}
+	}
+	break;
+	case e_ftpcmd_port:
+	case e_ftpcmd_eprt:
+	{
+		if (client_connection->epsv_all())
+		{
+			send_to_client(client_connection, "501 Only EPSV is allowed after EPSV ALL\r\n");
+			break;
+		}
+
+		struct sockaddr_storage client_addr;
+
+		if (command == e_ftpcmd_port)
+		{
+			if (!parse_port_argument(command_value, client_addr))
 			{
-				if (errno != EWOULDBLOCK)
-				{
-					ESP_LOGE(TAG, "Error when accepting connection: %s",
-						strerror(errno));
-				}
+				send_to_client(client_connection, "501 Illegal PORT command\r\n");
+				break;
 			}
-			else
+		}
+		else
+		{
+			bool unsupported_protocol = false;
+			if (!parse_eprt_argument(command_value, client_addr, unsupported_protocol))
 			{
-				handle_connection(free_socket);
+				if (unsupported_protocol)
+				{
+#ifdef FTPSERVER_IPV6_SUPPORT
+					send_to_client(client_connection, "522 Network protocol not supported, use (1,2)\r\n");
+#else
+					send_to_client(client_connection, "522 Network protocol not supported, use (1)\r\n");
+#endif
+				}
+				else
+				{
+					send_to_client(client_connection, "501 Illegal EPRT command\r\n");
+				}
+				break;
 			}
 		}
 
-		// receive data
-		for (int i = 0; i < max_socks; ++i)
-		{
-			auto& client_socket = client_sockets[i];
+		// no bounce attacks: only the client host itself (any host for FXP hosts),
+		// no privileged ports
+		struct sockaddr_storage control_peer_addr;
+		get_peer_address(client_connection->command_socket(), control_peer_addr);
 
-			if (client_socket != INVALID_SOCK)
-			{
-				char data_buf[128] = { 0 };
-				size_t data_buf_sz = sizeof(data_buf);
+		if ((!client_connection->fxp_allowed() && !addresses_same_host(client_addr, control_peer_addr))
+			|| address_port(client_addr) < 1024)
+		{
+			send_to_client(client_connection, "504 Data connection to this address is not allowed\r\n");
+			break;
+		}
 
-				int rc = recv(client_socket, data_buf, data_buf_sz, 0);
+		if (open_active_data_channel(client_connection, client_addr))
+		{
+			send_to_client(client_connection, command == e_ftpcmd_port ?
+				"200 PORT command successful\r\n" :
+				"200 EPRT command successful\r\n");
+		}
+		else
+		{
+			send_to_client(client_connection, "425 Can't open data connection\r\n");
+		}
+	}
+	break;
+	case e_ftpcmd_list:
+	{
+		handle_list_command(client_connection, e_listing_format_list, command_value);
 
-				if (rc < 0)
-				{
-					if (errno == EINPROGRESS ||
-						errno == EAGAIN ||
-						errno == EWOULDBLOCK)
-					{
-						continue;
-					}
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
+	}
+	break;
+	case e_ftpcmd_mlsd:
+	{
+		handle_list_command(client_connection, e_listing_format_mlsd, command_value);
 
-					if (errno == ENOTCONN)
-					{
-						ESP_LOGI(TAG, "Connection %d closed", client_socket);
-					}
-					else
-					{
-						ESP_LOGE(TAG, "Error occurred during receiving (sock: %d, err: %s). Close connection",
-							client_socket, strerror(errno));
-					}
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
+	}
+	break;
+	case e_ftpcmd_nlst:
+	{
+		handle_list_command(client_connection, e_listing_format_nlst, command_value);
 
-					remove_client_connection(client_socket);
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
+	}
+	break;
+	case e_ftpcmd_mlst:
+	{
+		handle_mlst_command(client_connection, command_value);
+	}
+	break;
+	case e_ftpcmd_syst:
+	{
+		send_to_client(client_connection, "215 WIN32 SingularFTP v.0.01\r\n");
+		break;
+	}
+	break;
+	case e_ftpcmd_feat:
+	{
+		std::string features =
+			"211-Features:\r\n"
+			" EPRT\r\n"
+			" EPSV\r\n"
+			" REST STREAM\r\n"
+			" MLSD\r\n"
+#ifdef FTPSERVER_WITH_ZLIB
+			" MODE Z\r\n"
+#endif
+			;
 
-					client_socket = INVALID_SOCK;
-				}
-				else if (rc > 0)
-				{
-					auto client_connection = find_connection_by_socket(client_socket);
-					if (!client_connection)
-					{
-						// impossible situation
-						continue;
-					}
+		// facts the session shows are marked with '*'
+		{
+			uint32_t facts = client_connection->mlst_facts();
 
-					handle_incoming_data(client_connection.get(), (uint8_t*)data_buf, rc);
-				}
+			features += " MLST ";
+			for (auto& fact : g_mlst_facts)
+			{
+				features += fact.name;
+				if (facts & fact.bit)
+					features += "*";
+				features += ";";
 			}
+			features += "\r\n";
 		}
-	}
-}
-#endif
 
+#ifdef FTPSERVER_WITH_OPENSSL
+		if (m_tls_context)
+		{
+			features +=
+				" AUTH TLS\r\n"
+				" PBSZ\r\n"
+				" PROT\r\n";
+		}
+#endif
 
-void ftp_server_c::remove_client_connection(SOCKET sock)
-{
-	if (sock == 0)
-		return;
-
-	closesocket(sock);
+		features += "211 End\r\n";
 
-	auto it = m_client_connections.begin();
-	while (it != m_client_connections.end())
+		send_to_client(client_connection, features.c_str());
+		break;
+	}
+	break;
+	case e_ftpcmd_help:
 	{
-		auto& client_connection = *it;
+		send_to_client(client_connection, "500 command not recognized\r\n");
+		break;
+	}
+	break;
+	case e_ftpcmd_noop:
+	{
+		send_to_client(client_connection, "200 OK\r\n");
+		break;
+	}
+	break;
+	case e_ftpcmd_delete:
+	{
+		auto full_path = client_connection->current_directory() + command_value;
 
-		if (client_connection->command_socket() == sock)
+		if (client_connection->current_encoding() != m_native_encoding)
 		{
-			it = m_client_connections.erase(it);
-			break;
+			translate_path
+			(
+				client_connection, full_path,
+				client_connection->current_encoding(),
+				m_native_encoding
+			);
 		}
 
-		++it;
-	}
-};
-
+		// todo: check permissions
+		//send_to_client(client_connection, "550 Path permission error\r\n");
 
-ftp_server_c::ftp_client_connection_t ftp_server_c::find_connection_by_socket(SOCKET sock)
-{
-	for (auto& client_connection : m_client_connections)
-	{
-		if (client_connection->command_socket() == sock)
+		// clients often delete what is not there, errno comes from the cache then
+		metadata_cache_c::path_info_s info;
+		if (m_metadata_cache.find(full_path, info) == metadata_cache_c::e_cached_missing
+			|| unlink(full_path.c_str()) != 0)
 		{
-			return client_connection;
+			send_system_error(client_connection);
+			return;
 		}
-	}
-
-	return ftp_client_connection_t();
-}
+		else
+		{
+			invalidate_cached_path(full_path);
 
+			send_to_client(client_connection, "250 DELE command successful\r\n");
+		}
+	}
+	break;
+	case e_ftpcmd_cdup:
+	{
+		auto& directory_iterator = client_connection->get_directory_iterator();
 
-void ftp_server_c::handle_connection(SOCKET client_socket)
-{
-	uint32_t ip[4];
-	get_ip_data(client_socket, ip);
+		directory_iterator.move_prev_dir();
 
-	ESP_LOGI
-	(
-		TAG, "New client connected (sock: %d, ip: %d.%d.%d.%d)",
-		client_socket,
-		ip[0], ip[1], ip[2], ip[3]
-	);
+		send_to_client(client_connection, "200 OK\r\n");
+	}
+	break;
+	case e_ftpcmd_retr:
+	{
+		handle_retr_command(client_connection, command_value);
 
-	// set socket non-blocking mode
-#ifdef WIN32
-	u_long non_blocking_mode = 1;
-	if (ioctlsocket(client_socket, FIONBIO, &non_blocking_mode) == SOCKET_ERROR)
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
+	}
+	break;
+	case e_ftpcmd_size:
 	{
-		ESP_LOGE
+		auto full_path = client_connection->current_directory() + command_value;
+
+		translate_path
 		(
-			TAG, "Failed to set non blocking mode for socket %d (err: %s)",
-			client_socket,
-			strerror(errno)
+			client_connection,
+			full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
 		);
 
-		return;
-	}
-#else
-	{
-		int flags = fcntl(client_socket, F_GETFL);
-		if (fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) == -1)
+		metadata_cache_c::path_info_s info;
+		if (!m_metadata_cache.get(full_path, info))
 		{
-			ESP_LOGE
-			(
-				TAG, "Failed to set non blocking mode for socket %d (err: %s)",
-				client_socket,
-				strerror(errno)
-			);
-
+			send_system_error(client_connection);
 			return;
 		}
-	}
-#endif
 
-	auto client_connection = std::make_shared<ftp_client_connection_c>(client_socket);
-	client_connection->set_ftp_root_directory(m_home_dir);
-	client_connection->set_encoding(m_native_encoding);
+		char buf[32];
+		sprintf(buf, "213 %llu\r\n", (unsigned long long)info.size);
+		send_to_client(client_connection, buf);
+	}
+	break;
+	case e_ftpcmd_mkd:
+	{
+		auto full_path = client_connection->current_directory() + command_value;
 
-	// send initial message
-	send_to_client(client_connection.get(), "220 lwftp ready\r\n");
+		translate_path
+		(
+			client_connection,
+			full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
+		);
 
-	m_client_connections.emplace_back(std::move(client_connection));
-}
+		int mkdir_result = -1;
 
+		metadata_cache_c::path_info_s info;
+		if (m_metadata_cache.find(full_path, info) == metadata_cache_c::e_cached_exists)
+		{
+			errno = EEXIST;
+		}
+		else
+		{
+			mkdir_result = mkdir(full_path.c_str()
+#ifndef WIN32
+				, 0777
+#endif
+				);
+		}
 
-uint16_t ftp_server_c::get_first_free_port()
-{
-	if (m_data_channel_ports_map.size() == 0)
-		return 0;
+		// todo: check permissions
+		//send_to_client(client_connection, "550 Path permission error\r\n");
 
-	uint16_t free_port = 0;
-	for (auto& port : m_data_channel_ports_map)
-	{
-		if (!port.busy)
+		if (mkdir_result == 0)
 		{
-			port.busy = true;
+			invalidate_cached_path(full_path);
 
-			return port.port;
+			send_to_client(client_connection, "257 Directory created\r\n");
+		}
+		else
+		{
+			send_system_error(client_connection);
+			return;
 		}
 	}
+	break;
+	case e_ftpcmd_rnfr:
+	{
+		auto full_path = client_connection->current_directory() + command_value;
 
-	return free_port;
-}
+		translate_path
+		(
+			client_connection,
+			full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
+		);
 
+		metadata_cache_c::path_info_s info;
 
-void ftp_server_c::mark_port_as_free(uint16_t port_number)
-{
-	uint16_t free_port = 0;
-	for (auto& port : m_data_channel_ports_map)
-	{
-		if (port.port == port_number)
+		if (m_metadata_cache.get(full_path, info))
 		{
-			port.busy = false;
-			return;
+			send_to_client(client_connection, "350 File Exists\r\n");
+			client_connection->set_rename_file_path(full_path);
 		}
+		else
+		{
+			send_to_client(client_connection, "550 Path permission error\r\n");
+			client_connection->set_rename_file_path("");
+		}
+		
 	}
-}
+	break;
+	case e_ftpcmd_rnto:
+	{
+		auto rename_to_full_path = client_connection->current_directory() + command_value;
 
+		translate_path
+		(
+			client_connection,
+			rename_to_full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
+		);
 
-void ftp_server_c::get_ip_data(int sock, uint32_t* ip)
-{
-	socklen_t addr_size = (socklen_t)sizeof(struct sockaddr_in);
-	struct sockaddr_in addr;
-	getsockname(sock, (struct sockaddr*)&addr, &addr_size);
+		auto rename_from_full_path = client_connection->rename_file_path();
 
-	char* host = inet_ntoa(addr.sin_addr);
-	sscanf(host, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]);
-}
+		// todo: check permissions
+		//send_to_client(client_connection, "550 Path permission error\r\n");
 
+		// paths below a renamed directory change too (RNFR has just cached the source)
+		metadata_cache_c::path_info_s info;
+		bool is_directory = m_metadata_cache.get(rename_from_full_path, info) && info.is_directory;
 
-void ftp_server_c::gen_port(uint16_t& p1, uint16_t& p2)
-{
-	srand((uint32_t)time(NULL));
-	p1 = 128 + (rand() % 64);
-	p2 = rand() % 0xff;
-}
+		if (rename(rename_from_full_path.c_str(), rename_to_full_path.c_str()) != 0)
+		{
+			send_system_error(client_connection);
+			return;
+		}
+		else
+		{
+			invalidate_cached_path(rename_from_full_path, is_directory);
+			invalidate_cached_path(rename_to_full_path, is_directory);
 
+			send_to_client(client_connection, "250 RNTO command successful\r\n");
+		}
+	}
+	break;
+	case e_ftpcmd_rmd:
+	{
+		auto full_path = client_connection->current_directory() + command_value;
 
-void ftp_server_c::translate_path(ftp_client_connection_c* client_connection,
-	std::string& path,
-	e_encoding source_encoding,
-	e_encoding dest_encoding)
-{
-	if (client_connection->current_encoding() == m_native_encoding)
-		return;
+		translate_path
+		(
+			client_connection,
+			full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
+		);
 
-	if (source_encoding == e_encoding_win1251 && dest_encoding == e_encoding_utf8)
+		// todo: check permissions
+		//send_to_client(client_connection, "550 Path permission error\r\n");
+
+		metadata_cache_c::path_info_s info;
+		if (m_metadata_cache.find(full_path, info) != metadata_cache_c::e_cached_missing
+			&& remove_directory_r(full_path.c_str(), false))
+		{
+			invalidate_cached_path(full_path, true);
+
+			send_to_client(client_connection, "250 RMD command successful\r\n");
+		}
+		else
+		{
+			send_system_error(client_connection);
+			return;
+		}
+	}
+	break;
+	case e_ftpcmd_stor:
 	{
-		std::string utf8_path;
-		utf8_path.resize(MAX_PATH);
-		convert_windows1251_to_utf8(path.c_str(), &utf8_path[0]);
+		handle_stor_command(client_connection, command_value);
 
-		path = utf8_path;
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
 	}
-	else if (source_encoding == e_encoding_utf8 && dest_encoding == e_encoding_win1251)
+	break;
+	case e_ftpcmd_appe:
 	{
-		std::string win1251_path;
-		win1251_path.resize(MAX_PATH);
-		convert_utf8_to_windows1251(path.c_str(), &win1251_path[0], win1251_path.size());
+		handle_stor_command(client_connection, command_value, true);
 
-		path = win1251_path;
+		// passive channel serves a single transfer
+		close_data_channel(client_connection);
 	}
-}
-
+	break;
+	case e_ftpcmd_allo:
+	{
+		// "ALLO <size> [R <record size>]", record size is meaningless here
+		auto size_str = command_value.substr(0, command_value.find(' '));
 
-bool ftp_server_c::initialize_sock_channel(SOCKET& sock,
-	uint16_t port,
-	bool non_blocking_sock)
-{
-	struct sockaddr_in server_address;
+		uint64_t allocation_size = 0;
+		if (!parse_uint64_argument(size_str, allocation_size))
+		{
+			send_to_client(client_connection, "501 Invalid ALLO parameter\r\n");
+			break;
+		}
 
-	// Create a socket that we will listen upon.
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sock == INVALID_SOCKET)
-	{
-		ESP_LOGE(TAG, "Failed to initialize socket channel (sock result: %d, err: %s)",
-			sock,
-			strerror(errno));
+		client_connection->set_allocation_size(allocation_size);
 
-		return false;
+		send_to_client(client_connection, "200 ALLO command successful\r\n");
 	}
-
-#ifdef WIN32
-	if (non_blocking_sock)
+	break;
+	case e_ftpcmd_rest:
 	{
-		// set non-blocking mode
-		u_long non_blocking_mode = 1;
-		if (ioctlsocket(sock, FIONBIO, &non_blocking_mode) == SOCKET_ERROR)
+		uint64_t offset = 0;
+
+		if (!parse_uint64_argument(command_value, offset))
 		{
-			return false;
+			send_to_client(client_connection, "501 Invalid REST parameter\r\n");
+			break;
 		}
+
+		client_connection->set_restart_offset(offset);
+
+		char buf[64];
+		sprintf(buf, "350 Restarting at %llu\r\n", (unsigned long long)offset);
+		send_to_client(client_connection, buf);
 	}
-#else
-	int flags = fcntl(sock, F_GETFL);
-	if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+	break;
+	case e_ftpcmd_site:
 	{
-		ESP_LOGE(TAG, "Unable to set socket %d non blocking: %s",
-			sock,
-			strerror(errno));
+		handle_site_command(client_connection, command_value);
 	}
-#endif
-
-	// bind our server socket to a port.
-	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-	server_address.sin_port = htons(port);
-	int rc = bind(sock, (struct sockaddr *)&server_address, sizeof(server_address));
-	if (rc == INVALID_SOCKET)
+	break;
+	case e_ftpcmd_auth:
+	case e_ftpcmd_pbsz:
+	case e_ftpcmd_prot:
 	{
-		ESP_LOGE(TAG, "bind sock %d failed (bind result: %d, err: %s)",
-			sock, rc, strerror(errno));
-
-		closesocket(sock);
-
-		return false;
+		handle_security_command(client_connection, command, command_value);
 	}
-
-	// flag the socket as listening for new connections.
-	rc = listen(sock, 5);
-	if (rc == INVALID_SOCKET)
+	break;
+	default:
 	{
-		ESP_LOGE(TAG, "listen sock %d failed (listen result: %d, err: %s",
-			sock, rc, strerror(errno));
-
-		closesocket(sock);
-
-		return false;
+		send_to_client(client_connection, "500 command not recognized\r\n");
+	}
+	break;
 	}
-
-	return true;
 }
 
 
-bool ftp_server_c::send_to_client(SOCKET client_socket,
-	const char* data, size_t data_size)
+void ftp_server_c::handle_list_command(ftp_client_connection_c* client_connection,
+	e_listing_format format, const std::string& command_value)
 {
-	// printf("send data '%s' (data_size: %d) to sock %d\n",
-	// 	data,
-	// 	data_size,
-	// 	(int)client_socket);
-
-	while (data_size > 0)
-	{
-		int written = send(client_socket, data, data_size, 0);
+	auto& directory_iterator = client_connection->get_directory_iterator();
 
-		if (written < 0 && errno != EINPROGRESS)
-		{
-			ESP_LOGE(TAG, "Failed to send data (sock: %d, written: %d, err: %s)",
-				client_socket, written, strerror(errno));
+	auto directory = directory_iterator.absolute_path();
 
-			return false;
-		}
+	// glob of names (or name of a single file);
+	// NLST names go with the directory as the client gave it
+	std::string name_pattern;
+	std::string name_prefix;
 
-		data_size -= written;
-	}
+	// "LIST [-<options>] [<path>]", "MLSD [<dir>]", "NLST [<path>]",
+	// last component of the path may be a glob ("LIST -la logs/*.csv")
+	std::string argument = command_value;
 
-	return true;
-}
+	// "LIST -R", "LIST -laR": the whole subtree
+	bool recursive = false;
 
+	if (format == e_listing_format_list)
+	{
+		// options of ls are ignored, but -R
+		while (!argument.empty() && argument[0] == '-')
+		{
+			size_t end = argument.find(' ');
 
-bool ftp_server_c::send_to_client(ftp_client_connection_c* client_connection,
-	char* data)
-{
-	return send_to_client(client_connection->command_socket(), data, strlen(data));
-}
+			if (argument.substr(0, end).find('R') != std::string::npos)
+				recursive = true;
 
+			argument = end == std::string::npos ? std::string() : argument.substr(end + 1);
 
-bool ftp_server_c::send_system_error(ftp_client_connection_c* client_connection)
-{
-	char buf[200];
-#ifdef WIN32
-	sprintf(buf, "550 %s\r\n", sys_errlist[errno]);
-#else
-	sprintf(buf, "550 %s\r\n", strerror(errno));
-#endif
+			while (!argument.empty() && argument[0] == ' ')
+				argument.erase(0, 1);
+		}
+	}
 
-	return send_to_client(client_connection, buf);
-}
+	if (!argument.empty())
+	{
+		size_t name_pos = argument.find_last_of('/');
+		name_pos = name_pos == std::string::npos ? 0 : name_pos + 1;
 
+		if (filesystem_tools::helpers::has_glob_chars(argument.substr(name_pos)))
+		{
+			name_pattern = argument.substr(name_pos);
+			argument.resize(name_pos);
 
-void ftp_server_c::handle_incoming_data(ftp_client_connection_c* client_connection,
-	uint8_t* data, size_t data_size)
-{
-//#ifdef _DEBUG
-	printf("received command: %s\n", data);
-//#endif
+			// names are matched in native encoding
+			translate_path
+			(
+				client_connection,
+				name_pattern,
+				client_connection->current_encoding(),
+				m_native_encoding
+			);
+		}
 
-	uint8_t* str_ptr = data;
+		// "../../etc" does not get out of the ftp root
+		std::string full_path;
+		if (!directory_iterator.resolve_path(argument, full_path))
+		{
+			send_to_client(client_connection, "550 No such file or directory\r\n");
+			return;
+		}
 
-	std::string command_name;
-	std::string command_value;
+		translate_path
+		(
+			client_connection,
+			full_path,
+			client_connection->current_encoding(),
+			m_native_encoding
+		);
 
-	bool single_command = false;
+		filesystem_tools::directory_iterator_c::entity_info_s info;
+		if (!filesystem_tools::directory_iterator_c::get_entity_info(full_path, info))
+		{
+			send_system_error(client_connection);
+			return;
+		}
 
-	// read command tag
-	{
-		uint8_t* str_begin = data;
-		while (*str_ptr)
+		if (!(info.attributes & filesystem_tools::directory_iterator_c::e_attribute_directory))
 		{
-			if (!*str_ptr || *str_ptr == ' ')
+			if (format == e_listing_format_mlsd || !name_pattern.empty())
 			{
-				command_name = std::string(str_begin, str_ptr);
-				++str_ptr;
-				break;
+				send_to_client(client_connection, "501 Not a directory\r\n");
+				return;
 			}
 
-			if (*str_ptr == '\r')
+			// LIST / NLST of a file lists the file itself, its name is taken literally
+			for (char c : info.name)
 			{
-				single_command = true;
-
-				command_name = std::string(str_begin, str_ptr);
-				break;
+				if (c == '*' || c == '?' || c == '[')
+				{
+					name_pattern += '[';
+					name_pattern += c;
+					name_pattern += ']';
+				}
+				else
+				{
+					name_pattern += c;
+				}
 			}
 
-			++str_ptr;
-		}
-	}
+			full_path = filesystem_tools::helpers::get_directory_path(full_path);
 
-	// read command value
-	if (!single_command)
-	{
-		uint8_t* str_begin = str_ptr;
-		while (*str_ptr)
-		{
-			if (!*str_ptr || *str_ptr == '\r')
-			{
-				command_value = std::string(str_begin, str_ptr);
-				++str_ptr;
-				break;
-			}
+			argument.resize(name_pos);
 
-			++str_ptr;
+			recursive = false;
 		}
-	}
-
-	handle_command
-	(
-		client_connection,
-		determine_command(command_name),
-		command_value
-	);
-}
 
+		directory = filesystem_tools::helpers::rebuild_path(full_path);
 
-ftp_server_c::e_command_types ftp_server_c::determine_command(const std::string& command_name)
-{
-	if (command_name == "USER")
-	{
-		// Authentication username.
-		return e_ftpcmd_user;
-	}
-	else if (command_name == "PASS")
-	{
-		// Authentication password.
-		return e_ftpcmd_pass;
-	}
-	else if (command_name == "opts")
-	{
-		// Select options for a feature (for example OPTS UTF8 ON).
-		return e_ftpcmd_opts;
-	}
-	else if (command_name == "PWD")
-	{
-		// Print working directory. Returns the current directory of the host.
-		return e_ftpcmd_pwd;
-	}
-	else if (command_name == "TYPE")
-	{
-		// 	Sets the transfer mode (ASCII/Binary).
-		return e_ftpcmd_type;
-	}
-	else if (command_name == "CWD")
-	{
-		// Change working directory.
-		return e_ftpcmd_cwd;
-	}
-	else if (command_name == "PASV")
-	{
-		// Enter passive mode.
-		return e_ftpcmd_pasv;
-	}
-	else if (command_name == "LIST")
-	{
-		// Enter passive mode.
-		return e_ftpcmd_list;
-	}
-	else if (command_name == "SYST")
-	{
-		// Enter passive mode.
-		return e_ftpcmd_syst;
-	}
-	else if (command_name == "FEAT")
-	{
-		// Get the feature list implemented by the server.
-		return e_ftpcmd_feat;
-	}
-	else if (command_name == "HELP")
-	{
-		// Returns usage documentation on a command if specified, else a general help document is returned.
-		return e_ftpcmd_help;
-	}
-	else if (command_name == "noop")
-	{
-		// No operation (dummy packet; used mostly on keepalives).
-		return e_ftpcmd_noop;
+		if (format == e_listing_format_nlst && !argument.empty())
+		{
+			name_prefix = argument;
+			if (name_prefix.back() != '/')
+				name_prefix += '/';
+		}
 	}
-	else if (command_name == "DELE")
+
+	// compiled once, checked before an entry is stat'ed
+	filesystem_tools::helpers::glob_matcher_c name_filter;
+	name_filter.compile(name_pattern);
+
+	// recursion may be turned off by the limits
+	if (m_recursive_list_max_entries == 0)
+		recursive = false;
+
+	// headers of "ls -R" start with the directory as the client gave it
+	std::string display_path = argument;
+	while (display_path.size() > 1 && display_path.back() == '/')
+		display_path.pop_back();
+	if (display_path.empty())
+		display_path = ".";
+
+	if (!send_transfer_starting(client_connection, "150 Opening connection\r\n"))
 	{
-		// Delete file.
-		return e_ftpcmd_delete;
+		// PROT P: runs again when the data connection is secured
+		return;
 	}
-	else if (command_name == "CDUP")
+
+	smart_socket data_socket_ptr
+	(
+		open_data_connection(client_connection)
+	);
+
+	if (data_socket_ptr.get() == INVALID_SOCKET)
 	{
-		// Change to Parent Directory.
-		return e_ftpcmd_cdup;
+		send_to_client(client_connection, "425 Can't open data connection\r\n");
+		return;
 	}
-	else if (command_name == "RETR")
+
+	data_transfer_s transfer;
+	if (!begin_data_transfer(client_connection, transfer, data_socket_ptr.get()))
 	{
-		// Retrieve a copy of the file.
-		return e_ftpcmd_retr;
+		send_to_client(client_connection, "425 Can't secure data connection\r\n");
+		return;
 	}
-	else if (command_name == "SIZE")
+
+	// listing lines are built with CRLF already
+	transfer.data_type = e_data_transfer_mode_binary;
+
+	bool transfer_ok = true;
+
+	// names are translated, so every client encoding (and set of facts) has its own listing
+	int variant = (int)client_connection->current_encoding() | ((int)format << 8);
+	if (format == e_listing_format_mlsd)
+		variant |= (int)client_connection->mlst_facts() << 16;
+
+	// only whole listings of a directory are kept
+	bool cacheable = name_pattern.empty() && name_prefix.empty() && !recursive;
+
+	bool truncated = false;
+
+	auto listing = cacheable ? m_listing_cache.find(directory, variant) : nullptr;
+	if (recursive)
 	{
-		// Return the size of a file.
-		return e_ftpcmd_size;
+		transfer_ok = send_recursive_listing(client_connection, transfer,
+			directory, display_path, name_filter, truncated);
 	}
-	else if (command_name == "MKD")
+	else if (listing)
 	{
-		// Make directory.
-		return e_ftpcmd_mkd;
+		// cached block is shared, it goes out as is in chunks (rate limits are checked per chunk)
+		const char* data = listing->data();
+		size_t data_left = listing->size();
+
+		while (data_left > 0)
+		{
+			size_t chunk_sz = data_left < transfer.chunk_size ? data_left : transfer.chunk_size;
+
+			if (!send_transfer_data(client_connection, transfer, data, chunk_sz))
+			{
+				transfer_ok = false;
+				break;
+			}
+
+			data += chunk_sz;
+			data_left -= chunk_sz;
+		}
 	}
-	else if (command_name == "RNFR")
+	else
 	{
-		// Rename from.
-		return e_ftpcmd_rnfr;
+		auto ticket = cacheable ? m_listing_cache.begin_fill(directory) : 0;
+
+		// copy for the cache, dropped once the listing outgrows its limit
+		std::shared_ptr<std::string> rendered;
+		if (ticket)
+			rendered = std::make_shared<std::string>();
+
+		// lines are rendered into a chunk sized buffer which goes out in one send,
+		// blocking send holds the enumeration back when the client reads slowly
+		std::string out;
+		out.reserve(transfer.chunk_size + LIST_LINE_RESERVE_SIZE);
+
+		auto flush = [&]() -> bool
+		{
+			if (rendered)
+			{
+				if (rendered->size() + out.size() <= m_listing_cache.listing_size_limit())
+					rendered->append(out);
+				else
+					rendered.reset();
+			}
+
+			bool ok = send_transfer_data(client_connection, transfer, out.data(), out.size());
+
+			out.clear();
+
+			if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+				tune_transfer_chunk_size(transfer, false);
+
+			return ok;
+		};
+
+		bool enum_ok = directory_iterator.enum_files
+		(
+			[&](const filesystem_tools::directory_iterator_c::entity_info_s& entity) -> bool
+			{
+				if (format == e_listing_format_nlst)
+				{
+					// like ls without -a
+					if (entity.name == "." || entity.name == "..")
+						return true;
+
+					out += name_prefix;
+					append_translated_name(client_connection, entity.name, out);
+					out += "\r\n";
+				}
+				else if (format == e_listing_format_mlsd)
+				{
+					format_mlsx_entry(client_connection, entity, out);
+				}
+				else
+				{
+					format_list_entry(client_connection, entity, out);
+				}
+
+				if (out.size() >= transfer.chunk_size && !flush())
+				{
+					transfer_ok = false;
+					return false;
+				}
+
+				return true; // true = continue, false = interrupt
+			},
+
+			directory,
+
+			// names are all NLST needs
+			format != e_listing_format_nlst,
+
+			name_filter.empty() ? nullptr : &name_filter
+		);
+
+		if (transfer_ok && !out.empty() && !flush())
+			transfer_ok = false;
+
+		// partial listing is never kept
+		m_listing_cache.end_fill(directory, variant,
+			enum_ok && transfer_ok ? rendered : nullptr, ticket);
 	}
-	else if (command_name == "RNTO")
+
+	if (!transfer_ok || !finish_data_transfer(transfer))
 	{
-		// Rename from.
-		return e_ftpcmd_rnto;
+		send_to_client(client_connection, "426 Broken pipe\r\n");
+		return;
 	}
-	else if (command_name == "RMD")
+
+	if (keep_data_connection(client_connection, transfer))
 	{
-		// Remove a directory.
-		return e_ftpcmd_rmd;
+		data_socket_ptr.set(0);
 	}
-	else if (command_name == "STOR")
+
+	if (truncated)
 	{
-		// Accept the data and to store the data as a file at the server site.
-		return e_ftpcmd_stor;
+		send_to_client(client_connection, "226 Transfer Complete, listing truncated by the server limits\r\n");
+		return;
 	}
 
-	return e_ftpcmd_unknown;
+	send_to_client(client_connection, "226 Transfer Complete\r\n");
 }
 
 
-void ftp_server_c::handle_command(ftp_client_connection_c* client_connection,
-	e_command_types command,
-	const std::string& command_value)
+bool ftp_server_c::send_recursive_listing(ftp_client_connection_c* client_connection,
+	data_transfer_s& transfer,
+	const std::string& directory,
+	const std::string& display_path,
+	const filesystem_tools::helpers::glob_matcher_c& name_filter,
+	bool& truncated)
 {
-	switch (command)
+	using entity_info_s = filesystem_tools::directory_iterator_c::entity_info_s;
+	using attrs = filesystem_tools::directory_iterator_c::e_attributes;
+
+	enum e_node_state
 	{
-	case e_command_types::e_ftpcmd_user:
+		e_node_pending,
+		e_node_taken,
+		e_node_done
+	};
+
+	enum e_render_result
 	{
-		send_to_client(client_connection, "331 pretend login accepted\r\n");
-	}
-	break;
-	case e_command_types::e_ftpcmd_pass:
+		e_render_complete,
+		e_render_interrupted,	// on_chunk returned false
+		e_render_limit			// entries limit was hit, lines up to it are rendered
+	};
+
+	// directory of the tree; key is the path of child indexes from the root,
+	// so keys go in the order of output and the smallest pending one is needed soonest
+	struct list_node_s
 	{
-		send_to_client(client_connection, "230 fake user logged in\r\n");
-	}
-	break;
-	case e_command_types::e_ftpcmd_opts:
+		std::vector<uint32_t> key;
+		std::string path;		// native, with trailing slash
+		std::string display;	// header of the listing, encoding of the client
+		uint32_t depth;
+		e_node_state state;
+		std::string text;		// rendered by a worker, waits for the sender
+		uint64_t entries;		// lines of the text
+		uint64_t device;
+		uint64_t inode;
+		bool cancelled;			// given up by the sender, the worker drops its result
+		std::vector<std::shared_ptr<list_node_s>> children;
+	};
+
+	typedef std::shared_ptr<list_node_s> list_node_t;
+
+	std::mutex mutex;
+	std::condition_variable state_changed;
+
+	std::map<std::vector<uint32_t>, list_node_t> pending;
+
+	// directories already listed, symlinks and bind mounts may lead back up the tree
+	std::set<std::pair<uint64_t, uint64_t>> visited;
+
+	size_t buffered = 0;
+	bool stop = false;
+
+	// entries limit counts the lines in the order of output, so only the sender
+	// knows when it is hit; entries rendered ahead by workers just tell them
+	// when there is no point to go on
+	std::atomic<uint64_t> entries_sent(0);
+	std::atomic<uint64_t> entries_rendered(0);
+	bool limit_reached = false;
+
+	// nothing to enumerate ahead without subdirectories
+	uint32_t workers_count = m_recursive_list_max_depth ? m_recursive_list_threads : 0;
+
+	// bigger directory is given up by the worker and streamed by the sender
+	size_t worker_text_limit = RECURSIVE_LIST_BUFFER_SIZE / (workers_count ? workers_count : 1);
+
+	auto root = std::make_shared<list_node_s>();
 	{
-		if (command_value == "utf8 on")
-		{
-			client_connection->set_encoding(e_encoding_utf8);
-		}
-
-		send_to_client(client_connection, "200 ok\r\n");
+		root->path = directory;
+		root->display = display_path;
+		root->depth = 0;
+		root->state = e_node_pending;
+		root->entries = 0;
+		root->device = 0;
+		root->inode = 0;
+		root->cancelled = false;
+
+		filesystem_tools::directory_iterator_c::entity_info_s info;
+		if (filesystem_tools::directory_iterator_c::get_entity_info(directory, info) && info.inode)
+			visited.emplace(info.device, info.inode);
 	}
-	break;
-	case e_command_types::e_ftpcmd_pwd:
+
+	// lines of the directory go to out, on_chunk is called once out reaches
+	// a chunk and interrupts the enumeration with false;
+	// entries_before are the entries counted so far, node.entries are added by the caller
+	auto render = [&](filesystem_tools::directory_iterator_c& iterator, list_node_s& node,
+		std::string& out, const std::function<bool()>& on_chunk,
+		const std::atomic<uint64_t>& entries_before) -> e_render_result
 	{
-		auto& directory_iterator = client_connection->get_directory_iterator();
+		e_render_result result = e_render_complete;
 
-		auto current_directory_relative_path = "/" + directory_iterator.relative_path();
+		node.entries = 0;
 
-		translate_path
+		// subdirectories are descended even if their names do not match
+		bool descend = node.depth < m_recursive_list_max_depth;
+
+		if (!node.key.empty())
+			out += "\r\n";
+		out += node.display;
+		out += ":\r\n";
+
+		iterator.enum_files
 		(
-			client_connection,
-			current_directory_relative_path,
-			m_native_encoding,
-			client_connection->current_encoding()
+			[&](const entity_info_s& entity) -> bool
+			{
+				bool is_directory = (entity.attributes & attrs::e_attribute_directory) != 0;
+
+				// files are filtered by enum_files before they are stat'ed
+				if (!is_directory || name_filter.empty() || name_filter.match(entity.name))
+				{
+					if (entries_before + node.entries + 1 > m_recursive_list_max_entries)
+					{
+						result = e_render_limit;
+						return false;
+					}
+
+					++node.entries;
+
+					format_list_entry(client_connection, entity, out);
+				}
+
+				if (is_directory && descend
+					&& entity.name != "." && entity.name != "..")
+				{
+					auto child = std::make_shared<list_node_s>();
+					{
+						child->key = node.key;
+						child->key.push_back((uint32_t)node.children.size());
+						child->path = filesystem_tools::helpers::rebuild_path(node.path + entity.name);
+						child->display = node.display;
+						child->display += '/';
+						append_translated_name(client_connection, entity.name, child->display);
+						child->depth = node.depth + 1;
+						child->state = e_node_pending;
+						child->entries = 0;
+						child->device = entity.device;
+						child->inode = entity.inode;
+						child->cancelled = false;
+					}
+
+					bool seen = false;
+
+					if (entity.inode)
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						seen = !visited.emplace(entity.device, entity.inode).second;
+					}
+
+					if (!seen)
+						node.children.push_back(child);
+				}
+
+				if (out.size() >= transfer.chunk_size && !on_chunk())
+				{
+					result = e_render_interrupted;
+					return false;
+				}
+
+				return true; // true = continue, false = interrupt
+			},
+
+			node.path,
+
+			true,
+
+			name_filter.empty() ? nullptr : &name_filter,
+
+			descend
 		);
 
+		return result;
+	};
 
-		char buf[MAX_PATH + 32] = "";
-		sprintf(buf, "257 \"%s\"\r\n", current_directory_relative_path.c_str());
-		send_to_client(client_connection, buf);
-	}
-	break;
-	case e_command_types::e_ftpcmd_type:
-	{
-		char buf[MAX_PATH + 32] = "";
-		sprintf(buf, "200 Type set to I\r\n");
-		send_to_client(client_connection, buf);
-	}
-	break;
-	case e_command_types::e_ftpcmd_cwd:
+	auto worker = [&]()
 	{
-		auto& directory_iterator = client_connection->get_directory_iterator();
+		filesystem_tools::directory_iterator_c iterator;
 
-		auto current_path = directory_iterator.absolute_path();
+		std::unique_lock<std::mutex> lock(mutex);
 
-		if (command_value[0] == '/')
+		while (true)
 		{
-			directory_iterator.move_to_root();
+			// entries rendered already are enough to hit the limit, the rest is the sender's
+			state_changed.wait(lock, [&]()
+			{
+				return stop || (!pending.empty() && buffered < RECURSIVE_LIST_BUFFER_SIZE
+					&& entries_rendered < m_recursive_list_max_entries);
+			});
+
+			if (stop)
+				break;
+
+			auto node = pending.begin()->second;
+			pending.erase(pending.begin());
+
+			node->state = e_node_taken;
+
+			lock.unlock();
+
+			std::string text;
+
+			auto result = render(iterator, *node, text, [&]() -> bool
+			{
+				return text.size() < worker_text_limit;
+			}, entries_rendered);
+
+			lock.lock();
+
+			if (node->cancelled)
+			{
+				// the parent is listed again by the sender, this subtree is not wanted
+				for (auto& child : node->children)
+				{
+					if (child->inode)
+						visited.erase(std::make_pair(child->device, child->inode));
+				}
+
+				node->children.clear();
+				node->state = e_node_done;
+			}
+			else if (result == e_render_complete)
+			{
+				entries_rendered += node->entries;
+
+				node->text = std::move(text);
+				node->state = e_node_done;
+
+				buffered += node->text.size();
+
+				for (auto& child : node->children)
+					pending.emplace(child->key, child);
+			}
+			else
+			{
+				// too big or maybe beyond the limit: left to the sender,
+				// which lists it again from the start, counting exactly
+				for (auto& child : node->children)
+				{
+					if (child->inode)
+						visited.erase(std::make_pair(child->device, child->inode));
+				}
+
+				node->children.clear();
+				node->entries = 0;
+				node->state = e_node_pending;
+			}
+
+			state_changed.notify_all();
 		}
+	};
 
-		std::string translated_path;
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < workers_count; ++i)
+		workers.emplace_back(worker);
 
-		if (client_connection->current_encoding() == e_encoding_utf8)
+	bool transfer_ok = true;
+
+	auto send_text = [&](const char* data, size_t data_left) -> bool
+	{
+		while (data_left > 0)
 		{
-			translated_path.resize(MAX_PATH);
-			convert_utf8_to_windows1251(command_value.c_str(), &translated_path[0], translated_path.size());
+			size_t chunk_sz = data_left < transfer.chunk_size ? data_left : transfer.chunk_size;
+
+			if (!send_transfer_data(client_connection, transfer, data, chunk_sz))
+				return false;
+
+			data += chunk_sz;
+			data_left -= chunk_sz;
+
+			if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+				tune_transfer_chunk_size(transfer, false);
 		}
-		else
+
+		return true;
+	};
+
+	// children of a node listed again are dropped with all rendered below them;
+	// the ones taken by workers are only marked, the workers drop them on return
+	std::function<void(list_node_s&)> abandon_children = [&](list_node_s& node)
+	{
+		for (auto& child : node.children)
 		{
-			translated_path = command_value;
+			child->cancelled = true;
+
+			if (child->inode)
+				visited.erase(std::make_pair(child->device, child->inode));
+
+			if (child->state == e_node_pending)
+			{
+				pending.erase(child->key);
+			}
+			else if (child->state == e_node_done)
+			{
+				buffered -= child->text.size();
+				std::string().swap(child->text);
+
+				entries_rendered -= child->entries;
+
+				abandon_children(*child);
+			}
+		}
+
+		node.children.clear();
+	};
+
+	// output goes depth first, a directory right before its subdirectories
+	std::vector<list_node_t> stack;
+	stack.push_back(root);
+
+	std::string out;
+	out.reserve(transfer.chunk_size + LIST_LINE_RESERVE_SIZE);
+
+	while (!stack.empty() && !limit_reached)
+	{
+		auto node = stack.back();
+		stack.pop_back();
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		state_changed.wait(lock, [&]() { return node->state != e_node_taken; });
+
+		// listing rendered ahead which goes beyond the limit is listed again up to it
+		if (node->state == e_node_done
+			&& entries_sent + node->entries > m_recursive_list_max_entries)
+		{
+			buffered -= node->text.size();
+			std::string().swap(node->text);
+
+			entries_rendered -= node->entries;
+
+			abandon_children(*node);
+
+			node->entries = 0;
+			node->state = e_node_pending;
+
+			state_changed.notify_all();
 		}
 
-		if (directory_iterator.change_dir(translated_path))
+		if (node->state == e_node_pending)
 		{
-			char buf[MAX_PATH + 32] = "";
-			sprintf(buf, "250 CWD command successful\r\n");
-			send_to_client(client_connection, buf);
+			// not taken yet (or too big for a worker), streamed right away
+			pending.erase(node->key);
+			node->state = e_node_taken;
 
-			printf("current path: %s, next dir: %s, real path: %s\n",
-				current_path.c_str(), translated_path.c_str(),
-				directory_iterator.absolute_path().c_str());
+			lock.unlock();
+
+			auto result = render(client_connection->get_directory_iterator(), *node, out, [&]() -> bool
+			{
+				bool ok = send_text(out.data(), out.size());
+				out.clear();
+				return ok;
+			}, entries_sent);
+
+			if (result != e_render_interrupted && !send_text(out.data(), out.size()))
+				result = e_render_interrupted;
+
+			out.clear();
+
+			if (result == e_render_interrupted)
+			{
+				transfer_ok = false;
+				break;
+			}
+
+			lock.lock();
+
+			entries_sent += node->entries;
+			entries_rendered += node->entries;
+
+			node->state = e_node_done;
+
+			if (result == e_render_limit)
+			{
+				// the rest of the tree is not listed
+				limit_reached = true;
+				node->children.clear();
+			}
+
+			for (auto& child : node->children)
+				pending.emplace(child->key, child);
+
+			state_changed.notify_all();
 		}
 		else
 		{
-			send_to_client(client_connection, "550 Could not change directory");
-			return;
-		}
-	}
-	break;
-	case e_command_types::e_ftpcmd_pasv:
-	{
-		// create passive channel
-		{
-			uint16_t p1, p2;
-			gen_port(p1, p2);// ftp_get_first_free_port();
-			uint16_t port = (256 * p1) + p2;
+			std::string text = std::move(node->text);
 
-			auto prev_data_sock = client_connection->data_socket();
-			if (prev_data_sock)
-			{
-				closesocket(prev_data_sock);
-				client_connection->assign_data_socket(0);
-			}
+			lock.unlock();
 
-			SOCKET new_channel = 0;
-			if (initialize_sock_channel(new_channel, port, false))
-			{
-				client_connection->set_data_channel_mode(e_data_channel_mode_passive);
+			bool ok = send_text(text.data(), text.size());
 
-				client_connection->assign_data_socket(new_channel);
-				uint32_t ip[4];
-				memset(ip, 0, sizeof(ip));
-				get_ip_data(client_connection->command_socket(), ip);
+			lock.lock();
 
-				char buf[62] = "";
-				sprintf(buf, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n",
-					ip[0], ip[1], ip[2], ip[3], p1, p2);
+			entries_sent += node->entries;
 
-				send_to_client(client_connection, buf);
-			}
-			else
+			buffered -= text.size();
+			state_changed.notify_all();
+
+			if (!ok)
 			{
-				// todo: send error, log error
+				transfer_ok = false;
+				break;
 			}
 		}
+
+		for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+			stack.push_back(*it);
+
+		node->children.clear();
 	}
-	break;
-	case e_ftpcmd_list:
-	{
-		handle_list_command(client_connection);
-	}
-	break;
-	case e_ftpcmd_syst:
-	{
-		send_to_client(client_connection, "215 WIN32 SingularFTP v.0.01\r\n");
-		break;
-	}
-	break;
-	case e_ftpcmd_feat:
-	{
-		send_to_client(client_connection, "500 command not recognized\r\n");
-		break;
-	}
-	break;
-	case e_ftpcmd_help:
+
 	{
-		send_to_client(client_connection, "500 command not recognized\r\n");
-		break;
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
 	}
-	break;
-	case e_ftpcmd_noop:
+
+	state_changed.notify_all();
+
+	for (auto& worker_thread : workers)
+		worker_thread.join();
+
+	truncated = limit_reached;
+
+	return transfer_ok;
+}
+
+
+// decimal digits right aligned in width (wider values are not cut), returns end of the text
+static char* format_uint_padded(char* p, uint64_t value, int width, char pad = ' ')
+{
+	char digits[20];
+	int digits_count = 0;
+
+	do
 	{
-		send_to_client(client_connection, "200 OK\r\n");
-		break;
+		digits[digits_count++] = (char)('0' + value % 10);
+		value /= 10;
 	}
-	break;
-	case e_ftpcmd_delete:
-	{
-		auto full_path = client_connection->current_directory() + command_value;
+	while (value);
 
-		if (client_connection->current_encoding() != m_native_encoding)
-		{
-			translate_path
-			(
-				client_connection, full_path,
-				client_connection->current_encoding(),
-				m_native_encoding
-			);
-		}
+	for (int i = digits_count; i < width; ++i)
+		*p++ = pad;
 
-		// todo: check permissions
-		//send_to_client(client_connection, "550 Path permission error\r\n");
+	while (digits_count > 0)
+		*p++ = digits[--digits_count];
 
-		if (unlink(full_path.c_str()) != 0)
-		{
-			send_system_error(client_connection);
-			return;
-		}
-		else
-		{
-			send_to_client(client_connection, "250 DELE command successful\r\n");
-		}
-	}
-	break;
-	case e_ftpcmd_cdup:
-	{
-		auto& directory_iterator = client_connection->get_directory_iterator();
+	return p;
+}
 
-		directory_iterator.move_prev_dir();
 
-		send_to_client(client_connection, "200 OK\r\n");
-	}
-	break;
-	case e_ftpcmd_retr:
+// lower case hex digits without leading zeros, returns end of the text
+static char* format_uint_hex(char* p, uint64_t value)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+
+	char digits[16];
+	int digits_count = 0;
+
+	do
 	{
-		handle_retr_command(client_connection, command_value);
+		digits[digits_count++] = hex_digits[value & 0xf];
+		value >>= 4;
 	}
-	break;
-	case e_ftpcmd_size:
-	{
-		auto full_path = client_connection->current_directory() + command_value;
+	while (value);
 
-		translate_path
-		(
-			client_connection,
-			full_path,
-			client_connection->current_encoding(),
-			m_native_encoding
-		);
+	while (digits_count > 0)
+		*p++ = digits[--digits_count];
 
-		struct stat file_stats;
-		if (stat(full_path.c_str(), &file_stats))
-		{
-			send_system_error(client_connection);
-			return;
-		}
+	return p;
+}
 
-		char buf[32];
-		sprintf(buf, "213 %d\r\n", (int)file_stats.st_size);
-		send_to_client(client_connection, buf);
-	}
-	break;
-	case e_ftpcmd_mkd:
+
+void ftp_server_c::format_list_entry(ftp_client_connection_c* client_connection,
+	const filesystem_tools::directory_iterator_c::entity_info_s& entity, std::string& out)
+{
+	// independed of locale, same as "%b %d  %Y" of strftime
+	static const char months_str[12][4] =
 	{
-		auto full_path = client_connection->current_directory() + command_value;
+		"Jan",
+		"Feb",
+		"Mar",
+		"Apr",
+		"May",
+		"Jun",
+		"Jul",
+		"Aug",
+		"Sep",
+		"Oct",
+		"Nov",
+		"Dec"
+	};
+
+	using attrs = filesystem_tools::directory_iterator_c::e_attributes;
+
+	char directory_attr = entity.attributes & attrs::e_attribute_directory ? 'd' : '-';
+
+	char write_attr = entity.attributes & attrs::e_attribute_readonly ? '-' : 'w';
+
+	// "drw-rw-rw-   1 root  root    %7llu Mon d  yyyy "
+	char line_buf[128];
+	char* p = line_buf;
+	{
+		*p++ = directory_attr;
+		*p++ = 'r'; *p++ = write_attr; *p++ = '-';
+		*p++ = 'r'; *p++ = write_attr; *p++ = '-';
+		*p++ = 'r'; *p++ = write_attr; *p++ = '-';
 
-		translate_path
-		(
-			client_connection,
-			full_path,
-			client_connection->current_encoding(),
-			m_native_encoding
-		);
+		static const char owner_str[] = "   1 root  root    ";
+		memcpy(p, owner_str, sizeof(owner_str) - 1);
+		p += sizeof(owner_str) - 1;
 
-		auto mkdir_result = mkdir(full_path.c_str()
-#ifndef WIN32
-			, 0777
-#endif
-			);
+		p = format_uint_padded(p, entity.file_size_bytes, 7);
+		*p++ = ' ';
 
-		// todo: check permissions
-		//send_to_client(client_connection, "550 Path permission error\r\n");
+		memcpy(p, months_str[(unsigned)entity.write_time.tm_mon % 12], 3);
+		p += 3;
+		*p++ = ' ';
 
-		if (mkdir_result == 0)
-		{
-			send_to_client(client_connection, "257 Directory created\r\n");
-		}
-		else
-		{
-			send_system_error(client_connection);
-			return;
-		}
+		p = format_uint_padded(p, (uint64_t)entity.write_time.tm_mday, 0);
+		*p++ = ' ';
+		*p++ = ' ';
+
+		p = format_uint_padded(p, (uint64_t)(entity.write_time.tm_year + 1900), 0);
+		*p++ = ' ';
 	}
-	break;
-	case e_ftpcmd_rnfr:
-	{
-		auto full_path = client_connection->current_directory() + command_value;
 
-		translate_path
-		(
-			client_connection,
-			full_path,
-			client_connection->current_encoding(),
-			m_native_encoding
-		);
+	out.append(line_buf, p - line_buf);
 
-		struct stat st;
+	append_translated_name(client_connection, entity.name, out);
 
-		if (stat(full_path.c_str(), &st) == 0)
-		{
-			send_to_client(client_connection, "350 File Exists\r\n");
-			client_connection->set_rename_file_path(full_path);
-		}
-		else
-		{
-			send_to_client(client_connection, "550 Path permission error\r\n");
-			client_connection->set_rename_file_path("");
-		}
-		
-	}
-	break;
-	case e_ftpcmd_rnto:
-	{
-		auto rename_to_full_path = client_connection->current_directory() + command_value;
+	out += "\r\n";
+}
 
-		translate_path
-		(
-			client_connection,
-			rename_to_full_path,
-			client_connection->current_encoding(),
-			m_native_encoding
-		);
 
-		auto rename_from_full_path = client_connection->rename_file_path();
+void ftp_server_c::format_mlsx_entry(ftp_client_connection_c* client_connection,
+	const filesystem_tools::directory_iterator_c::entity_info_s& entity, std::string& out)
+{
+	using attrs = filesystem_tools::directory_iterator_c::e_attributes;
 
-		// todo: check permissions
-		//send_to_client(client_connection, "550 Path permission error\r\n");
+	bool is_directory = (entity.attributes & attrs::e_attribute_directory) != 0;
+	bool is_readonly = (entity.attributes & attrs::e_attribute_readonly) != 0;
 
-		if (rename(rename_from_full_path.c_str(), rename_to_full_path.c_str()) != 0)
-		{
-			send_system_error(client_connection);
-			return;
-		}
-		else
-		{
-			send_to_client(client_connection, "250 RNTO command successful\r\n");
-		}
-	}
-	break;
-	case e_ftpcmd_rmd:
-	{
-		auto full_path = client_connection->current_directory() + command_value;
+	uint32_t facts = client_connection->mlst_facts();
 
-		translate_path
-		(
-			client_connection,
-			full_path,
-			client_connection->current_encoding(),
-			m_native_encoding
-		);
+	char facts_buf[160];
+	char* p = facts_buf;
 
-		// todo: check permissions
-		//send_to_client(client_connection, "550 Path permission error\r\n");
+	// size of a directory means nothing to clients
+	if ((facts & e_mlst_fact_size) && !is_directory)
+	{
+		memcpy(p, "size=", 5);
+		p += 5;
+		p = format_uint_padded(p, entity.file_size_bytes, 0);
+		*p++ = ';';
+	}
 
-		if (remove_directory_r(full_path.c_str(), false))
-		{
-			send_to_client(client_connection, "250 RMD command successful\r\n");
-		}
-		else
-		{
-			send_system_error(client_connection);
-			return;
-		}
+	if (facts & e_mlst_fact_modify)
+	{
+		// YYYYMMDDHHMMSS, UTC
+		struct tm utc_time;
+#ifdef WIN32
+		gmtime_s(&utc_time, &entity.write_time_unix);
+#else
+		gmtime_r(&entity.write_time_unix, &utc_time);
+#endif
+
+		memcpy(p, "modify=", 7);
+		p += 7;
+		p = format_uint_padded(p, (uint64_t)(utc_time.tm_year + 1900), 4, '0');
+		p = format_uint_padded(p, (uint64_t)(utc_time.tm_mon + 1), 2, '0');
+		p = format_uint_padded(p, (uint64_t)utc_time.tm_mday, 2, '0');
+		p = format_uint_padded(p, (uint64_t)utc_time.tm_hour, 2, '0');
+		p = format_uint_padded(p, (uint64_t)utc_time.tm_min, 2, '0');
+		p = format_uint_padded(p, (uint64_t)utc_time.tm_sec, 2, '0');
+		*p++ = ';';
 	}
-	break;
-	case e_ftpcmd_stor:
+
+	if (facts & e_mlst_fact_type)
 	{
-		handle_stor_command(client_connection, command_value);
+		const char* type = !is_directory ? "file"
+			: entity.name == "." ? "cdir"
+			: entity.name == ".." ? "pdir"
+			: "dir";
+
+		size_t type_len = strlen(type);
+
+		memcpy(p, "type=", 5);
+		p += 5;
+		memcpy(p, type, type_len);
+		p += type_len;
+		*p++ = ';';
 	}
-	break;
-	default:
+
+	if (facts & e_mlst_fact_perm)
 	{
-		send_to_client(client_connection, "500 command not recognized\r\n");
+		// what the server lets the client do (no per user permissions yet)
+		const char* perm = is_directory ?
+			(is_readonly ? "el" : "cdeflmp") :
+			(is_readonly ? "r" : "adfrw");
+
+		size_t perm_len = strlen(perm);
+
+		memcpy(p, "perm=", 5);
+		p += 5;
+		memcpy(p, perm, perm_len);
+		p += perm_len;
+		*p++ = ';';
 	}
-	break;
+
+	// only if the filesystem has inode numbers
+	if ((facts & e_mlst_fact_unique) && entity.inode)
+	{
+		memcpy(p, "unique=", 7);
+		p += 7;
+		p = format_uint_hex(p, entity.device);
+		*p++ = 'U';
+		p = format_uint_hex(p, entity.inode);
+		*p++ = ';';
 	}
+
+	*p++ = ' ';
+
+	out.append(facts_buf, p - facts_buf);
+
+	append_translated_name(client_connection, entity.name, out);
+
+	out += "\r\n";
 }
 
 
-void ftp_server_c::handle_list_command(ftp_client_connection_c* client_connection)
+void ftp_server_c::invalidate_cached_path(const std::string& path, bool directory_tree)
 {
-	auto& directory_iterator = client_connection->get_directory_iterator();
+	m_listing_cache.invalidate_path(path);
 
-	send_to_client(client_connection, "150 Opening connection\r\n");
+	if (directory_tree)
+		m_metadata_cache.invalidate_tree(path);
+	else
+		m_metadata_cache.invalidate_path(path);
+}
 
-	smart_socket data_socket_ptr
-	(
-		accept(client_connection->data_socket(), NULL, NULL)
-	);
 
-	if (data_socket_ptr.get() == 0)
+void ftp_server_c::append_translated_name(ftp_client_connection_c* client_connection,
+	const std::string& name, std::string& out)
+{
+	if (client_connection->current_encoding() == m_native_encoding)
 	{
-		// todo: handle error
+		out += name;
+		return;
 	}
 
-	directory_iterator.enum_files
-	(
-		[&](const filesystem_tools::directory_iterator_c::entity_info_s& entity) -> bool
-		{
-			char answer_buf[256] = "";
-
-			char write_datetime_str[20] = "";
-#if 0 // depends on locale
-			strftime(write_datetime_str, 20, "%b %d  %Y", &entity.write_time);
-#else	// independed format
-			static const char* months_str[12] =
-			{
-				"Jan",
-				"Feb",
-				"Mar",
-				"Apr",
-				"May",
-				"Jun",
-				"Jul",
-				"Aug",
-				"Sep",
-				"Oct",
-				"Nov",
-				"Dec"
-			};
-
-			sprintf(write_datetime_str, "%s %d  %d",
-				months_str[entity.write_time.tm_mon],
-				entity.write_time.tm_mday,
-				entity.write_time.tm_year + 1900);
-#endif
+	// translate to target encoding
+	std::string translated_name = name;
 
-			using attrs = filesystem_tools::directory_iterator_c::e_attributes;
+	translate_path
+	(
+		client_connection,
+		translated_name,
+		this->naive_encoding(),
+		client_connection->current_encoding()
+	);
 
-			char directory_attr = entity.attributes & attrs::e_attribute_directory ? 'd' : '-';
+	// converted name is padded with zeros
+	out += translated_name.c_str();
+}
 
-			char write_attr = entity.attributes & attrs::e_attribute_readonly ? '-' : 'w';
 
-			// translate to target encoding
-			std::string translated_entity_name = entity.name;
+void ftp_server_c::handle_mlst_command(ftp_client_connection_c* client_connection,
+	const std::string& command_value)
+{
+	auto& directory_iterator = client_connection->get_directory_iterator();
 
-			translate_path
-			(
-				client_connection,
-				translated_entity_name,
-				this->naive_encoding(),
-				client_connection->current_encoding()
-			);
+	std::string full_path;
+	if (!directory_iterator.resolve_path(command_value, full_path))
+	{
+		send_to_client(client_connection, "550 No such file or directory\r\n");
+		return;
+	}
 
-			sprintf
-			(
-				answer_buf,
-				"%cr%c-r%c-r%c-   1 root  root    %7u %s %s\r\n",
+	translate_path
+	(
+		client_connection,
+		full_path,
+		client_connection->current_encoding(),
+		m_native_encoding
+	);
 
-				directory_attr, write_attr, write_attr, write_attr,
-				(uint32_t)entity.file_size_bytes,
-				write_datetime_str,
-				translated_entity_name.c_str()
-			);
+	filesystem_tools::directory_iterator_c::entity_info_s info;
+	if (!filesystem_tools::directory_iterator_c::get_entity_info(full_path, info))
+	{
+		send_system_error(client_connection);
+		return;
+	}
 
-			send_to_client(data_socket_ptr.get(), answer_buf, strlen(answer_buf)); // todo
+	// entry carries the path as the client gave it (current directory if none)
+	std::string shown_path = command_value.empty() ?
+		"/" + directory_iterator.relative_path() :
+		command_value;
 
-#if defined(_DEBUG) && 0
-			if (entity.attributes & attrs::e_attribute_directory)
-			{
-				printf("  %s   <DIR>", entity.name.c_str());
-			}
-			else
-			{
-				printf("  %s   %ld bytes", entity.name.c_str(), entity.file_size_bytes);
-			}
+	std::string reply = "250-Listing " + shown_path + "\r\n ";
 
-			printf("   last write time: %04d-%02d-%02d %02d:%02d:%02d\n",
-				entity.write_time.tm_year + 1900,
-				entity.write_time.tm_mon + 1,
-				entity.write_time.tm_mday,
-				entity.write_time.tm_hour,
-				entity.write_time.tm_min,
-				entity.write_time.tm_sec);
-#endif
+	translate_path
+	(
+		client_connection,
+		shown_path,
+		client_connection->current_encoding(),
+		m_native_encoding
+	);
 
-			return true; // true = continue, false = interrupt
-		},
+	info.name = shown_path;
 
-		directory_iterator.absolute_path()
-	);
+	format_mlsx_entry(client_connection, info, reply);
 
-	send_to_client(client_connection, "226 Transfer Complete\r\n");
+	reply += "250 End\r\n";
+
+	send_to_client(client_connection, reply.c_str());
 }
 
 
@@ -1474,6 +6033,14 @@ void ftp_server_c::handle_retr_command(ftp_client_connection_c* client_connectio
 
 	// check file available
 	{
+		// probes for missing files are answered without open
+		metadata_cache_c::path_info_s info;
+		if (m_metadata_cache.find(full_file_path, info) == metadata_cache_c::e_cached_missing)
+		{
+			send_system_error(client_connection);
+			return;
+		}
+
 		//printf("open file: %s\n", full_file_path.c_str());
 
 		file_handle_ptr.reset(fopen(full_file_path.c_str(), "rb"));
@@ -1489,59 +6056,88 @@ void ftp_server_c::handle_retr_command(ftp_client_connection_c* client_connectio
 		}
 	}
 
-	send_to_client(client_connection, "150 Opening BINARY mode data connection\r\n");
+	uint64_t file_size = 0;
+	if (!get_file_size(file_handle_ptr.get(), file_size))
+	{
+		send_system_error(client_connection);
+		return;
+	}
+
+	auto restart_offset = client_connection->restart_offset();
+	if (restart_offset > file_size)
+	{
+		send_to_client(client_connection, "554 Invalid REST parameter\r\n");
+		return;
+	}
+
+	if (!send_transfer_starting(client_connection,
+		client_connection->data_transfer_mode() == e_data_transfer_mode_ascii ?
+			"150 Opening ASCII mode data connection\r\n" :
+			"150 Opening BINARY mode data connection\r\n"))
+	{
+		// PROT P: runs again when the data connection is secured
+		return;
+	}
+
 	smart_socket data_socket_ptr
 	(
-		accept(client_connection->data_socket(), NULL, NULL)
+		open_data_connection(client_connection)
 	);
 
-	if (data_socket_ptr.get() == 0)
+	if (data_socket_ptr.get() == INVALID_SOCKET)
 	{
-		// todo: handle error
+		send_to_client(client_connection, "425 Can't open data connection\r\n");
+		return;
 	}
 
 	//printf("data channel opened: %d\n", (int)data_socket_ptr.get());
 
-	// send file data
+	data_transfer_s transfer;
+	if (!begin_data_transfer(client_connection, transfer, data_socket_ptr.get(),
+		!deflate_tools::is_compressed_file_type(command_value)))
 	{
-#if defined(WIN32) || defined(__linux__)
-		struct stat st;
-		memset(&st, 0, sizeof(struct stat));
-		stat(full_file_path.c_str(), &st);
-		const size_t max_buf_sz = 1024 * 1024 * 10;
-		size_t buf_sz = st.st_size > max_buf_sz ? max_buf_sz : st.st_size;
-
-		auto dynamic_buf = new char[buf_sz];
-		std::unique_ptr<char*, array_deleter_s<char*>> smart_buf(&dynamic_buf);
-		char* buf = *smart_buf;
-#else	// ESP32
-		char buf[256];
-		size_t buf_sz = sizeof(buf);
+		send_to_client(client_connection, "425 Can't secure data connection\r\n");
+		return;
+	}
+
+	// stream mode (and MODE Z) file is sent by server loop, session may start next RETR meanwhile
+	bool background = transfer.transmission_mode == e_transmission_mode_stream;
+#ifdef FTPSERVER_WITH_ZLIB
+	background = background || transfer.transmission_mode == e_transmission_mode_deflate;
 #endif
 
-		while (!feof(file_handle_ptr.get()))
+	if (background)
+	{
+		auto background_transfer = std::make_shared<background_transfer_s>();
 		{
-			auto data_sz = fread(buf, 1, buf_sz, file_handle_ptr.get());
+			background_transfer->transfer = transfer;
+			background_transfer->file = file_handle_ptr.release();
+			background_transfer->file_offset = restart_offset;
+			background_transfer->file_end = file_size;
+		}
+		data_socket_ptr.set(0);
 
-			if (data_sz == 0)
-			{
-				break;
-			}
-			else if (data_sz < 0)
-			{
-				send_system_error(client_connection);
-				return;
-			}
+		start_background_transfer(client_connection, background_transfer);
 
-			if (!send_to_client(data_socket_ptr.get(), buf, data_sz))
-			{
-				printf("Failed to send data to sock %d\n",
-					(int)data_socket_ptr.get());
+		return;
+	}
 
-				send_to_client(client_connection, "426 Broken pipe\r\n");
-				return;
-			}
-		}
+	// send file data
+	if (!send_transfer_file(client_connection, transfer, file_handle_ptr.get(), restart_offset, file_size))
+	{
+		send_to_client(client_connection, "426 Connection closed; transfer aborted\r\n");
+		return;
+	}
+
+	if (!finish_data_transfer(transfer))
+	{
+		send_to_client(client_connection, "426 Broken pipe\r\n");
+		return;
+	}
+
+	if (keep_data_connection(client_connection, transfer))
+	{
+		data_socket_ptr.set(0);
 	}
 
 	send_to_client(client_connection, "226 Transfer Complete\r\n");
@@ -1549,7 +6145,7 @@ void ftp_server_c::handle_retr_command(ftp_client_connection_c* client_connectio
 
 
 void ftp_server_c::handle_stor_command(ftp_client_connection_c* client_connection,
-	const std::string& command_value)
+	const std::string& command_value, bool append)
 {
 	auto full_file_path = client_connection->current_directory() + command_value;
 	if (client_connection->current_encoding() == e_encoding_utf8)
@@ -1563,41 +6159,157 @@ void ftp_server_c::handle_stor_command(ftp_client_connection_c* client_connectio
 		);
 	}
 
-	smart_fp file_obj(fopen(full_file_path.c_str(), "wb"));
-	if (!file_obj)
+	auto restart_offset = client_connection->restart_offset();
+
+	partial_upload_t partial_upload;
+	if (!append)
 	{
-		send_system_error(client_connection);
+		partial_upload = find_partial_upload(full_file_path, client_connection->allocation_size());
+	}
+
+	smart_fp file_obj(nullptr);
+
+	if (partial_upload)
+	{
+		// ranges come in any order, so offset may be beyond the end of the part file
+		if (restart_offset >= partial_upload->expected_size)
+		{
+			send_to_client(client_connection, "554 Invalid REST parameter\r\n");
+			return;
+		}
+
+		file_obj.reset(fopen(partial_upload->part_path.c_str(), "r+b"));
+		if (!file_obj)
+		{
+			file_obj.reset(fopen(partial_upload->part_path.c_str(), "w+b"));
+		}
+
+		if (!file_obj)
+		{
+			send_system_error(client_connection);
+			return;
+		}
+	}
+	else
+	{
+		// REST + STOR overwrites the file from the offset, the head is kept
+		file_obj.reset(fopen(full_file_path.c_str(),
+			append ? "ab" : restart_offset ? "r+b" : "wb"));
+
+		if (!file_obj)
+		{
+			send_system_error(client_connection);
+			return;
+		}
+
+		if (!append && restart_offset)
+		{
+			uint64_t file_size = 0;
+			if (!get_file_size(file_obj.get(), file_size))
+			{
+				send_system_error(client_connection);
+				return;
+			}
+
+			if (restart_offset > file_size)
+			{
+				send_to_client(client_connection, "554 Invalid REST parameter\r\n");
+				return;
+			}
+		}
+	}
+
+	if (!append && restart_offset && !seek_file(file_obj.get(), restart_offset))
+	{
+		send_to_client(client_connection, "554 Invalid REST parameter\r\n");
+		return;
+	}
+
+	// file (or part file) may be new
+	invalidate_cached_path(full_file_path);
+
+	if (!send_transfer_starting(client_connection,
+		client_connection->data_transfer_mode() == e_data_transfer_mode_ascii ?
+			"150 Opening ASCII mode data connection\r\n" :
+			"150 Opening BINARY mode data connection\r\n"))
+	{
+		// PROT P: runs again when the data connection is secured
 		return;
 	}
 
-	send_to_client(client_connection, "150 Opening BINARY mode data connection\r\n");
 	smart_socket data_socket_ptr
 	(
-		accept(client_connection->data_socket(), NULL, NULL)
+		open_data_connection(client_connection)
 	);
 
-	if (data_socket_ptr.get() == 0)
+	if (data_socket_ptr.get() == INVALID_SOCKET)
+	{
+		send_to_client(client_connection, "425 Can't open data connection\r\n");
+		return;
+	}
+
+	data_transfer_s transfer;
+	if (!begin_data_transfer(client_connection, transfer, data_socket_ptr.get()))
+	{
+		send_to_client(client_connection, "425 Can't secure data connection\r\n");
+		return;
+	}
+
+	if (partial_upload)
+	{
+		partial_upload->writers += 1;
+	}
+
+	// binary stream is written with positioned writes by server loop,
+	// so several ranges of one file are received at once
+	if (!append
+		&& transfer.transmission_mode == e_transmission_mode_stream
+		&& transfer.data_type == e_data_transfer_mode_binary)
 	{
-		// todo
+		auto background_transfer = std::make_shared<background_transfer_s>();
+		{
+			background_transfer->transfer = transfer;
+			background_transfer->file = file_obj.release();
+			background_transfer->upload = true;
+			background_transfer->file_offset = restart_offset;
+			background_transfer->range_begin = restart_offset;
+			background_transfer->partial_upload = partial_upload;
+			background_transfer->file_path = full_file_path;
+		}
+		data_socket_ptr.set(0);
+
+		start_background_transfer(client_connection, background_transfer);
+
+		return;
 	}
 
 	// receive file data
 	{
 #if defined(WIN32) || defined(__linux__)
-		const size_t max_buf_sz = 1024 * 1024 * 10;
-		size_t buf_sz = max_buf_sz;
-
-		auto dynamic_buf = new char[buf_sz];
-		std::unique_ptr<char*, array_deleter_s<char*>> smart_buf(&dynamic_buf);
-		char* buf = *smart_buf;
+		std::vector<char> dynamic_buf;
 #else	// ESP32
 		char buf[256];
 		size_t buf_sz = sizeof(buf);
 #endif
 
+		uint64_t range_end = restart_offset;
+		bool received_ok = true;
+
 		while (true)
 		{
-			auto received_chunk_sz = recv(data_socket_ptr.get(), buf, sizeof(buf), 0);
+#if defined(WIN32) || defined(__linux__)
+			if (transfer.bytes_transferred >= transfer.next_chunk_tune)
+			{
+				tune_transfer_chunk_size(transfer, true);
+			}
+
+			resize_chunk_buffer(dynamic_buf, transfer.chunk_size);
+
+			char* buf = dynamic_buf.data();
+			size_t buf_sz = dynamic_buf.size();
+#endif
+
+			auto received_chunk_sz = recv_transfer_data(client_connection, transfer, buf, buf_sz);
 
 			if (received_chunk_sz == 0)
 			{
@@ -1605,21 +6317,227 @@ void ftp_server_c::handle_stor_command(ftp_client_connection_c* client_connectio
 			}
 			else if (received_chunk_sz < 0)
 			{
+				// connection reset, broken block or compressed stream
 				printf("read failed (received_chunk_sz: %d)\n", received_chunk_sz);
-				send_system_error(client_connection);
-				return;
+				send_to_client(client_connection, "426 Connection closed; transfer aborted\r\n");
+				received_ok = false;
+				break;
 			}
 
 			// Write to file
 			if (fwrite(buf, received_chunk_sz, 1, file_obj.get()) != 1)
 			{
 				send_system_error(client_connection);
-				return;
+				received_ok = false;
+				break;
 			}
+
+			range_end += received_chunk_sz;
+		}
+
+		// buffered data must reach the file before the client hears 226
+		file_obj.reset();
+
+		update_transfer_statistics(transfer, true);
+
+		if (partial_upload)
+		{
+			// part file is closed above, so it may be renamed
+			complete_upload_range(partial_upload, restart_offset, range_end);
+		}
+
+		invalidate_cached_path(full_file_path);
+
+		if (!received_ok)
+			return;
+
+		if (keep_data_connection(client_connection, transfer))
+		{
+			data_socket_ptr.set(0);
 		}
 
 		send_to_client(client_connection, "226 Transfer Complete\r\n");
 	}
 }
 
+
+void ftp_server_c::handle_security_command(ftp_client_connection_c* client_connection,
+	e_command_types command, const std::string& command_value)
+{
+#ifdef FTPSERVER_WITH_OPENSSL
+	if (!m_tls_context)
+	{
+		send_to_client(client_connection, "502 TLS is not configured\r\n");
+		return;
+	}
+
+	auto& control_tls = client_connection->control_tls();
+
+	switch (command)
+	{
+	case e_ftpcmd_auth:
+	{
+		if (control_tls)
+		{
+			send_to_client(client_connection, "503 TLS is already active\r\n");
+			break;
+		}
+
+		if (!strings_iequals(command_value, "TLS")
+			&& !strings_iequals(command_value, "TLS-C")
+			&& !strings_iequals(command_value, "SSL"))
+		{
+			send_to_client(client_connection, "504 Unsupported security mechanism\r\n");
+			break;
+		}
+
+		// the reply goes in clear, the handshake follows it; server loop drives
+		// the handshake and no command runs until it is over
+		send_to_client(client_connection, "234 AUTH TLS successful\r\n");
+
+		auto& handshake = client_connection->control_handshake();
+
+		handshake.session = std::make_shared<tls_tools::tls_session_c>(*m_tls_context,
+			(int)client_connection->command_socket(), false);
+		handshake.state = tls_tools::e_handshake_want_read;
+		handshake.deadline = time(NULL) + TLS_HANDSHAKE_TIMEOUT_SEC;
+	}
+	break;
+	case e_ftpcmd_pbsz:
+	{
+		if (!control_tls)
+		{
+			send_to_client(client_connection, "503 PBSZ requires AUTH TLS first\r\n");
+			break;
+		}
+
+		// TLS records are the protection buffers, so the size is always 0
+		client_connection->set_pbsz(true);
+
+		send_to_client(client_connection, "200 PBSZ=0\r\n");
+	}
+	break;
+	case e_ftpcmd_prot:
+	{
+		if (!control_tls || !client_connection->pbsz_set())
+		{
+			send_to_client(client_connection, "503 PROT requires PBSZ first\r\n");
+			break;
+		}
+
+		if (strings_iequals(command_value, "P"))
+		{
+			client_connection->set_data_protection(true);
+
+			send_to_client(client_connection, "200 PROT now Private\r\n");
+		}
+		else if (strings_iequals(command_value, "C"))
+		{
+			if (m_tls_required)
+			{
+				send_to_client(client_connection, "534 Data connections must be protected\r\n");
+				break;
+			}
+
+			client_connection->set_data_protection(false);
+
+			send_to_client(client_connection, "200 PROT now Clear\r\n");
+		}
+		else if (strings_iequals(command_value, "S") || strings_iequals(command_value, "E"))
+		{
+			send_to_client(client_connection, "536 Requested PROT level not supported\r\n");
+		}
+		else
+		{
+			send_to_client(client_connection, "504 Command not implemented for that parameter\r\n");
+		}
+	}
+	break;
+	default:
+		break;
+	}
+#else
+	(void)command;
+	(void)command_value;
+
+	send_to_client(client_connection, "502 Command not implemented\r\n");
+#endif
+}
+
+
+void ftp_server_c::handle_site_command(ftp_client_connection_c* client_connection,
+	const std::string& command_value)
+{
+	std::vector<std::string> args;
+	{
+		size_t pos = 0;
+		while (pos < command_value.size())
+		{
+			auto end = command_value.find(' ', pos);
+			if (end == std::string::npos)
+				end = command_value.size();
+
+			if (end > pos)
+				args.push_back(command_value.substr(pos, end - pos));
+
+			pos = end + 1;
+		}
+	}
+
+	if (args.empty() || !strings_iequals(args[0], "RATE"))
+	{
+		send_to_client(client_connection, "504 SITE command not implemented for that parameter\r\n");
+		return;
+	}
+
+	// "SITE RATE" shows the limits the session is under
+	if (args.size() == 1)
+	{
+		auto user_rate_limiter = client_connection->user_rate_limiter();
+
+		char buf[192];
+		snprintf(buf, sizeof(buf), "200 Rate limits (bytes/s, 0 - unlimited): global %llu, user %llu, session %llu\r\n",
+			(unsigned long long)m_global_rate_limiter.rate(),
+			(unsigned long long)(user_rate_limiter ? user_rate_limiter->rate() : 0),
+			(unsigned long long)client_connection->rate_limiter().rate());
+
+		send_to_client(client_connection, buf);
+		return;
+	}
+
+	// "SITE RATE SESSION <bytes per second> [<burst bytes>]" slows the session down;
+	// global and user limits are set by the server owner only (set_xxx_rate_limit)
+	uint64_t rate = 0;
+	uint64_t burst = 0;
+
+	if (args.size() < 3 || args.size() > 4
+		|| !strings_iequals(args[1], "SESSION")
+		|| !parse_uint64_argument(args[2], rate)
+		|| (args.size() == 4 && !parse_uint64_argument(args[3], burst)))
+	{
+		send_to_client(client_connection, "501 Invalid SITE RATE parameters\r\n");
+		return;
+	}
+
+	// limit of new sessions is the ceiling, 0 - unlimited
+	if (m_session_rate_limit != 0)
+	{
+		uint64_t max_burst = m_session_rate_burst ? m_session_rate_burst : m_session_rate_limit;
+
+		if (rate == 0 || rate > m_session_rate_limit || burst > max_burst)
+		{
+			send_to_client(client_connection, "550 SITE RATE may only lower the session limit\r\n");
+			return;
+		}
+
+		// one second of the new rate may be more than the burst allowed
+		if (burst == 0 && rate > max_burst)
+			burst = max_burst;
+	}
+
+	client_connection->rate_limiter().set_rate(rate, burst);
+
+	send_to_client(client_connection, "200 SITE RATE command successful\r\n");
+}
+
 }
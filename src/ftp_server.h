@@ -7,13 +7,32 @@
 
 #pragma once
 
+// large files on 32-bit linux, see filesystem_tools.h
+#if defined(__linux__) && !defined(_FILE_OFFSET_BITS)
+#	define _FILE_OFFSET_BITS 64
+#endif
+
 // stl
+#include <map>
+#include <list>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <memory>
 #include <string>
+#include <time.h>
 #include <stdint.h>
 
 // helpers
 #include "filesystem_tools.h"
+#include "ports_pool.h"
+#include "ranges_set.h"
+#include "token_bucket.h"
+#include "listing_cache.h"
+#include "metadata_cache.h"
+#include "deflate_tools.h"
+#include "ascii_tools.h"
+#include "tls_tools.h"
 
 //
 #if defined(WIN32)
@@ -23,6 +42,8 @@
 #	include <Windows.h>
 #	include <winsock2.h>
 
+#	define FTPSERVER_IPV6_SUPPORT
+
 #	define ESP_LOGE(LOG_TAG, ...)		\
 	printf("ERROR:	[%s] ", LOG_TAG);	\
 	printf(__VA_ARGS__);
@@ -36,6 +57,10 @@
 	printf(__VA_ARGS__);
 #elif defined(__linux__)
 #	include <unistd.h>
+#	include <sys/socket.h>
+#	include <netinet/in.h>
+
+#	define FTPSERVER_IPV6_SUPPORT
 
 #	define ESP_LOGE(LOG_TAG, ...)		\
 	printf("ERROR:	[%s] ", LOG_TAG);	\
@@ -73,6 +98,87 @@
 
 #define FTPSERVER_DEFAULT_PORT	21
 
+// same range gen_port() used to pick ports from
+#define FTPSERVER_DEFAULT_PASSIVE_FIRST_PORT	32768
+#define FTPSERVER_DEFAULT_PASSIVE_LAST_PORT		49151
+
+// passive channel which was not used for a transfer is closed after this,
+// transfer command waits as long for its data connection
+#define FTPSERVER_DEFAULT_DATA_CHANNEL_TIMEOUT_SEC	30
+
+// active mode (PORT/EPRT) connect to the client must complete within this
+#define FTPSERVER_DEFAULT_ACTIVE_CONNECT_TIMEOUT_SEC	10
+
+// ranged upload (ALLO + REST + STOR) no range arrived for this long is abandoned,
+// its part file is removed
+#define FTPSERVER_DEFAULT_PARTIAL_UPLOAD_TIMEOUT_SEC	600
+
+// block mode sender puts restart marker into data stream every N bytes (0 - never)
+#define FTPSERVER_DEFAULT_BLOCK_RESTART_MARKER_INTERVAL	(1024 * 1024 * 16)
+
+// MODE Z compression level, client may change it with OPTS MODE Z LEVEL n
+#define FTPSERVER_DEFAULT_DEFLATE_LEVEL		6
+
+// bandwidth of data transfers of a single session, bytes per second (0 - unlimited)
+#define FTPSERVER_DEFAULT_SESSION_RATE_LIMIT	0
+
+// control connection carries short commands and replies,
+// they must wait neither for Nagle nor for delayed ACK of the peer
+#define FTPSERVER_DEFAULT_CONTROL_NO_DELAY		true
+#define FTPSERVER_DEFAULT_CONTROL_QUICK_ACK		true
+
+// listeners bound in advance, so PASV does not pay for socket/bind/listen
+#if defined(WIN32) || defined(__linux__)
+#	define FTPSERVER_DEFAULT_PASSIVE_LISTENERS_POOL_SIZE	8
+#else // ESP32, lwip has only a few sockets
+#	define FTPSERVER_DEFAULT_PASSIVE_LISTENERS_POOL_SIZE	0
+#endif
+
+// data channels (PASV / PORT) a session may prepare ahead of transfers,
+// segmented download clients open several and run RETRs over them in parallel
+#if defined(WIN32) || defined(__linux__)
+#	define FTPSERVER_DEFAULT_MAX_DATA_CHANNELS_PER_SESSION	8
+#else // ESP32
+#	define FTPSERVER_DEFAULT_MAX_DATA_CHANNELS_PER_SESSION	1
+#endif
+
+// memory for rendered listings shared by all sessions (0 - no cache)
+#if defined(WIN32) || defined(__linux__)
+#	define FTPSERVER_DEFAULT_LISTING_CACHE_SIZE	(1024 * 1024 * 8)
+#else // ESP32
+#	define FTPSERVER_DEFAULT_LISTING_CACHE_SIZE	0
+#endif
+
+// listings of directories without change notifications (not linux,
+// network filesystems) are rendered again after this, watched ones
+// after LISTING_CACHE_WATCHED_TTL_FACTOR times this
+#define FTPSERVER_DEFAULT_LISTING_CACHE_TTL_SEC	5
+
+// paths stat'ed by SIZE, CWD, RNFR, ... kept for all sessions (0 - no cache)
+#if defined(WIN32) || defined(__linux__)
+#	define FTPSERVER_DEFAULT_METADATA_CACHE_ENTRIES	65536
+#else // ESP32
+#	define FTPSERVER_DEFAULT_METADATA_CACHE_ENTRIES	0
+#endif
+
+// changes made by other hosts (network filesystems) are seen after this,
+// missing paths are asked again sooner
+#define FTPSERVER_DEFAULT_METADATA_CACHE_TTL_MS				2000
+#define FTPSERVER_DEFAULT_METADATA_CACHE_NEGATIVE_TTL_MS	1000
+
+// LIST -R walks the tree on the server: levels below the listed directory,
+// entries of the whole tree, threads enumerating directories ahead of the
+// one being sent (0 - the session thread does everything)
+#if defined(WIN32) || defined(__linux__)
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_DEPTH		32
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_ENTRIES	1000000
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_THREADS		4
+#else // ESP32
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_DEPTH		8
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_MAX_ENTRIES	10000
+#	define FTPSERVER_DEFAULT_RECURSIVE_LIST_THREADS		0
+#endif
+
 //
 
 namespace ftp_server
@@ -97,8 +203,143 @@ enum e_data_channel_mode
 	e_data_channel_mode_passive
 };
 
+// MODE command (RFC 959)
+enum e_transmission_mode
+{
+	e_transmission_mode_stream,
+	e_transmission_mode_block,
+	e_transmission_mode_deflate		// MODE Z
+};
+
+// output of directory listing commands
+enum e_listing_format
+{
+	e_listing_format_list,		// LIST, "ls -l" lines
+	e_listing_format_mlsd,		// MLSD / MLST, facts (RFC 3659)
+	e_listing_format_nlst		// NLST, names only
+};
+
+// MLSD / MLST facts, client picks them with OPTS MLST
+enum e_mlst_fact : uint32_t
+{
+	e_mlst_fact_size	= 0x01,
+	e_mlst_fact_modify	= 0x02,
+	e_mlst_fact_type	= 0x04,
+	e_mlst_fact_perm	= 0x08,
+	e_mlst_fact_unique	= 0x10,
+
+	e_mlst_facts_all	= 0x1f
+};
+
+enum e_socket_profile
+{
+	e_socket_profile_listener,	// control connections listener
+	e_socket_profile_control,	// control connections
+	e_socket_profile_data,		// data connections and passive listeners
+
+	e_socket_profile_count
+};
+
+// Options applied to the sockets of one kind, zero / false keeps
+// the system default. Options unknown to the platform are ignored.
+struct socket_profile_s
+{
+	bool no_delay = false;			// TCP_NODELAY
+	bool quick_ack = false;			// TCP_QUICKACK, armed again after every received command
+	bool cork = false;				// TCP_CORK around block headers and payload (MODE B)
+
+	int send_buffer = 0;			// SO_SNDBUF, bytes
+	int recv_buffer = 0;			// SO_RCVBUF, bytes, set on the listener to get the window scale right
+	int not_sent_lowat = 0;			// TCP_NOTSENT_LOWAT, bytes kept unsent in the kernel
+	int busy_poll_us = 0;			// SO_BUSY_POLL
+
+	// listeners only
+	int defer_accept_sec = 0;		// TCP_DEFER_ACCEPT, only for peers which talk first (not the FTP greeting)
+	int fast_open_queue = 0;		// TCP_FASTOPEN
+};
+
+// Sample of a data transfer (see ftp_server_c::transfer_statistics()),
+// taken whenever its chunk size is tuned and when it ends
+struct transfer_statistics_s
+{
+	SOCKET command_socket;
+	std::string user_name;
+
+	bool upload;
+	bool active;				// false - one of the recent transfers, over already
+
+	time_t start_time;
+
+	uint64_t bytes_transferred;	// file offset, counted from REST
+
+	// last TCP_INFO sample of the data connection and the chunk size tuned to it
+	size_t chunk_size;
+	uint32_t rtt_us;
+	uint32_t window_bytes;		// cwnd for sending, receive space for receiving
+	uint64_t pacing_rate;		// bytes per second, 0 - not paced
+};
+
 class ftp_server_c
 {
+#ifdef FTPSERVER_WITH_OPENSSL
+	// TLS handshake driven by the server loop, a step runs when the socket is ready
+	struct tls_handshake_s
+	{
+		std::shared_ptr<tls_tools::tls_session_c> session;
+		tls_tools::e_handshake_state state;
+		time_t deadline;
+
+		bool in_progress() const
+		{
+			return session
+				&& (state == tls_tools::e_handshake_want_read || state == tls_tools::e_handshake_want_write);
+		}
+	};
+#endif
+
+	// PASV listener or PORT connection waiting for a transfer command
+	struct data_channel_s
+	{
+		SOCKET sock;
+
+		// passive listener port (0 for active channel)
+		uint16_t port;
+
+		e_data_channel_mode mode;
+
+		time_t open_time;
+
+		// active mode connect to the client is still in progress
+		bool connect_pending;
+
+		// passive: connection accepted by the server loop, not taken by a transfer yet
+		SOCKET data_sock;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		// PROT P: handshake of the connection, starts when the transfer command has replied
+		tls_handshake_s tls;
+#endif
+	};
+
+	struct background_transfer_s;
+	typedef std::shared_ptr<background_transfer_s> background_transfer_t;
+
+	// settings shared by all sessions of a user
+	struct user_profile_s
+	{
+		user_profile_s()
+			: transfer_weight(1)
+		{
+		}
+
+		token_bucket_c rate_limiter;
+
+		// share of the bandwidth the user's transfers get when links are busy
+		std::atomic<uint32_t> transfer_weight;
+	};
+
+	typedef std::shared_ptr<user_profile_s> user_profile_t;
+
 	class ftp_client_connection_c
 		: public std::enable_shared_from_this<ftp_client_connection_c>
 	{
@@ -110,32 +351,81 @@ class ftp_server_c
 	public:
 		ftp_client_connection_c(SOCKET command_socket)
 			: m_command_socket(command_socket)
-			, m_data_socket(0)
+			, m_persistent_data_socket(0)
+			, m_epsv_all(false)
 			, m_data_transfer_mode(e_data_transfer_mode_binary)
-			, m_data_channel_mode(e_data_channel_mode_active)
+			, m_transmission_mode(e_transmission_mode_stream)
+			, m_deflate_level(FTPSERVER_DEFAULT_DEFLATE_LEVEL)
+			, m_restart_offset(0)
+			, m_allocation_size(0)
+			, m_pbsz_set(false)
+			, m_data_protection(false)
+			, m_mlst_facts(e_mlst_facts_all)
+			, m_fxp_allowed(false)
+			, m_deferred_time(0)
+			, m_resuming_command(false)
+#ifdef FTPSERVER_WITH_OPENSSL
+			, m_awaiting_data_tls(false)
+			, m_transfer_replied(false)
+#endif
 		{
 		}
 
 		virtual ~ftp_client_connection_c()
 		{
+#ifdef FTPSERVER_WITH_OPENSSL
+			// close_notify goes before the socket is closed
+			m_control_tls.reset();
+			m_control_handshake.session.reset();
+			m_data_tls.session.reset();
+
+			for (auto& data_channel : m_data_channels)
+			{
+				data_channel.tls.session.reset();
+			}
+#endif
+
 			if (m_command_socket)
 			{
 				closesocket(m_command_socket);
 				m_command_socket = 0;
 			}
 
-			if (m_data_socket)
+			for (auto& data_channel : m_data_channels)
 			{
-				closesocket(m_data_socket);
-				m_data_socket = 0;
+				if (data_channel.sock)
+				{
+					closesocket(data_channel.sock);
+				}
+
+				if (data_channel.data_sock)
+				{
+					closesocket(data_channel.data_sock);
+				}
 			}
-		}
 
-		void assign_data_socket(SOCKET data_socket) { m_data_socket = data_socket; }
+			if (m_persistent_data_socket)
+			{
+				closesocket(m_persistent_data_socket);
+				m_persistent_data_socket = 0;
+			}
+		}
 
 		SOCKET command_socket() const { return m_command_socket; }
 
-		SOCKET data_socket() const { return m_data_socket; }
+		// prepared data channels, oldest first; transfer command uses the front one
+		std::deque<data_channel_s>& data_channels() { return m_data_channels; }
+
+		// stream mode RETRs which are served by the server loop
+		std::list<background_transfer_t>& background_transfers() { return m_background_transfers; }
+
+		// block mode keeps data connection open between transfers
+		void assign_persistent_data_socket(SOCKET data_socket) { m_persistent_data_socket = data_socket; }
+		SOCKET persistent_data_socket() const { return m_persistent_data_socket; }
+
+		// client sent "EPSV ALL", only EPSV is accepted from now on
+		void set_epsv_all(bool epsv_all) { m_epsv_all = epsv_all; }
+		bool epsv_all() const { return m_epsv_all; }
 
 		bool set_ftp_root_directory(const std::string& path) { return m_directory_iterator.set_root(path); }
 
@@ -152,11 +442,94 @@ class ftp_server_c
 		void set_data_transfer_mode(e_data_transfer_mode data_transfer_mode) { m_data_transfer_mode = data_transfer_mode; }
 		e_data_transfer_mode data_transfer_mode() { return m_data_transfer_mode; }
 
-		void set_data_channel_mode(e_data_channel_mode data_channel_mode) { m_data_channel_mode = data_channel_mode; }
-		e_data_channel_mode data_channel_mode() { return m_data_channel_mode; }
+		void set_transmission_mode(e_transmission_mode transmission_mode) { m_transmission_mode = transmission_mode; }
+		e_transmission_mode transmission_mode() const { return m_transmission_mode; }
+
+		void set_deflate_level(int level) { m_deflate_level = level; }
+		int deflate_level() const { return m_deflate_level; }
+
+		// REST offset for the next RETR / STOR
+		void set_restart_offset(uint64_t offset) { m_restart_offset = offset; }
+		uint64_t restart_offset() const { return m_restart_offset; }
+
+		// ALLO size for the next STOR, makes it a part of ranged upload
+		void set_allocation_size(uint64_t size) { m_allocation_size = size; }
+		uint64_t allocation_size() const { return m_allocation_size; }
+
+		void set_user_name(const std::string& user_name) { m_user_name = user_name; }
+		const std::string& user_name() const { return m_user_name; }
+
+		void set_user_profile(const user_profile_t& user_profile) { m_user_profile = user_profile; }
+		const user_profile_t& user_profile() const { return m_user_profile; }
+
+		// bandwidth limits of the session and of its user
+		token_bucket_c& rate_limiter() { return m_rate_limiter; }
+		token_bucket_c* user_rate_limiter() const { return m_user_profile ? &m_user_profile->rate_limiter : nullptr; }
+
+		uint32_t transfer_weight() const { return m_user_profile ? m_user_profile->transfer_weight.load() : 1; }
+
+		// data connections may go to / come from another host (server-to-server transfers),
+		// decided by the address of the control connection
+		void set_fxp_allowed(bool fxp_allowed) { m_fxp_allowed = fxp_allowed; }
+		bool fxp_allowed() const { return m_fxp_allowed; }
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		// AUTH TLS, commands and replies go through the session from now on
+		void set_control_tls(const std::shared_ptr<tls_tools::tls_session_c>& session) { m_control_tls = session; }
+		const std::shared_ptr<tls_tools::tls_session_c>& control_tls() const { return m_control_tls; }
+
+		// AUTH TLS handshake in progress, commands wait for it
+		tls_handshake_s& control_handshake() { return m_control_handshake; }
+
+		// handshake of the data connection open_data_connection() handed out
+		void set_data_tls(const tls_handshake_s& handshake) { m_data_tls = handshake; }
+		tls_handshake_s take_data_tls() { tls_handshake_s handshake = m_data_tls; m_data_tls.session.reset(); return handshake; }
+
+		// transfer command has replied and waits for the handshake of its data
+		// connection, it runs again when the handshake is over
+		void set_awaiting_data_tls(bool awaiting) { m_awaiting_data_tls = awaiting; }
+		bool awaiting_data_tls() const { return m_awaiting_data_tls; }
+
+		// transfer command runs again, its reply went out already
+		void set_transfer_replied(bool replied) { m_transfer_replied = replied; }
+		bool transfer_replied() const { return m_transfer_replied; }
+#endif
+
+		// PBSZ 0 / PROT P (RFC 4217)
+		void set_pbsz(bool pbsz_set) { m_pbsz_set = pbsz_set; }
+		bool pbsz_set() const { return m_pbsz_set; }
+
+		void set_data_protection(bool data_protection) { m_data_protection = data_protection; }
+		bool data_protection() const { return m_data_protection; }
+
+		// e_mlst_fact bits shown by MLSD / MLST
+		void set_mlst_facts(uint32_t facts) { m_mlst_facts = facts; }
+		uint32_t mlst_facts() const { return m_mlst_facts; }
+
+		// received part of control stream which is not a whole command yet
+		std::string& command_buffer() { return m_command_buffer; }
+
+		// transfer command waiting for its data connection (PORT connect in progress,
+		// PASV connection not accepted yet), commands sent behind it wait as well
+		void defer_command(const std::string& line) { m_deferred_command = line; m_deferred_time = time(NULL); }
+		const std::string& deferred_command() const { return m_deferred_command; }
+		time_t deferred_time() const { return m_deferred_time; }
+		std::string take_deferred_command() { std::string line; line.swap(m_deferred_command); return line; }
+
+		// deferred command runs again and takes whatever data connection there is
+		void set_resuming_command(bool resuming) { m_resuming_command = resuming; }
+		bool resuming_command() const { return m_resuming_command; }
 
 	protected:
-		SOCKET m_command_socket, m_data_socket;
+		SOCKET m_command_socket;
+
+		std::deque<data_channel_s> m_data_channels;
+
+		std::list<background_transfer_t> m_background_transfers;
+
+		SOCKET m_persistent_data_socket;
+
+		bool m_epsv_all;
 
 		filesystem_tools::directory_iterator_c m_directory_iterator;
 
@@ -165,11 +538,199 @@ class ftp_server_c
 		std::string m_last_rename_from_file;
 
 		e_data_transfer_mode m_data_transfer_mode;
-		e_data_channel_mode m_data_channel_mode;
+		e_transmission_mode m_transmission_mode;
+
+		int m_deflate_level;
+
+		uint64_t m_restart_offset;
+		uint64_t m_allocation_size;
+
+		std::string m_user_name;
+
+		user_profile_t m_user_profile;
+
+		token_bucket_c m_rate_limiter;
+
+		bool m_pbsz_set;
+		bool m_data_protection;
+
+		uint32_t m_mlst_facts;
+
+		bool m_fxp_allowed;
+
+		std::string m_command_buffer;
+
+		std::string m_deferred_command;
+		time_t m_deferred_time;
+		bool m_resuming_command;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		std::shared_ptr<tls_tools::tls_session_c> m_control_tls;
+		tls_handshake_s m_control_handshake;
+
+		tls_handshake_s m_data_tls;
+		bool m_awaiting_data_tls;
+		bool m_transfer_replied;
+#endif
 	};
 
 	typedef std::shared_ptr<ftp_client_connection_c> ftp_client_connection_t;
 
+	struct passive_listener_s
+	{
+		SOCKET sock;
+		uint16_t port;
+	};
+
+	// block mode descriptor bits (RFC 959, 3.4.2)
+	enum e_block_descriptor : uint8_t
+	{
+		e_block_descriptor_restart_marker	= 0x10,
+		e_block_descriptor_suspected_errors	= 0x20,
+		e_block_descriptor_eof				= 0x40,
+		e_block_descriptor_eor				= 0x80
+	};
+
+	// state of one transfer over data connection
+	struct data_transfer_s
+	{
+		SOCKET sock;
+
+		e_transmission_mode transmission_mode;
+
+		// TYPE A converts line ends of the payload
+		e_data_transfer_mode data_type;
+		bool ascii_cr_state;
+		std::vector<char> ascii_buf;
+
+		// offset of the payload (file) after bytes sent or received
+		uint64_t bytes_transferred;
+
+		uint64_t next_restart_marker;
+
+		// block mode receiver
+		uint32_t block_bytes_left;
+		uint8_t block_descriptor;
+		bool eof;
+
+		// size of a single file read / write and socket send / recv,
+		// follows the connection (see tune_transfer_chunk_size())
+		size_t chunk_size;
+		// bytes_transferred at which the chunk size is tuned again
+		uint64_t next_chunk_tune;
+
+		// last TCP_INFO sample of the data connection, zeros if not available
+		uint32_t rtt_us;
+		uint32_t window_bytes;	// cwnd for sending, receive space for receiving
+		uint64_t pacing_rate;	// bytes per second
+
+		// published sample, shared by copies of the transfer; the last copy
+		// gone moves it to the recent ones
+		std::shared_ptr<transfer_statistics_s> statistics;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+		// PROT P, null for clear data connection
+		std::shared_ptr<tls_tools::tls_session_c> tls;
+#endif
+
+#ifdef FTPSERVER_WITH_ZLIB
+		// MODE Z
+		std::shared_ptr<deflate_tools::block_deflater_c> deflater;
+		std::shared_ptr<deflate_tools::inflater_c> inflater;
+		std::vector<char> compressed_buf;
+#endif
+	};
+
+	// File uploaded by ranges (ALLO <size> + REST <offset> + STOR per range,
+	// ranges may come over several data connections at once). Data goes to
+	// <file>.part which is renamed to <file> when all ranges have arrived.
+	// STOR without ALLO replaces the upload, idle one expires.
+	struct partial_upload_s
+	{
+		std::string target_path;
+		std::string part_path;
+
+		uint64_t expected_size;
+
+		ranges_set_c ranges;
+
+		// STORs writing into the part file right now
+		uint32_t writers;
+
+		// last range started or ended
+		time_t last_activity;
+	};
+
+	typedef std::shared_ptr<partial_upload_s> partial_upload_t;
+
+	// File download which is sent piece by piece when data socket is writable
+	// (or upload received when it is readable), so the session keeps accepting
+	// commands (and other transfers) meanwhile
+	struct background_transfer_s
+	{
+		background_transfer_s()
+			: file(nullptr)
+			, upload(false)
+			, completed(false)
+			, file_offset(0)
+			, file_end(0)
+			, range_begin(0)
+			, pending_data(nullptr)
+			, pending_size(0)
+			, deficit(0)
+			, compression_wait(false)
+		{
+			transfer.sock = 0;
+		}
+
+		~background_transfer_s()
+		{
+			if (transfer.sock)
+			{
+#ifdef FTPSERVER_WITH_OPENSSL
+				// close_notify goes before the socket is closed
+				transfer.tls.reset();
+#endif
+				closesocket(transfer.sock);
+			}
+
+			if (file)
+				fclose(file);
+		}
+
+		data_transfer_s transfer;
+
+		FILE* file;
+
+		bool upload;
+		bool completed;
+
+		// positioned reads / writes, transfers of the same file do not share an offset
+		uint64_t file_offset;
+		uint64_t file_end;	// download only
+
+		// upload: offset of the first byte of this STOR
+		uint64_t range_begin;
+		partial_upload_t partial_upload;
+
+		std::vector<char> buf;
+
+		// part of the last chunk the socket did not take yet
+		const char* pending_data;
+		size_t pending_size;
+
+		// bytes the transfer may move in the current round of the scheduler,
+		// negative if the last send went over it
+		int64_t deficit;
+
+		// upload: listing of its directory is dropped when the file is complete
+		std::string file_path;
+
+		// MODE Z download: nothing to send until workers finish a batch,
+		// the socket is not watched meanwhile
+		bool compression_wait;
+	};
+
 	enum e_command_types
 	{
 		e_ftpcmd_unknown = 0,
@@ -194,13 +755,21 @@ class ftp_server_c
 		e_ftpcmd_rnfr,
 		e_ftpcmd_rnto,
 		e_ftpcmd_rmd,
-		e_ftpcmd_stor
-	};
-
-	struct port_busy_flag_s
-	{
-		uint16_t port;
-		bool busy;
+		e_ftpcmd_stor,
+		e_ftpcmd_epsv,
+		e_ftpcmd_port,
+		e_ftpcmd_eprt,
+		e_ftpcmd_mode,
+		e_ftpcmd_rest,
+		e_ftpcmd_appe,
+		e_ftpcmd_allo,
+		e_ftpcmd_site,
+		e_ftpcmd_auth,
+		e_ftpcmd_pbsz,
+		e_ftpcmd_prot,
+		e_ftpcmd_mlsd,
+		e_ftpcmd_mlst,
+		e_ftpcmd_nlst
 	};
 
 private:
@@ -220,6 +789,98 @@ public:
 	virtual void set_native_encoding(e_encoding encoding) { m_native_encoding = encoding; }
 	e_encoding naive_encoding() const { return m_native_encoding; }
 
+	// default MODE Z level of new sessions (0 - 9)
+	virtual void set_deflate_level(int level) { m_deflate_level = level; }
+	int deflate_level() const { return m_deflate_level; }
+
+	// range of ports for passive data channels (open it on firewall)
+	virtual bool set_passive_ports_range(uint16_t first_port, uint16_t last_port);
+
+	virtual void set_data_channel_timeout(uint32_t timeout_sec) { m_data_channel_timeout_sec = timeout_sec; }
+	uint32_t data_channel_timeout() const { return m_data_channel_timeout_sec; }
+
+	virtual void set_active_connect_timeout(uint32_t timeout_sec) { m_active_connect_timeout_sec = timeout_sec; }
+	uint32_t active_connect_timeout() const { return m_active_connect_timeout_sec; }
+
+	virtual void set_partial_upload_timeout(uint32_t timeout_sec) { m_partial_upload_timeout_sec = timeout_sec; }
+	uint32_t partial_upload_timeout() const { return m_partial_upload_timeout_sec; }
+
+	// 0 - any local port (default), RFC 959 suggests 20 (needs privileges)
+	virtual void set_active_mode_source_port(uint16_t port) { m_active_mode_source_port = port; }
+	uint16_t active_mode_source_port() const { return m_active_mode_source_port; }
+
+	virtual void set_block_restart_marker_interval(uint32_t interval_bytes) { m_block_restart_marker_interval = interval_bytes; }
+	uint32_t block_restart_marker_interval() const { return m_block_restart_marker_interval; }
+
+	// 0 - bind passive listener on every PASV
+	virtual void set_passive_listeners_pool_size(uint32_t pool_size) { m_passive_listeners_pool_size = pool_size; }
+	uint32_t passive_listeners_pool_size() const { return m_passive_listeners_pool_size; }
+
+	// oldest prepared channel is closed when a session opens one more
+	virtual void set_max_data_channels_per_session(uint32_t channels_count) { m_max_data_channels_per_session = channels_count ? channels_count : 1; }
+	uint32_t max_data_channels_per_session() const { return m_max_data_channels_per_session; }
+
+	// bandwidth of data transfers, bytes per second (0 - unlimited), burst 0 - one second of traffic;
+	// transfer has to fit all of the global, user and session limits.
+	// Limits may be changed while the server runs, clients may only lower
+	// the limit of their own session (SITE RATE SESSION); session takes the
+	// user's settings at USER, so users are set up before they log in
+	virtual void set_global_rate_limit(uint64_t bytes_per_sec, uint64_t burst_bytes = 0);
+	virtual void set_user_rate_limit(const std::string& user_name, uint64_t bytes_per_sec, uint64_t burst_bytes = 0);
+
+	// limit of every new session
+	virtual void set_session_rate_limit(uint64_t bytes_per_sec, uint64_t burst_bytes = 0);
+
+	// busy server gives transfers of the user weight times more bytes per round
+	// than transfers of a user with weight 1 (default); set by the server owner
+	// only, clients have no command for it
+	virtual void set_user_transfer_weight(const std::string& user_name, uint32_t weight);
+
+	// FXP: PORT to another server and passive connections from it,
+	// data goes between the servers instead of through the client.
+	// Allowed for sessions whose control connection comes from one of these
+	// hosts (IP address), everybody else may use its own host only
+	virtual bool add_fxp_host(const std::string& address);
+	virtual void clear_fxp_hosts();
+
+	// socket options of listeners, control and data connections,
+	// each kind is tuned separately (new sockets only)
+	virtual void set_socket_profile(e_socket_profile kind, const socket_profile_s& profile) { m_socket_profiles[kind] = profile; }
+	const socket_profile_s& socket_profile(e_socket_profile kind) const { return m_socket_profiles[kind]; }
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// FTPS (AUTH TLS, RFC 4217) is offered once the certificate is loaded, PEM files
+	virtual bool set_tls_certificate(const std::string& cert_file, const std::string& key_file);
+
+	// refuse login over clear control connection and PROT C transfers
+	virtual void set_tls_required(bool tls_required) { m_tls_required = tls_required; }
+	bool tls_required() const { return m_tls_required; }
+#endif
+
+	// directory listings are kept rendered, keyed by directory and encoding of the client
+	virtual void set_listing_cache_size(size_t budget_bytes) { m_listing_cache.set_memory_budget(budget_bytes); }
+	virtual void set_listing_cache_ttl(uint32_t ttl_sec) { m_listing_cache.set_ttl(ttl_sec); }
+	listing_cache_c::statistics_s listing_cache_statistics() { return m_listing_cache.statistics(); }
+
+	// existence, type, size and time of paths, missing ones too
+	virtual void set_metadata_cache_size(size_t entries_count) { m_metadata_cache.set_capacity(entries_count); }
+	virtual void set_metadata_cache_ttl(uint32_t ttl_ms, uint32_t negative_ttl_ms) { m_metadata_cache.set_ttl(ttl_ms, negative_ttl_ms); }
+	metadata_cache_c::statistics_s metadata_cache_statistics() { return m_metadata_cache.statistics(); }
+
+	// transfers in progress, then the last ones over (newest first)
+	std::vector<transfer_statistics_s> transfer_statistics();
+
+	// LIST -R stops descending below max_depth levels and stops listing after max_entries
+	// (the reply tells the listing is truncated), 0 entries - -R is ignored
+	virtual void set_recursive_list_limits(uint32_t max_depth, uint64_t max_entries) { m_recursive_list_max_depth = max_depth; m_recursive_list_max_entries = max_entries; }
+	uint32_t recursive_list_max_depth() const { return m_recursive_list_max_depth; }
+	uint64_t recursive_list_max_entries() const { return m_recursive_list_max_entries; }
+
+	// threads of one LIST -R, they mostly wait for the filesystem,
+	// so more threads than cores pay off on network storage
+	virtual void set_recursive_list_threads(uint32_t threads_count) { m_recursive_list_threads = threads_count; }
+	uint32_t recursive_list_threads() const { return m_recursive_list_threads; }
+
 	virtual void set_on_error_callback(void(*msg_callback_t)());
 
 	virtual void set_on_info_callback();
@@ -241,37 +902,236 @@ protected:
 
 	virtual uint16_t get_first_free_port();
 	virtual void mark_port_as_free(uint16_t port_number);
-	virtual void get_ip_data(int sock, uint32_t* ip);
-	virtual void gen_port(uint16_t& p1, uint16_t& p2);
+	virtual bool get_local_address(SOCKET sock, struct sockaddr_storage& addr);
+	virtual bool get_peer_address(SOCKET sock, struct sockaddr_storage& addr);
+
+	virtual void fill_passive_listeners_pool();
+	virtual void free_passive_listeners_pool();
+	virtual bool open_passive_listener(SOCKET& sock, uint16_t& port);
+	virtual void drain_passive_listener(SOCKET sock);
+	virtual bool open_passive_data_channel(ftp_client_connection_c* client_connection, uint16_t& port);
+
+	virtual bool open_active_data_channel(ftp_client_connection_c* client_connection,
+		const struct sockaddr_storage& client_addr);
+	virtual void add_data_channel(ftp_client_connection_c* client_connection,
+		const data_channel_s& data_channel);
+	// passive listeners wait for readable, active connects in progress for writable socket
+	virtual void prepare_data_channels_fds(fd_set* accept_set, fd_set* connect_set, fd_set* error_set,
+		SOCKET& max_sd);
+	virtual void handle_data_channels_fds(fd_set* accept_set, fd_set* connect_set, fd_set* error_set);
+	virtual bool finish_data_connect(ftp_client_connection_c* client_connection,
+		data_channel_s& data_channel);
+	virtual bool accept_data_channel(ftp_client_connection_c* client_connection,
+		data_channel_s& data_channel);
+
+	// transfer command may run: data connection is there, failed or nothing is prepared
+	virtual bool data_connection_ready(ftp_client_connection_c* client_connection);
+	// runs deferred commands whose data connections are ready or which waited too long
+	virtual void check_deferred_commands();
+	virtual void resume_deferred_command(ftp_client_connection_c* client_connection);
+
+	// passive: connection accepted by the server loop, active: connected socket;
+	// nothing is waited for, channel which got the connection is moved to the front
+	virtual SOCKET open_data_connection(ftp_client_connection_c* client_connection);
+	virtual SOCKET take_accepted_connection(ftp_client_connection_c* client_connection);
+	// passive channel with the oldest accepted connection goes to the front
+	virtual bool front_accepted_connection(ftp_client_connection_c* client_connection);
+	virtual SOCKET take_connected_socket(ftp_client_connection_c* client_connection);
+
+	// front channel, the one used (or failed to be used) by the last transfer command
+	virtual void close_data_channel(ftp_client_connection_c* client_connection);
+	virtual void close_all_data_channels(ftp_client_connection_c* client_connection);
+	virtual void release_data_channel(data_channel_s& data_channel);
+	virtual void close_persistent_data_connection(ftp_client_connection_c* client_connection);
+	virtual void check_data_channels_timeouts();
 
 	virtual void translate_path(ftp_client_connection_c* client_connection,
 		std::string& path,
 		e_encoding source_encoding,
 		e_encoding dest_encoding);
 
-	virtual bool initialize_sock_channel(SOCKET& sock, uint16_t port, bool non_blocking_sock);
+	virtual bool initialize_sock_channel(SOCKET& sock, uint16_t port, bool non_blocking_sock,
+		const socket_profile_s& profile);
+
+	virtual void apply_socket_profile(SOCKET sock, const socket_profile_s& profile, bool listener);
 
 	virtual bool send_to_client(SOCKET client_socket, const char* data, size_t data_size);
-	virtual bool send_to_client(ftp_client_connection_c* client_connection, char* data);
+	virtual bool send_to_client(ftp_client_connection_c* client_connection, const char* data);
+	virtual int recv_from_client(SOCKET client_socket, char* buf, size_t buf_sz);
+
+	// raw bytes of data connection, through TLS session of PROT P
+	virtual bool send_to_data_connection(data_transfer_s& transfer, const char* data, size_t data_size);
+	virtual int send_data_chunk(data_transfer_s& transfer, const char* data, size_t data_size);
+	virtual int recv_data_chunk(data_transfer_s& transfer, char* buf, size_t buf_sz);
+	virtual bool recv_data_exact(data_transfer_s& transfer, char* buf, size_t size);
+
+	// data may go to the socket as is (sendfile): no TLS, or kernel makes the records
+	bool direct_socket_send(const data_transfer_s& transfer) const;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	// no handshake blocks the server loop: it waits for its socket in select()
+	// and fails when it is not over in TLS_HANDSHAKE_TIMEOUT_SEC
+	virtual void tls_handshake(SOCKET sock, tls_handshake_s& handshake);
+	virtual void prepare_tls_handshakes_fds(fd_set* read_set, fd_set* write_set, SOCKET& max_sd);
+	virtual void handle_tls_handshakes_fds(fd_set* read_set, fd_set* write_set);
+	virtual void finish_control_handshake(ftp_client_connection_c* client_connection);
+
+	// PROT P: starts the handshake of the data connection the transfer command
+	// is going to take, true while it is in progress
+	virtual bool secure_data_connection(ftp_client_connection_c* client_connection);
+#endif
 	virtual bool send_system_error(ftp_client_connection_c* client_connection);
 
+	// 150 or 125 if block mode data connection is open already;
+	// false if the transfer must wait for the handshake of its PROT P data
+	// connection, the command runs again when it is over
+	virtual bool send_transfer_starting(ftp_client_connection_c* client_connection,
+		const char* opening_reply);
+
+	// data connection payload in current transmission mode
+	// compressible = false: MODE Z sends data as stored blocks (already compressed file);
+	// false if PROT P data connection could not be secured
+	virtual bool begin_data_transfer(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer, SOCKET data_sock, bool compressible = true);
+	virtual bool send_transfer_data(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer, const char* data, size_t data_size);
+	// sends file from offset to the end (sendfile when payload is not converted)
+	virtual bool send_transfer_file(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer, FILE* file, uint64_t offset, uint64_t file_size);
+	virtual bool finish_data_transfer(data_transfer_s& transfer);
+	// returns 0 on end of data, -1 on error
+	virtual int recv_transfer_data(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer, char* buf, size_t buf_sz);
+	// recv_transfer_data() without TYPE A conversion
+	virtual int recv_transfer_payload(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer, char* buf, size_t buf_sz);
+	virtual bool send_data_block(data_transfer_s& transfer, uint8_t descriptor,
+		const char* data, size_t data_size);
+	// picks chunk size from RTT, window and pacing rate of the data connection (linux),
+	// so slow or lossy peers do not hold big buffers and fat pipes get big chunks
+	virtual void tune_transfer_chunk_size(data_transfer_s& transfer, bool upload);
+	// transfer_statistics() sees the transfer from begin_data_transfer() on
+	virtual void start_transfer_statistics(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer);
+	virtual void update_transfer_statistics(const data_transfer_s& transfer, bool upload);
+	void end_transfer_statistics(transfer_statistics_s* statistics);
+	// block mode: data connection stays open for the next transfer (returns true if kept)
+	virtual bool keep_data_connection(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer);
+
+	virtual void start_background_transfer(ftp_client_connection_c* client_connection,
+		const background_transfer_t& background_transfer);
+	// transfers over their rate limit are left out, timeout is cut to the time they may go on
+	virtual void prepare_background_transfers_fds(fd_set* read_set, fd_set* write_set, SOCKET& max_sd,
+		struct timeval& timeout);
+	// deficit round robin: every ready transfer moves up to its quantum
+	// (times the user's weight) per call, so a call never takes long
+	virtual void handle_background_transfers_fds(fd_set* read_set, fd_set* write_set);
+	// moves up to the deficit, returns false when transfer is over (completed or failed)
+	virtual bool continue_background_transfer(ftp_client_connection_c* client_connection,
+		background_transfer_s& background_transfer);
+	virtual bool continue_background_upload(ftp_client_connection_c* client_connection,
+		background_transfer_s& background_transfer);
+#ifdef FTPSERVER_WITH_ZLIB
+	// MODE Z download: feeds the deflater with the file, sends what its workers produced
+	virtual bool continue_background_deflate(ftp_client_connection_c* client_connection,
+		background_transfer_s& background_transfer);
+#endif
+	// sends 226 / 426
+	virtual void finish_background_transfer(ftp_client_connection_c* client_connection,
+		background_transfer_s& background_transfer);
+	// closes the file and accounts uploaded range, returns true if transfer succeeded
+	virtual bool complete_background_transfer(background_transfer_s& background_transfer);
+
+	// profile set up by set_user_*, the shared default one for other names
+	virtual user_profile_t find_user_profile(const std::string& user_name);
+	// set_user_*: profile of the user, created if it is not there yet
+	virtual user_profile_t configure_user_profile(const std::string& user_name);
+
+	// rate limits of the session, its user and the global one together
+	virtual bool transfer_rate_available(ftp_client_connection_c* client_connection);
+	virtual void consume_transfer_rate(ftp_client_connection_c* client_connection, size_t bytes);
+	virtual uint32_t transfer_rate_wait_time(ftp_client_connection_c* client_connection);
+	// blocks (synchronous transfers only)
+	virtual void wait_transfer_rate(ftp_client_connection_c* client_connection);
+
+	// part file of ranged upload to target_path when size is given (ALLO), joins
+	// the upload of the same size in progress; no size - drops the upload
+	virtual partial_upload_t find_partial_upload(const std::string& target_path, uint64_t allocation_size);
+	virtual void complete_upload_range(const partial_upload_t& partial_upload,
+		uint64_t range_begin, uint64_t range_end);
+	// drops the upload, part file is removed when nobody writes into it
+	virtual void abandon_partial_upload(const partial_upload_t& partial_upload);
+	virtual void check_partial_uploads_timeouts();
+
+	// bytes received over control connection, every whole line goes to handle_incoming_data,
+	// so commands sent at once (pipelined) are not lost
+	virtual void handle_control_data(ftp_client_connection_c* client_connection,
+		const char* data, size_t data_size);
+
 	virtual void handle_incoming_data(ftp_client_connection_c* client_connection,
 		uint8_t* data, size_t data_size);
 
 	virtual e_command_types determine_command(const std::string& command_name);
 
+	// command which opens a data connection (LIST, RETR, STOR, ...)
+	static bool is_transfer_command(e_command_types command);
+
 	virtual void handle_command(ftp_client_connection_c* client_connection,
 		e_command_types command,
 		const std::string& command_value);
 
-	virtual void handle_list_command(ftp_client_connection_c* client_connection);
+	// LIST / MLSD / NLST of the current directory or of the one given by MLSD / NLST,
+	// NLST takes a glob of names too ("NLST dir/*.txt") and never stats the entries
+	// LIST -R goes down the subtree
+	virtual void handle_list_command(ftp_client_connection_c* client_connection,
+		e_listing_format format, const std::string& command_value);
+
+	// LIST -R: the directory and its subdirectories in "ls -R" order over one data connection,
+	// directories are enumerated by worker threads ahead of the sending one;
+	// truncated is set when a limit of depth or entries was hit
+	virtual bool send_recursive_listing(ftp_client_connection_c* client_connection,
+		data_transfer_s& transfer,
+		const std::string& directory,
+		const std::string& display_path,
+		const filesystem_tools::helpers::glob_matcher_c& name_filter,
+		bool& truncated);
+
+	// MLST, facts of a single file go over control connection
+	virtual void handle_mlst_command(ftp_client_connection_c* client_connection,
+		const std::string& command_value);
+
+	// "ls -l" line of the entry with CRLF, name in encoding of the client;
+	// LIST -R calls it from its worker threads too
+	virtual void format_list_entry(ftp_client_connection_c* client_connection,
+		const filesystem_tools::directory_iterator_c::entity_info_s& entity, std::string& out);
+
+	// "fact=value;... name" line of MLSD / MLST with CRLF
+	virtual void format_mlsx_entry(ftp_client_connection_c* client_connection,
+		const filesystem_tools::directory_iterator_c::entity_info_s& entity, std::string& out);
+
+	// path was created, changed or removed by the server: drops it from the caches;
+	// directory_tree - a directory was renamed or removed, paths below it are gone too
+	void invalidate_cached_path(const std::string& path, bool directory_tree = false);
+
+	// name in encoding of the client
+	void append_translated_name(ftp_client_connection_c* client_connection,
+		const std::string& name, std::string& out);
 
 	virtual void handle_retr_command(ftp_client_connection_c* client_connection,
 		const std::string& command_value);
 
+	// append = true for APPE
 	virtual void handle_stor_command(ftp_client_connection_c* client_connection,
+		const std::string& command_value, bool append = false);
+
+	virtual void handle_site_command(ftp_client_connection_c* client_connection,
 		const std::string& command_value);
 
+	// AUTH, PBSZ, PROT
+	virtual void handle_security_command(ftp_client_connection_c* client_connection,
+		e_command_types command, const std::string& command_value);
+
 protected:
 	std::string m_home_dir;
 
@@ -279,9 +1139,72 @@ protected:
 
 	volatile bool m_working = false;
 
+	// samples of transfers in progress and of the last ones over;
+	// declared before the connections, whose transfers report to them when destroyed
+	std::vector<transfer_statistics_s*> m_active_transfers_statistics;
+	std::deque<transfer_statistics_s> m_recent_transfers_statistics;
+	std::mutex m_transfers_statistics_mutex;
+
 	std::vector<ftp_client_connection_t> m_client_connections;
 
-	std::vector<port_busy_flag_s> m_data_channel_ports_map;
+	// target path -> ranged upload in progress
+	std::map<std::string, partial_upload_t> m_partial_uploads;
+
+	token_bucket_c m_global_rate_limiter;
+
+	// user name -> settings shared by all sessions of the user,
+	// users the owner configured only
+	std::map<std::string, user_profile_t> m_user_profiles;
+	std::mutex m_user_profiles_mutex;
+
+	// users without settings of their own, unlimited
+	user_profile_t m_default_user_profile;
+
+	// control connections from these hosts may use FXP
+	std::vector<struct sockaddr_storage> m_fxp_hosts;
+	std::mutex m_fxp_hosts_mutex;
+
+	uint64_t m_session_rate_limit;
+	uint64_t m_session_rate_burst;
+
+	ports_pool_c m_data_channel_ports_pool;
+
+	std::vector<passive_listener_s> m_passive_listeners_pool;
+	uint32_t m_passive_listeners_pool_size;
+
+	uint32_t m_data_channel_timeout_sec;
+
+	uint32_t m_max_data_channels_per_session;
+
+	uint32_t m_block_restart_marker_interval;
+
+	int m_deflate_level;
+
+#ifdef FTPSERVER_WITH_ZLIB
+	// MODE Z compression threads of all transfers, started by the first one
+	std::shared_ptr<worker_pool_c> m_deflate_workers;
+#endif
+
+	uint32_t m_active_connect_timeout_sec;
+	uint16_t m_active_mode_source_port;
+
+	uint32_t m_partial_upload_timeout_sec;
+
+	socket_profile_s m_socket_profiles[e_socket_profile_count];
+
+	listing_cache_c m_listing_cache;
+
+	metadata_cache_c m_metadata_cache;
+
+	uint32_t m_recursive_list_max_depth;
+	uint64_t m_recursive_list_max_entries;
+	uint32_t m_recursive_list_threads;
+
+#ifdef FTPSERVER_WITH_OPENSSL
+	std::shared_ptr<tls_tools::tls_context_c> m_tls_context;
+
+	bool m_tls_required = false;
+#endif
 
 	e_encoding m_native_encoding;
 };
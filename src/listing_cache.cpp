@@ -0,0 +1,479 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+// first, it sets 64-bit off_t before any system header
+#include "filesystem_tools.h"
+#include "listing_cache.h"
+
+#include <chrono>
+
+#if defined(__linux__)
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/vfs.h>		// statfs
+#	include <sys/inotify.h>
+#endif
+
+//
+
+// bookkeeping of a listing besides its text (keys, nodes of maps and list)
+#define LISTING_ENTRY_OVERHEAD		256
+
+#if defined(__linux__)
+// changes of the directory entries and of the directory itself
+#	define LISTING_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB \
+		| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// inotify does not see changes made by other hosts on these
+static bool is_network_filesystem(long fs_type)
+{
+	switch ((unsigned long)fs_type)
+	{
+	case 0x6969:		// NFS
+	case 0x517B:		// SMB
+	case 0xFF534D42:	// CIFS
+	case 0xFE534D42:	// SMB2
+	case 0x65735546:	// FUSE (sshfs, s3fs, ...)
+	case 0x01021997:	// 9P
+	case 0x00C36400:	// CEPH
+		return true;
+	default:
+		return false;
+	}
+}
+#endif
+
+namespace ftp_server
+{
+
+listing_cache_c::listing_cache_c()
+	: m_memory_budget(0)
+	, m_ttl_sec(0)
+	, m_notify_fd(-1)
+	, m_next_ticket(1)
+	, m_memory_used(0)
+	, m_hits(0)
+	, m_misses(0)
+	, m_invalidations(0)
+	, m_evictions(0)
+{
+}
+
+
+listing_cache_c::~listing_cache_c()
+{
+#if defined(__linux__)
+	if (m_notify_fd >= 0)
+		close(m_notify_fd);
+#endif
+}
+
+
+void listing_cache_c::set_memory_budget(size_t budget_bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_memory_budget = budget_bytes;
+
+	evict(budget_bytes);
+}
+
+
+listing_cache_c::listing_t listing_cache_c::find(const std::string& directory, int variant)
+{
+	if (!enabled())
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	process_events();
+
+	auto dir_it = find_directory(directory);
+	if (dir_it == m_directories.end())
+	{
+		++m_misses;
+		return nullptr;
+	}
+
+	auto it = dir_it->second.listings.find(variant);
+	if (it == dir_it->second.listings.end())
+	{
+		++m_misses;
+		return nullptr;
+	}
+
+	uint64_t ttl_sec = dir_it->second.watch < 0 ?
+		m_ttl_sec :
+		(uint64_t)m_ttl_sec * LISTING_CACHE_WATCHED_TTL_FACTOR;
+
+	if (now_sec() - it->second.created_sec >= ttl_sec)
+	{
+		++m_misses;
+		++m_invalidations;
+
+		remove_listing(dir_it, it);
+		return nullptr;
+	}
+
+	++m_hits;
+
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+
+	return it->second.listing;
+}
+
+
+uint64_t listing_cache_c::begin_fill(const std::string& directory)
+{
+	if (!enabled())
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	process_events();
+
+	auto key = normalize(directory);
+
+	auto dir_it = m_directories.find(key);
+	if (dir_it == m_directories.end())
+	{
+		directory_s dir;
+		dir.ticket = m_next_ticket++;
+		// watch is set up before enumeration, so no change slips in between
+		dir.watch = add_watch(key);
+
+		dir_it = m_directories.emplace(key, std::move(dir)).first;
+	}
+
+	return dir_it->second.ticket;
+}
+
+
+void listing_cache_c::end_fill(const std::string& directory, int variant,
+	const listing_t& listing, uint64_t ticket)
+{
+	if (ticket == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	process_events();
+
+	auto dir_it = find_directory(directory);
+
+	// directory changed (and was dropped) while it was enumerated
+	if (dir_it == m_directories.end() || dir_it->second.ticket != ticket)
+		return;
+
+	size_t cost = listing ? listing->size() + dir_it->first.size() + LISTING_ENTRY_OVERHEAD : 0;
+
+	if (!listing || listing->size() > listing_size_limit())
+	{
+		if (dir_it->second.listings.empty())
+			remove_directory(dir_it);
+
+		return;
+	}
+
+	auto& listings = dir_it->second.listings;
+
+	auto it = listings.find(variant);
+	if (it != listings.end())
+		remove_listing(dir_it, it);	// filled by two sessions at once
+
+	listing_s entry;
+	{
+		entry.listing = listing;
+		entry.cost = cost;
+		entry.created_sec = now_sec();
+
+		m_lru.emplace_front(dir_it->first, variant);
+		entry.lru_it = m_lru.begin();
+	}
+
+	listings.emplace(variant, entry);
+
+	m_memory_used += cost;
+
+	// the new listing is at the front, so it is not evicted
+	evict(m_memory_budget);
+}
+
+
+void listing_cache_c::invalidate(const std::string& directory)
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto dir_it = find_directory(directory);
+	if (dir_it == m_directories.end())
+		return;
+
+	m_invalidations += dir_it->second.listings.size();
+
+	remove_directory(dir_it);
+}
+
+
+void listing_cache_c::invalidate_path(const std::string& path)
+{
+	if (!enabled())
+		return;
+
+	std::string target = path;
+	while (target.size() > 1 && (target.back() == '/' || target.back() == '\\'))
+		target.pop_back();
+
+	invalidate(target);
+	invalidate(filesystem_tools::helpers::get_directory_path(target));
+}
+
+
+void listing_cache_c::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	while (!m_directories.empty())
+		remove_directory(m_directories.begin());
+}
+
+
+listing_cache_c::statistics_s listing_cache_c::statistics()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	statistics_s stats;
+	{
+		stats.hits = m_hits;
+		stats.misses = m_misses;
+		stats.invalidations = m_invalidations;
+		stats.evictions = m_evictions;
+		stats.memory_used = m_memory_used;
+		stats.listings_count = m_lru.size();
+		stats.watched_directories = m_watches.size();
+	}
+
+	return stats;
+}
+
+
+void listing_cache_c::process_events()
+{
+#if defined(__linux__)
+	if (m_notify_fd < 0)
+		return;
+
+	alignas(struct inotify_event) char buf[4096];
+
+	while (true)
+	{
+		ssize_t len = read(m_notify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;	// EAGAIN, nothing more
+
+		for (ssize_t pos = 0; pos < len; )
+		{
+			auto event = (const struct inotify_event*)(buf + pos);
+			pos += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// events were lost, nothing can be trusted
+				for (auto& dir : m_directories)
+					m_invalidations += dir.second.listings.size();
+
+				while (!m_directories.empty())
+					remove_directory(m_directories.begin());
+
+				continue;
+			}
+
+			auto watch_it = m_watches.find(event->wd);
+			if (watch_it == m_watches.end())
+				continue;
+
+			if (event->mask & IN_IGNORED)
+			{
+				// kernel removed the watch (directory deleted, unmounted)
+				for (auto& watched_directory : watch_it->second)
+				{
+					auto dir_it = m_directories.find(watched_directory);
+					if (dir_it != m_directories.end())
+					{
+						m_invalidations += dir_it->second.listings.size();
+						dir_it->second.watch = -1;	// gone already
+						remove_directory(dir_it);
+					}
+				}
+
+				m_watches.erase(watch_it);
+				continue;
+			}
+
+			// copy, removing the directory changes the set
+			auto watched_directories = watch_it->second;
+
+			for (auto& watched_directory : watched_directories)
+			{
+				// size and time of the directory in the listing of its parent changed too
+				for (auto& changed_directory : { watched_directory, parent_directory(watched_directory) })
+				{
+					auto dir_it = m_directories.find(changed_directory);
+					if (dir_it != m_directories.end())
+					{
+						m_invalidations += dir_it->second.listings.size();
+						remove_directory(dir_it);
+					}
+				}
+			}
+		}
+	}
+#endif
+}
+
+
+listing_cache_c::directories_t::iterator listing_cache_c::find_directory(const std::string& directory)
+{
+	return m_directories.find(normalize(directory));
+}
+
+
+void listing_cache_c::remove_directory(directories_t::iterator it)
+{
+	for (auto& listing : it->second.listings)
+	{
+		m_memory_used -= listing.second.cost;
+		m_lru.erase(listing.second.lru_it);
+	}
+
+	if (it->second.watch >= 0)
+		remove_watch(it->second.watch, it->first);
+
+	m_directories.erase(it);
+}
+
+
+void listing_cache_c::remove_listing(directories_t::iterator dir_it, std::map<int, listing_s>::iterator it)
+{
+	m_memory_used -= it->second.cost;
+	m_lru.erase(it->second.lru_it);
+
+	dir_it->second.listings.erase(it);
+
+	if (dir_it->second.listings.empty())
+		remove_directory(dir_it);
+}
+
+
+void listing_cache_c::evict(size_t budget)
+{
+	while (m_memory_used > budget && !m_lru.empty())
+	{
+		auto& last = m_lru.back();
+
+		auto dir_it = m_directories.find(last.first);
+		if (dir_it == m_directories.end())
+		{
+			m_lru.pop_back();	// never happens
+			continue;
+		}
+
+		auto it = dir_it->second.listings.find(last.second);
+		if (it == dir_it->second.listings.end())
+		{
+			m_lru.pop_back();
+			continue;
+		}
+
+		++m_evictions;
+
+		remove_listing(dir_it, it);
+	}
+}
+
+
+int listing_cache_c::add_watch(const std::string& directory)
+{
+#if defined(__linux__)
+	if (m_notify_fd < 0)
+	{
+		m_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_notify_fd < 0)
+			return -1;
+	}
+
+	struct statfs fs;
+	if (statfs(directory.c_str(), &fs) != 0 || is_network_filesystem((long)fs.f_type))
+		return -1;
+
+	// fails on inotify limit (max_user_watches), listings of the directory expire then
+	int watch = inotify_add_watch(m_notify_fd, directory.c_str(), LISTING_WATCH_MASK);
+	if (watch < 0)
+		return -1;
+
+	m_watches[watch].insert(directory);
+
+	return watch;
+#else
+	(void)directory;
+	return -1;
+#endif
+}
+
+
+void listing_cache_c::remove_watch(int watch, const std::string& directory)
+{
+#if defined(__linux__)
+	auto watch_it = m_watches.find(watch);
+	if (watch_it == m_watches.end())
+		return;
+
+	watch_it->second.erase(directory);
+
+	if (watch_it->second.empty())
+	{
+		inotify_rm_watch(m_notify_fd, watch);
+		m_watches.erase(watch_it);
+	}
+#else
+	(void)watch;
+	(void)directory;
+#endif
+}
+
+
+std::string listing_cache_c::normalize(const std::string& directory)
+{
+	// "/a//b" and "/a/b/" are the same directory
+	return filesystem_tools::helpers::rebuild_path(directory);
+}
+
+
+std::string listing_cache_c::parent_directory(const std::string& directory)
+{
+	std::string path = directory;
+	while (!path.empty() && (path.back() == '/' || path.back() == '\\'))
+		path.pop_back();
+
+	size_t index = path.find_last_of("\\/");
+
+	return index == std::string::npos ?
+		std::string() :
+		path.substr(0, index + 1);
+}
+
+
+uint64_t listing_cache_c::now_sec()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <map>
+#include <set>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// single listing may take this part of the memory budget at most (1 / N)
+#define LISTING_CACHE_BUDGET_SHARE	4
+
+// listings of watched directories expire after this many TTLs: sizes and times
+// of their subdirectories change without events unless those are watched too
+#define LISTING_CACHE_WATCHED_TTL_FACTOR	12
+
+//
+
+namespace ftp_server
+{
+
+// Rendered directory listings shared by all sessions, so clients polling
+// the same directory do not enumerate and stat it again and again.
+// Linux: a listing lives until inotify reports a change in the directory
+// or in one of its watched subdirectories, but no longer than a multiple of TTL;
+// directories which can not be watched (network filesystems, inotify limit)
+// and other platforms fall back to expiration after TTL.
+// Least recently used listings are evicted to stay within the memory budget.
+class listing_cache_c
+{
+private:
+	listing_cache_c(const listing_cache_c&) = delete;
+	listing_cache_c& operator=(const listing_cache_c&) = delete;
+
+public:
+	typedef std::shared_ptr<const std::string> listing_t;
+
+	struct statistics_s
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t invalidations;	// listings dropped because the directory changed or expired
+		uint64_t evictions;		// listings dropped to fit the memory budget
+		size_t memory_used;
+		size_t listings_count;
+		size_t watched_directories;
+	};
+
+public:
+	listing_cache_c();
+
+	~listing_cache_c();
+
+	// bytes of listings kept, 0 - cache disabled
+	void set_memory_budget(size_t budget_bytes);
+	size_t memory_budget() const { return m_memory_budget; }
+
+	bool enabled() const { return m_memory_budget != 0; }
+
+	// bigger listings are streamed without being kept, so one huge
+	// directory does not push out all the others
+	size_t listing_size_limit() const { return m_memory_budget / LISTING_CACHE_BUDGET_SHARE; }
+
+	// lifetime of listings of directories without change notifications,
+	// watched ones live LISTING_CACHE_WATCHED_TTL_FACTOR times longer
+	void set_ttl(uint32_t ttl_sec) { m_ttl_sec = ttl_sec; }
+	uint32_t ttl() const { return m_ttl_sec; }
+
+	// variant tells listings of one directory apart (encoding, format), null on miss
+	listing_t find(const std::string& directory, int variant);
+
+	// begin_fill() goes before the directory is enumerated, end_fill() stores the
+	// listing only if the directory did not change meanwhile; null listing - enumeration failed
+	uint64_t begin_fill(const std::string& directory);
+	void end_fill(const std::string& directory, int variant, const listing_t& listing, uint64_t ticket);
+
+	// changes made by the server itself, for platforms without notifications
+	void invalidate(const std::string& directory);
+	// file or directory was created, changed or removed: drops its parent and itself
+	void invalidate_path(const std::string& path);
+
+	void clear();
+
+	statistics_s statistics();
+
+private:
+	struct listing_s
+	{
+		listing_t listing;
+		size_t cost;
+		uint64_t created_sec;
+		std::list<std::pair<std::string, int>>::iterator lru_it;
+	};
+
+	struct directory_s
+	{
+		uint64_t ticket;
+		int watch;	// -1 - not watched, listings expire
+		std::map<int, listing_s> listings;
+	};
+
+	typedef std::map<std::string, directory_s> directories_t;
+
+	// linux: reads inotify events and drops changed directories
+	void process_events();
+
+	directories_t::iterator find_directory(const std::string& directory);
+	void remove_directory(directories_t::iterator it);
+	void remove_listing(directories_t::iterator dir_it, std::map<int, listing_s>::iterator it);
+	void evict(size_t budget);
+
+	int add_watch(const std::string& directory);
+	void remove_watch(int watch, const std::string& directory);
+
+	static std::string normalize(const std::string& directory);
+	// "/a/b/" -> "/a/", empty for the root
+	static std::string parent_directory(const std::string& directory);
+	static uint64_t now_sec();
+
+private:
+	std::mutex m_mutex;
+
+	size_t m_memory_budget;
+	uint32_t m_ttl_sec;
+
+	directories_t m_directories;
+
+	// front - most recently used (directory, variant)
+	std::list<std::pair<std::string, int>> m_lru;
+
+	// watch descriptor -> directories using it (same inode under different paths)
+	std::map<int, std::set<std::string>> m_watches;
+	int m_notify_fd;
+
+	uint64_t m_next_ticket;
+
+	size_t m_memory_used;
+
+	uint64_t m_hits;
+	uint64_t m_misses;
+	uint64_t m_invalidations;
+	uint64_t m_evictions;
+};
+
+}
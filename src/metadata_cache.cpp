@@ -0,0 +1,549 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+// first, it sets 64-bit off_t before any system header
+#include "filesystem_tools.h"
+#include "metadata_cache.h"
+
+#include <chrono>
+#include <vector>
+#include <functional>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#	include <unistd.h>
+#	include <sys/inotify.h>
+#endif
+
+//
+
+#if defined(__linux__)
+// finished writes, not every write() of a file being uploaded;
+// size of a growing file is refreshed by TTL
+#	define METADATA_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB \
+		| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+
+namespace ftp_server
+{
+
+metadata_cache_c::metadata_cache_c()
+	: m_capacity(0)
+	, m_ttl_ms(0)
+	, m_negative_ttl_ms(0)
+	, m_generation(0)
+	, m_notify_fd(-1)
+{
+}
+
+
+metadata_cache_c::~metadata_cache_c()
+{
+#if defined(__linux__)
+	if (m_notify_fd >= 0)
+		close(m_notify_fd);
+#endif
+}
+
+
+void metadata_cache_c::set_capacity(size_t entries_count)
+{
+	m_capacity = entries_count;
+
+	size_t capacity = entries_count ? shard_capacity() : 0;
+
+	for (auto& shard : m_shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		while (shard.entries.size() > capacity)
+		{
+			shard.entries.erase(shard.lru.back());
+			shard.lru.pop_back();
+
+			++shard.evictions;
+		}
+	}
+}
+
+
+bool metadata_cache_c::get(const std::string& path, path_info_s& info)
+{
+	bool directory_expected = !path.empty() && (path.back() == '/' || path.back() == '\\');
+
+	entry_s entry;
+	std::string key;
+
+	if (!enabled() || !make_key(path, key))
+	{
+		entry.exists = stat_path(path, entry.info, entry.error);
+		return take_result(entry, directory_expected, info);
+	}
+
+	process_events();
+
+	uint64_t epoch = 0;
+	uint64_t generation = 0;
+
+	if (find_entry(key, entry, epoch, generation))
+		return take_result(entry, directory_expected, info);
+
+	// watch goes first, so a change right after stat is not missed
+	watch_directory(parent_key(key));
+
+	entry.exists = stat_path(path, entry.info, entry.error);
+
+	// other errors (permissions, i/o) may go away, they are not kept
+	if (entry.exists || entry.error == ENOENT || entry.error == ENOTDIR)
+		store_entry(key, entry, epoch, generation);
+
+	return take_result(entry, directory_expected, info);
+}
+
+
+metadata_cache_c::e_cached_state metadata_cache_c::find(const std::string& path, path_info_s& info)
+{
+	bool directory_expected = !path.empty() && (path.back() == '/' || path.back() == '\\');
+
+	std::string key;
+
+	if (!enabled() || !make_key(path, key))
+		return e_cached_unknown;
+
+	process_events();
+
+	entry_s entry;
+	uint64_t epoch = 0;
+	uint64_t generation = 0;
+
+	if (!find_entry(key, entry, epoch, generation))
+		return e_cached_unknown;
+
+	return take_result(entry, directory_expected, info) ? e_cached_exists : e_cached_missing;
+}
+
+
+void metadata_cache_c::invalidate_path(const std::string& path)
+{
+	if (!enabled())
+		return;
+
+	std::string key;
+	if (!make_key(path, key))
+	{
+		// can not tell which entries the path is
+		++m_generation;
+		return;
+	}
+
+	drop(key);
+	drop(parent_key(key));
+}
+
+
+void metadata_cache_c::invalidate_tree(const std::string& path)
+{
+	if (!enabled())
+		return;
+
+	// entries below the directory are not found by prefix in hashed shards,
+	// all of them go, directories are renamed and removed rarely
+	++m_generation;
+
+	invalidate_path(path);
+}
+
+
+void metadata_cache_c::clear()
+{
+	for (auto& shard : m_shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		shard.entries.clear();
+		shard.lru.clear();
+
+		++shard.epoch;
+	}
+}
+
+
+metadata_cache_c::statistics_s metadata_cache_c::statistics()
+{
+	statistics_s stats;
+	{
+		stats.hits = 0;
+		stats.negative_hits = 0;
+		stats.misses = 0;
+		stats.invalidations = 0;
+		stats.evictions = 0;
+		stats.entries_count = 0;
+	}
+
+	for (auto& shard : m_shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		stats.hits += shard.hits;
+		stats.negative_hits += shard.negative_hits;
+		stats.misses += shard.misses;
+		stats.invalidations += shard.invalidations;
+		stats.evictions += shard.evictions;
+		stats.entries_count += shard.entries.size();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_watch_mutex);
+		stats.watched_directories = m_watches.size();
+	}
+
+	return stats;
+}
+
+
+metadata_cache_c::shard_s& metadata_cache_c::shard_of(const std::string& key)
+{
+	return m_shards[std::hash<std::string>()(key) % METADATA_CACHE_SHARDS];
+}
+
+
+bool metadata_cache_c::find_entry(const std::string& key, entry_s& entry,
+	uint64_t& epoch, uint64_t& generation)
+{
+	auto& shard = shard_of(key);
+
+	generation = m_generation;
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	epoch = shard.epoch;
+
+	auto it = shard.entries.find(key);
+	if (it != shard.entries.end()
+		&& it->second.generation == generation
+		&& now_ms() < it->second.expires_ms)
+	{
+		entry = it->second;
+
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_it);
+
+		if (entry.exists)
+			++shard.hits;
+		else
+			++shard.negative_hits;
+
+		return true;
+	}
+
+	if (it != shard.entries.end())
+	{
+		// expired or of older generation
+		shard.lru.erase(it->second.lru_it);
+		shard.entries.erase(it);
+	}
+
+	++shard.misses;
+
+	return false;
+}
+
+
+void metadata_cache_c::store_entry(const std::string& key, entry_s& entry,
+	uint64_t epoch, uint64_t generation)
+{
+	auto& shard = shard_of(key);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	// path was dropped while it was stat'ed, the result may be old already
+	if (shard.epoch != epoch || shard.entries.find(key) != shard.entries.end())
+		return;
+
+	entry.generation = generation;
+	entry.expires_ms = now_ms() + (entry.exists ? m_ttl_ms : m_negative_ttl_ms);
+
+	shard.lru.push_front(key);
+	entry.lru_it = shard.lru.begin();
+
+	shard.entries.emplace(key, entry);
+
+	while (shard.entries.size() > shard_capacity())
+	{
+		shard.entries.erase(shard.lru.back());
+		shard.lru.pop_back();
+
+		++shard.evictions;
+	}
+}
+
+
+bool metadata_cache_c::take_result(entry_s& entry, bool directory_expected, path_info_s& info)
+{
+	if (entry.exists && directory_expected && !entry.info.is_directory)
+	{
+		entry.exists = false;
+		entry.error = ENOTDIR;
+	}
+
+	if (!entry.exists)
+	{
+		errno = entry.error;
+		return false;
+	}
+
+	info = entry.info;
+
+	return true;
+}
+
+
+size_t metadata_cache_c::shard_capacity() const
+{
+	size_t capacity = m_capacity / METADATA_CACHE_SHARDS;
+
+	return capacity ? capacity : 1;
+}
+
+
+void metadata_cache_c::drop(const std::string& key)
+{
+	if (key.empty())
+		return;
+
+	auto& shard = shard_of(key);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	// stat in progress must not store what it has seen before the change
+	++shard.epoch;
+
+	auto it = shard.entries.find(key);
+	if (it == shard.entries.end())
+		return;
+
+	shard.lru.erase(it->second.lru_it);
+	shard.entries.erase(it);
+
+	++shard.invalidations;
+}
+
+
+void metadata_cache_c::process_events()
+{
+#if defined(__linux__)
+	std::vector<std::string> changed;
+	bool everything_changed = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_watch_mutex);
+
+		if (m_notify_fd < 0)
+			return;
+
+		alignas(struct inotify_event) char buf[4096];
+
+		while (true)
+		{
+			ssize_t len = read(m_notify_fd, buf, sizeof(buf));
+			if (len <= 0)
+				break;	// EAGAIN, nothing more
+
+			for (ssize_t pos = 0; pos < len; )
+			{
+				auto event = (const struct inotify_event*)(buf + pos);
+				pos += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					// events were lost, nothing can be trusted
+					everything_changed = true;
+					continue;
+				}
+
+				auto watch_it = m_watches.find(event->wd);
+				if (watch_it == m_watches.end())
+					continue;
+
+				const std::string& directory = watch_it->second;
+
+				if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+				{
+					// directory is gone or lives under another path now, so do its subdirectories
+					everything_changed = true;
+
+					if (!(event->mask & IN_IGNORED))
+						inotify_rm_watch(m_notify_fd, event->wd);
+
+					m_watched_directories.erase(directory);
+					m_watches.erase(watch_it);
+					continue;
+				}
+
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)))
+					everything_changed = true;
+
+				if (event->len)
+				{
+					std::string entry_key = directory;
+					if (entry_key.back() != '/')
+						entry_key += '/';
+					entry_key += event->name;
+
+					changed.push_back(entry_key);
+				}
+
+				// modification time of the directory itself
+				changed.push_back(directory);
+			}
+		}
+	}
+
+	if (everything_changed)
+		++m_generation;
+
+	for (auto& key : changed)
+		drop(key);
+#endif
+}
+
+
+void metadata_cache_c::watch_directory(const std::string& directory)
+{
+#if defined(__linux__)
+	if (directory.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(m_watch_mutex);
+
+	if (m_watched_directories.find(directory) != m_watched_directories.end())
+		return;
+
+	if (m_notify_fd < 0)
+	{
+		m_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_notify_fd < 0)
+			return;
+	}
+
+	if (m_watched_directories.size() >= METADATA_CACHE_MAX_WATCHES)
+	{
+		// entries of directories without watch are still refreshed by TTL
+		for (auto& watch : m_watches)
+			inotify_rm_watch(m_notify_fd, watch.first);
+
+		m_watches.clear();
+		m_watched_directories.clear();
+	}
+
+	// fails for missing directory and on inotify limit (max_user_watches),
+	// -1 is kept too, so the next miss does not try again
+	int watch = inotify_add_watch(m_notify_fd, directory.c_str(), METADATA_WATCH_MASK);
+
+	m_watched_directories[directory] = watch;
+
+	if (watch >= 0)
+		m_watches[watch] = directory;
+#else
+	(void)directory;
+#endif
+}
+
+
+bool metadata_cache_c::make_key(const std::string& path, std::string& key)
+{
+	key.clear();
+	key.reserve(path.size());
+
+	if (!path.empty() && (path[0] == '/' || path[0] == '\\'))
+		key += '/';
+
+	size_t pos = 0;
+
+	while (pos < path.size())
+	{
+		size_t end = path.find_first_of("/\\", pos);
+		if (end == std::string::npos)
+			end = path.size();
+
+		size_t len = end - pos;
+
+		if (len)
+		{
+			// "link/.." is not the directory of the link
+			if (path[pos] == '.' && (len == 1 || (len == 2 && path[pos + 1] == '.')))
+				return false;
+
+			if (!key.empty() && key.back() != '/')
+				key += '/';
+
+			key.append(path, pos, len);
+		}
+
+		pos = end + 1;
+	}
+
+	return !key.empty();
+}
+
+
+std::string metadata_cache_c::parent_key(const std::string& key)
+{
+	size_t pos = key.find_last_of('/');
+
+	if (pos == std::string::npos || key.size() == 1)
+		return std::string();
+
+	return pos == 0 ? std::string("/") : key.substr(0, pos);
+}
+
+
+bool metadata_cache_c::stat_path(const std::string& path, path_info_s& info, int& error)
+{
+	std::string target_path = path;
+
+	// stat of esp-idf (and msvc) fails on trailing slash
+	while (target_path.size() > 1 && (target_path.back() == '/' || target_path.back() == '\\'))
+		target_path.pop_back();
+
+#ifdef WIN32
+	struct _stat64 st;
+	if (_stat64(target_path.c_str(), &st) != 0)
+	{
+		error = errno;
+		return false;
+	}
+
+	info.is_directory = (st.st_mode & _S_IFDIR) != 0;
+#else
+	struct stat st;
+	if (stat(target_path.c_str(), &st) != 0)
+	{
+		error = errno;
+		return false;
+	}
+
+	info.is_directory = S_ISDIR(st.st_mode);
+#endif
+
+	info.size = (uint64_t)st.st_size;
+	info.mtime = st.st_mtime;
+
+	error = 0;
+
+	return true;
+}
+
+
+uint64_t metadata_cache_c::now_ms()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
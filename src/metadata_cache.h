@@ -0,0 +1,180 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// paths are spread over this many independently locked parts
+#define METADATA_CACHE_SHARDS		16
+
+// linux: directories watched for changes at most, watches start over beyond it
+#define METADATA_CACHE_MAX_WATCHES	1024
+
+//
+
+namespace ftp_server
+{
+
+// Results of stat() of paths named by commands (SIZE, CWD, RNFR, DELE, MKD, ...),
+// missing paths included, so clients probing for files which do not exist
+// and network filesystems do not cost a lookup per command.
+// Entries live a short TTL (missing paths even shorter), changes made by the
+// server drop them at once; linux: so do changes in their directories made
+// by others and reported by inotify (closed writes, created, removed, renamed).
+// Paths are spread over shards by hash, every shard has its own lock and
+// least recently used list, the oldest entries are dropped beyond capacity.
+class metadata_cache_c
+{
+private:
+	metadata_cache_c(const metadata_cache_c&) = delete;
+	metadata_cache_c& operator=(const metadata_cache_c&) = delete;
+
+public:
+	struct path_info_s
+	{
+		bool is_directory;
+		uint64_t size;
+		time_t mtime;
+	};
+
+	enum e_cached_state
+	{
+		e_cached_unknown,
+		e_cached_exists,
+		e_cached_missing
+	};
+
+	struct statistics_s
+	{
+		uint64_t hits;
+		uint64_t negative_hits;		// missing paths answered from the cache
+		uint64_t misses;
+		uint64_t invalidations;		// entries dropped because the path changed
+		uint64_t evictions;			// entries dropped to stay within capacity
+		size_t entries_count;
+		size_t watched_directories;
+	};
+
+public:
+	metadata_cache_c();
+
+	~metadata_cache_c();
+
+	// entries kept at most, 0 - cache disabled
+	void set_capacity(size_t entries_count);
+	size_t capacity() const { return m_capacity; }
+
+	bool enabled() const { return m_capacity != 0; }
+
+	// lifetime of entries of existing and of missing paths
+	void set_ttl(uint32_t ttl_ms, uint32_t negative_ttl_ms) { m_ttl_ms = ttl_ms; m_negative_ttl_ms = negative_ttl_ms; }
+	uint32_t ttl() const { return m_ttl_ms; }
+	uint32_t negative_ttl() const { return m_negative_ttl_ms; }
+
+	// stat() through the cache, false - no such path (or it can not be stat'ed),
+	// errno is set as stat() sets it; path with trailing slash must be a directory
+	bool get(const std::string& path, path_info_s& info);
+
+	// cache only, the filesystem is not asked; missing - errno is set too.
+	// Commands which fail on missing (DELE, RETR) or existing (MKD) path
+	// answer from it before they touch the filesystem
+	e_cached_state find(const std::string& path, path_info_s& info);
+
+	// file or directory was created, changed or removed: drops it and its parent
+	void invalidate_path(const std::string& path);
+	// directory was renamed or removed: nothing below it is valid any more
+	void invalidate_tree(const std::string& path);
+
+	void clear();
+
+	statistics_s statistics();
+
+private:
+	struct entry_s
+	{
+		bool exists;
+		int error;		// errno of missing path
+		path_info_s info;
+		uint64_t expires_ms;
+		uint64_t generation;
+		std::list<std::string>::iterator lru_it;
+	};
+
+	struct shard_s
+	{
+		std::mutex mutex;
+
+		std::unordered_map<std::string, entry_s> entries;
+
+		// front - most recently used
+		std::list<std::string> lru;
+
+		// bumped by every drop, entry stat'ed meanwhile is not stored
+		uint64_t epoch = 0;
+
+		uint64_t hits = 0;
+		uint64_t negative_hits = 0;
+		uint64_t misses = 0;
+		uint64_t invalidations = 0;
+		uint64_t evictions = 0;
+	};
+
+	shard_s& shard_of(const std::string& key);
+
+	// live entry of the key, epoch and generation tell a stat result may be stored later
+	bool find_entry(const std::string& key, entry_s& entry, uint64_t& epoch, uint64_t& generation);
+	void store_entry(const std::string& key, entry_s& entry, uint64_t epoch, uint64_t generation);
+
+	// "file/" is not found, as stat() says
+	static bool take_result(entry_s& entry, bool directory_expected, path_info_s& info);
+
+	size_t shard_capacity() const;
+
+	void drop(const std::string& key);
+
+	// linux: reads inotify events and drops changed paths
+	void process_events();
+	void watch_directory(const std::string& directory);
+
+	// "/a//b/" -> "/a/b", false for paths with "." or ".." (they depend on symlinks)
+	static bool make_key(const std::string& path, std::string& key);
+	static std::string parent_key(const std::string& key);
+
+	// errno of a missing path is returned in error
+	static bool stat_path(const std::string& path, path_info_s& info, int& error);
+
+	static uint64_t now_ms();
+
+private:
+	shard_s m_shards[METADATA_CACHE_SHARDS];
+
+	size_t m_capacity;
+	uint32_t m_ttl_ms;
+	uint32_t m_negative_ttl_ms;
+
+	// entries of older generations are stale, bumped when whole trees change
+	std::atomic<uint64_t> m_generation;
+
+	std::mutex m_watch_mutex;
+
+	// watch descriptor -> directory
+	std::map<int, std::string> m_watches;
+	std::map<std::string, int> m_watched_directories;
+	int m_notify_fd;
+};
+
+}
@@ -0,0 +1,154 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "ports_pool.h"
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+//
+
+namespace ftp_server
+{
+
+static inline uint32_t lowest_set_bit_index(uint32_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index = 0;
+	_BitScanForward(&index, value);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(value);
+#endif
+}
+
+
+ports_pool_c::ports_pool_c()
+	: m_first_port(0)
+	, m_last_port(0)
+	, m_capacity(0)
+	, m_free_count(0)
+	, m_cursor_word(0)
+{
+}
+
+
+bool ports_pool_c::set_range(uint16_t first_port, uint16_t last_port)
+{
+	if (first_port == 0 || first_port > last_port)
+		return false;
+
+	m_first_port = first_port;
+	m_last_port = last_port;
+
+	m_capacity = (uint32_t)last_port - first_port + 1;
+	m_free_count = m_capacity;
+	m_cursor_word = 0;
+
+	uint32_t words_count = (m_capacity + 31) / 32;
+
+	m_busy_bits.assign(words_count, 0);
+	m_summary_bits.assign((words_count + 31) / 32, 0);
+
+	// tail of the last word is out of range, keep it busy forever
+	uint32_t tail_bits = m_capacity % 32;
+	if (tail_bits)
+	{
+		m_busy_bits[words_count - 1] = ~0u << tail_bits;
+	}
+
+	for (uint32_t word = 0; word < words_count; ++word)
+	{
+		m_summary_bits[word / 32] |= 1u << (word % 32);
+	}
+
+	return true;
+}
+
+
+uint16_t ports_pool_c::allocate()
+{
+	if (m_free_count == 0)
+		return 0;
+
+	uint32_t summary_count = (uint32_t)m_summary_bits.size();
+
+	uint32_t start_summary = m_cursor_word / 32;
+	uint32_t start_bit = m_cursor_word % 32;
+
+	// last pass wraps around to the bits below the cursor
+	for (uint32_t i = 0; i <= summary_count; ++i)
+	{
+		uint32_t summary_index = (start_summary + i) % summary_count;
+		uint32_t bits = m_summary_bits[summary_index];
+
+		if (i == 0)
+			bits &= ~0u << start_bit;
+
+		if (bits == 0)
+			continue;
+
+		uint32_t word = summary_index * 32 + lowest_set_bit_index(bits);
+		uint32_t index = word * 32 + lowest_set_bit_index(~m_busy_bits[word]);
+
+		set_busy(index);
+
+		m_cursor_word = (word + 1) % (uint32_t)m_busy_bits.size();
+
+		return (uint16_t)(m_first_port + index);
+	}
+
+	return 0;
+}
+
+
+void ports_pool_c::release(uint16_t port)
+{
+	if (!is_busy(port))
+		return;
+
+	set_free((uint32_t)port - m_first_port);
+}
+
+
+bool ports_pool_c::is_busy(uint16_t port) const
+{
+	if (m_capacity == 0 || port < m_first_port || port > m_last_port)
+		return false;
+
+	uint32_t index = (uint32_t)port - m_first_port;
+
+	return (m_busy_bits[index / 32] & (1u << (index % 32))) != 0;
+}
+
+
+void ports_pool_c::set_busy(uint32_t index)
+{
+	uint32_t word = index / 32;
+
+	m_busy_bits[word] |= 1u << (index % 32);
+	m_free_count -= 1;
+
+	if (m_busy_bits[word] == ~0u)
+	{
+		m_summary_bits[word / 32] &= ~(1u << (word % 32));
+	}
+}
+
+
+void ports_pool_c::set_free(uint32_t index)
+{
+	uint32_t word = index / 32;
+
+	m_busy_bits[word] &= ~(1u << (index % 32));
+	m_free_count += 1;
+
+	m_summary_bits[word / 32] |= 1u << (word % 32);
+}
+
+}
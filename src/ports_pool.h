@@ -0,0 +1,67 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <vector>
+#include <stdint.h>
+
+//
+
+namespace ftp_server
+{
+
+// Bitmap allocator of data channel (passive) ports.
+// Every port of the range is one bit of m_busy_bits (1 = busy),
+// m_summary_bits keeps one bit per busy word (1 = word has a free port),
+// so allocation never scans more than a couple of words.
+class ports_pool_c
+{
+private:
+	ports_pool_c(const ports_pool_c&) = delete;
+	ports_pool_c& operator=(const ports_pool_c&) = delete;
+
+public:
+	ports_pool_c();
+
+	// [first_port, last_port], both ports included
+	bool set_range(uint16_t first_port, uint16_t last_port);
+
+	uint16_t first_port() const { return m_first_port; }
+	uint16_t last_port() const { return m_last_port; }
+
+	uint32_t capacity() const { return m_capacity; }
+	uint32_t free_count() const { return m_free_count; }
+
+	// returns 0 if there are no free ports
+	uint16_t allocate();
+
+	void release(uint16_t port);
+
+	bool is_busy(uint16_t port) const;
+
+private:
+	void set_busy(uint32_t index);
+	void set_free(uint32_t index);
+
+private:
+	uint16_t m_first_port;
+	uint16_t m_last_port;
+
+	uint32_t m_capacity;
+	uint32_t m_free_count;
+
+	// word to start next search from (round robin, so just freed
+	// port is not handed out again immediately)
+	uint32_t m_cursor_word;
+
+	std::vector<uint32_t> m_busy_bits;
+	std::vector<uint32_t> m_summary_bits;
+};
+
+}
@@ -0,0 +1,79 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "ranges_set.h"
+
+//
+
+namespace ftp_server
+{
+
+void ranges_set_c::add(uint64_t begin, uint64_t end)
+{
+	if (begin >= end)
+		return;
+
+	auto it = m_ranges.upper_bound(begin);
+
+	// previous range reaches the new one
+	if (it != m_ranges.begin())
+	{
+		auto prev = it;
+		--prev;
+
+		if (prev->second >= begin)
+		{
+			begin = prev->first;
+
+			if (prev->second > end)
+				end = prev->second;
+
+			m_ranges.erase(prev);
+		}
+	}
+
+	// following ranges which start inside the new one
+	while (it != m_ranges.end() && it->first <= end)
+	{
+		if (it->second > end)
+			end = it->second;
+
+		it = m_ranges.erase(it);
+	}
+
+	m_ranges.insert(it, std::make_pair(begin, end));
+}
+
+
+bool ranges_set_c::covers(uint64_t begin, uint64_t end) const
+{
+	if (begin >= end)
+		return true;
+
+	auto it = m_ranges.upper_bound(begin);
+	if (it == m_ranges.begin())
+		return false;
+
+	--it;
+
+	return it->first <= begin && it->second >= end;
+}
+
+
+uint64_t ranges_set_c::covered_size() const
+{
+	uint64_t size = 0;
+
+	for (auto& range : m_ranges)
+	{
+		size += range.second - range.first;
+	}
+
+	return size;
+}
+
+}
@@ -0,0 +1,41 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+
+namespace ftp_server
+{
+
+// Set of [begin, end) byte ranges of a file, overlapping and adjacent
+// ranges are merged, so the set stays as small as the number of holes.
+class ranges_set_c
+{
+public:
+	void add(uint64_t begin, uint64_t end);
+
+	// true if [begin, end) is received completely
+	bool covers(uint64_t begin, uint64_t end) const;
+
+	uint64_t covered_size() const;
+
+	size_t ranges_count() const { return m_ranges.size(); }
+
+	void clear() { m_ranges.clear(); }
+
+private:
+	// begin -> end
+	std::map<uint64_t, uint64_t> m_ranges;
+};
+
+}
@@ -0,0 +1,221 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "tls_tools.h"
+
+#ifdef FTPSERVER_WITH_OPENSSL
+
+#include <openssl/err.h>
+
+#include <errno.h>
+
+#if defined(WIN32)
+#	include <winsock2.h>
+#endif
+
+//
+
+namespace tls_tools
+{
+
+static void set_would_block()
+{
+#if defined(WIN32)
+	WSASetLastError(WSAEWOULDBLOCK);
+#else
+	errno = EAGAIN;
+#endif
+}
+
+
+tls_context_c::tls_context_c()
+	: m_ctx(nullptr)
+{
+}
+
+
+tls_context_c::~tls_context_c()
+{
+	if (m_ctx)
+		SSL_CTX_free(m_ctx);
+}
+
+
+bool tls_context_c::load_certificate(const std::string& cert_file, const std::string& key_file)
+{
+	SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+		return false;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	// background transfers retry a short write with a moved buffer
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// stream mode ends the file with closing of data connection,
+	// many clients do not send close_notify before it
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	// data connections resume the session of control connection
+	static const unsigned char session_id_context[] = "lwftp";
+	SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1
+		|| SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(ctx) != 1)
+	{
+		SSL_CTX_free(ctx);
+		return false;
+	}
+
+	if (m_ctx)
+		SSL_CTX_free(m_ctx);
+
+	m_ctx = ctx;
+
+	return true;
+}
+
+
+std::string tls_context_c::last_error()
+{
+	char buf[256] = "";
+	ERR_error_string_n(ERR_peek_last_error(), buf, sizeof(buf));
+	ERR_clear_error();
+
+	return buf;
+}
+
+
+tls_session_c::tls_session_c(const tls_context_c& context, int fd, bool kernel_offload)
+	: m_ssl(SSL_new(context.native_handle()))
+	, m_established(false)
+{
+	if (!m_ssl)
+		return;
+
+	SSL_set_fd(m_ssl, fd);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	// OpenSSL switches to kTLS after the handshake if the kernel and the cipher allow it
+	if (kernel_offload)
+		SSL_set_options(m_ssl, SSL_OP_ENABLE_KTLS);
+#else
+	(void)kernel_offload;
+#endif
+}
+
+
+tls_session_c::~tls_session_c()
+{
+	if (!m_ssl)
+		return;
+
+	// one way close, the peer does not have to answer
+	if (m_established)
+		SSL_shutdown(m_ssl);
+
+	SSL_free(m_ssl);
+
+	ERR_clear_error();
+}
+
+
+e_handshake_state tls_session_c::handshake()
+{
+	if (!m_ssl)
+		return e_handshake_failed;
+
+	int rc = SSL_accept(m_ssl);
+	if (rc == 1)
+	{
+		m_established = true;
+		return e_handshake_done;
+	}
+
+	switch (SSL_get_error(m_ssl, rc))
+	{
+	case SSL_ERROR_WANT_READ:
+		return e_handshake_want_read;
+	case SSL_ERROR_WANT_WRITE:
+		return e_handshake_want_write;
+	default:
+		return e_handshake_failed;
+	}
+}
+
+
+int tls_session_c::send(const char* data, size_t data_size)
+{
+	if (!m_established)
+		return -1;
+
+	return check_io_result(SSL_write(m_ssl, data, (int)data_size));
+}
+
+
+int tls_session_c::recv(char* buf, size_t buf_sz)
+{
+	if (!m_established)
+		return -1;
+
+	return check_io_result(SSL_read(m_ssl, buf, (int)buf_sz));
+}
+
+
+int tls_session_c::pending() const
+{
+	return m_established ? SSL_pending(m_ssl) : 0;
+}
+
+
+int tls_session_c::check_io_result(int rc)
+{
+	if (rc > 0)
+		return rc;
+
+	switch (SSL_get_error(m_ssl, rc))
+	{
+	case SSL_ERROR_ZERO_RETURN:
+		// close_notify (or end of connection, see SSL_OP_IGNORE_UNEXPECTED_EOF)
+		return 0;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		set_would_block();
+		return -1;
+	default:
+		// broken connection must not send close_notify
+		m_established = false;
+		ERR_clear_error();
+		return -1;
+	}
+}
+
+
+bool tls_session_c::kernel_send() const
+{
+	return m_established && BIO_get_ktls_send(SSL_get_wbio(m_ssl)) > 0;
+}
+
+
+const char* tls_session_c::protocol_name() const
+{
+	return m_ssl ? SSL_get_version(m_ssl) : "";
+}
+
+
+const char* tls_session_c::cipher_name() const
+{
+	return m_ssl ? SSL_get_cipher_name(m_ssl) : "";
+}
+
+}
+
+#endif
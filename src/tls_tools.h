@@ -0,0 +1,109 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <string>
+#include <stddef.h>
+
+// FTPS needs OpenSSL, define FTPSERVER_WITH_OPENSSL and link with libssl / libcrypto to enable it
+#ifdef FTPSERVER_WITH_OPENSSL
+#	include <openssl/ssl.h>
+#endif
+
+//
+
+namespace tls_tools
+{
+
+#ifdef FTPSERVER_WITH_OPENSSL
+
+// Server side TLS settings shared by all connections: certificate, key,
+// session cache (data connections resume the session of the control one).
+class tls_context_c
+{
+private:
+	tls_context_c(const tls_context_c&) = delete;
+	tls_context_c& operator=(const tls_context_c&) = delete;
+
+public:
+	tls_context_c();
+
+	~tls_context_c();
+
+	bool initialized() const { return m_ctx != nullptr; }
+
+	// PEM files, the certificate file may hold the whole chain
+	bool load_certificate(const std::string& cert_file, const std::string& key_file);
+
+	SSL_CTX* native_handle() const { return m_ctx; }
+
+	// text of the last OpenSSL error of the thread, for log messages
+	static std::string last_error();
+
+private:
+	SSL_CTX* m_ctx;
+};
+
+
+enum e_handshake_state
+{
+	e_handshake_done,
+	e_handshake_want_read,
+	e_handshake_want_write,
+	e_handshake_failed
+};
+
+
+// Server end of TLS connection over a socket (blocking or not).
+// With kernel offload (kTLS) records are made by the kernel after the
+// handshake, then plain send() / sendfile() on the socket is encrypted
+// too and the file data never goes through user space.
+class tls_session_c
+{
+private:
+	tls_session_c(const tls_session_c&) = delete;
+	tls_session_c& operator=(const tls_session_c&) = delete;
+
+public:
+	tls_session_c(const tls_context_c& context, int fd, bool kernel_offload);
+
+	// sends close_notify, socket must be still open
+	~tls_session_c();
+
+	// one step of the handshake, repeat when the socket is ready
+	e_handshake_state handshake();
+
+	// same as send() / recv(): would block is reported by errno
+	// (WSAGetLastError() on Windows), recv() returns 0 on close_notify
+	// and on end of connection
+	int send(const char* data, size_t data_size);
+	int recv(char* buf, size_t buf_sz);
+
+	// bytes of a record decrypted already, recv() returns them without
+	// the socket getting readable again
+	int pending() const;
+
+	// records of outgoing data are made by the kernel
+	bool kernel_send() const;
+
+	const char* protocol_name() const;
+	const char* cipher_name() const;
+
+private:
+	int check_io_result(int rc);
+
+private:
+	SSL* m_ssl;
+
+	bool m_established;
+};
+
+#endif
+
+}
@@ -0,0 +1,164 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "token_bucket.h"
+
+#include <chrono>
+
+//
+
+#define MICROSECONDS_PER_SECOND		1000000ULL
+
+namespace ftp_server
+{
+
+token_bucket_c::token_bucket_c()
+	: m_rate(0)
+	, m_burst(0)
+	, m_tokens(0)
+	, m_refill_time_us(now_us())
+{
+}
+
+
+void token_bucket_c::set_rate(uint64_t bytes_per_sec, uint64_t burst_bytes)
+{
+	if (burst_bytes == 0)
+		burst_bytes = bytes_per_sec;
+
+	bool was_unlimited = unlimited();
+
+	// tokens earned at the old rate are counted first
+	if (!was_unlimited)
+		refill(now_us());
+
+	m_burst.store(burst_bytes, std::memory_order_relaxed);
+	m_rate.store(bytes_per_sec, std::memory_order_relaxed);
+
+	if (was_unlimited)
+	{
+		// limit which is just enabled starts with a full bucket
+		m_refill_time_us.store(now_us());
+		m_tokens.store((int64_t)burst_bytes);
+
+		return;
+	}
+
+	// balance is kept (debt too), it never exceeds the new burst
+	int64_t limit = (int64_t)burst_bytes;
+	int64_t current = m_tokens.load();
+
+	while (current > limit && !m_tokens.compare_exchange_weak(current, limit))
+	{
+	}
+}
+
+
+bool token_bucket_c::available()
+{
+	if (unlimited())
+		return true;
+
+	refill(now_us());
+
+	return m_tokens.load() > 0;
+}
+
+
+void token_bucket_c::consume(size_t bytes)
+{
+	if (unlimited())
+		return;
+
+	m_tokens.fetch_sub((int64_t)bytes);
+}
+
+
+uint32_t token_bucket_c::wait_time_us()
+{
+	uint64_t rate = m_rate.load(std::memory_order_relaxed);
+	if (rate == 0)
+		return 0;
+
+	uint64_t now = now_us();
+
+	refill(now);
+
+	int64_t tokens = m_tokens.load();
+	if (tokens > 0)
+		return 0;
+
+	// time to earn the debt and one more token, minus the part already earned
+	uint64_t needed_us = ((uint64_t)(1 - tokens) * MICROSECONDS_PER_SECOND + rate - 1) / rate;
+
+	uint64_t refill_time = m_refill_time_us.load();
+	uint64_t earned_us = now > refill_time ? now - refill_time : 0;
+
+	uint64_t wait_us = needed_us > earned_us ? needed_us - earned_us : 0;
+
+	return wait_us > UINT32_MAX ? UINT32_MAX : (uint32_t)wait_us;
+}
+
+
+void token_bucket_c::refill(uint64_t now)
+{
+	uint64_t rate = m_rate.load(std::memory_order_relaxed);
+	if (rate == 0)
+		return;
+
+	uint64_t burst = m_burst.load(std::memory_order_relaxed);
+
+	uint64_t refill_time = m_refill_time_us.load();
+	if (now <= refill_time)
+		return;
+
+	uint64_t elapsed_us = now - refill_time;
+
+	uint64_t tokens = 0;
+	uint64_t new_refill_time = now;
+
+	if (elapsed_us / MICROSECONDS_PER_SECOND > burst / rate)
+	{
+		// long idle fills the bucket up (and keeps the math below from overflow)
+		tokens = burst;
+	}
+	else
+	{
+		tokens = elapsed_us * rate / MICROSECONDS_PER_SECOND;
+		if (tokens == 0)
+			return;
+
+		// fraction of a token is left for the next refill
+		new_refill_time = refill_time + tokens * MICROSECONDS_PER_SECOND / rate;
+	}
+
+	// only one of concurrent callers adds the tokens of this period
+	if (!m_refill_time_us.compare_exchange_strong(refill_time, new_refill_time))
+		return;
+
+	int64_t limit = (int64_t)burst;
+	int64_t current = m_tokens.load();
+
+	while (current < limit)
+	{
+		int64_t updated = current + (int64_t)tokens;
+		if (updated > limit)
+			updated = limit;
+
+		if (m_tokens.compare_exchange_weak(current, updated))
+			break;
+	}
+}
+
+
+uint64_t token_bucket_c::now_us()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
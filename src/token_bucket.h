@@ -0,0 +1,66 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+
+namespace ftp_server
+{
+
+// Bandwidth limiter, one token is one byte.
+// Bytes are charged after they went through the socket, so the balance
+// may go below zero; the next chunk waits until the debt is paid off.
+// Refill and charge are plain atomic operations, the bucket may be
+// shared by any number of sessions and threads without a lock.
+class token_bucket_c
+{
+private:
+	token_bucket_c(const token_bucket_c&) = delete;
+	token_bucket_c& operator=(const token_bucket_c&) = delete;
+
+public:
+	token_bucket_c();
+
+	// bytes_per_sec = 0 - unlimited, burst = 0 - one second of traffic;
+	// enabled limit starts with a full bucket, changed one keeps the balance
+	void set_rate(uint64_t bytes_per_sec, uint64_t burst_bytes = 0);
+
+	uint64_t rate() const { return m_rate.load(std::memory_order_relaxed); }
+	uint64_t burst() const { return m_burst.load(std::memory_order_relaxed); }
+
+	bool unlimited() const { return rate() == 0; }
+
+	// true if the next chunk may be sent
+	bool available();
+
+	void consume(size_t bytes);
+
+	// microseconds left until available() becomes true
+	uint32_t wait_time_us();
+
+private:
+	void refill(uint64_t now_us);
+
+	static uint64_t now_us();
+
+private:
+	std::atomic<uint64_t> m_rate;
+	std::atomic<uint64_t> m_burst;
+
+	std::atomic<int64_t> m_tokens;
+
+	// time the tokens were counted up to
+	std::atomic<uint64_t> m_refill_time_us;
+};
+
+}
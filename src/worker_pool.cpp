@@ -0,0 +1,97 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#include "worker_pool.h"
+
+#include <system_error>
+
+//
+
+namespace ftp_server
+{
+
+worker_pool_c::worker_pool_c(uint32_t threads_count)
+	: m_stopping(false)
+{
+	if (threads_count == 0)
+		threads_count = std::thread::hardware_concurrency();
+
+	// hardware_concurrency() may be unknown
+	if (threads_count == 0)
+		threads_count = 1;
+
+	try
+	{
+		for (uint32_t i = 0; i < threads_count; ++i)
+		{
+			m_threads.emplace_back(&worker_pool_c::worker_routine, this);
+		}
+	}
+	catch (const std::system_error&)
+	{
+		// pool works with the threads started so far
+	}
+}
+
+
+worker_pool_c::~worker_pool_c()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_stopping = true;
+	}
+
+	m_jobs_cv.notify_all();
+
+	for (auto& thread : m_threads)
+	{
+		thread.join();
+	}
+}
+
+
+bool worker_pool_c::post(std::function<void()> job)
+{
+	if (m_threads.empty())
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_jobs.push_back(std::move(job));
+	}
+
+	m_jobs_cv.notify_one();
+
+	return true;
+}
+
+
+void worker_pool_c::worker_routine()
+{
+	while (true)
+	{
+		std::function<void()> job;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			m_jobs_cv.wait(lock, [&]() { return m_stopping || !m_jobs.empty(); });
+
+			if (m_jobs.empty())
+				return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+
+		job();
+	}
+}
+
+}
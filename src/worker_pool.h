@@ -0,0 +1,60 @@
+/*
+ *	Author: Ilia Vasilchikov
+ *	mail: gravity@hotmail.ru
+ *	gihub page: https://github.com/Singular112/
+ *	Licence: MIT
+*/
+
+#pragma once
+
+// stl
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+//
+
+namespace ftp_server
+{
+
+// Fixed set of threads running queued jobs.
+// Work which is cut into many small pieces (MODE Z blocks) does not start
+// a thread per piece, and busy threads do not multiply with the number of
+// transfers: jobs of all of them wait in one queue, the oldest first.
+class worker_pool_c
+{
+private:
+	worker_pool_c(const worker_pool_c&) = delete;
+	worker_pool_c& operator=(const worker_pool_c&) = delete;
+
+public:
+	// threads_count = 0 - a thread per hardware thread
+	explicit worker_pool_c(uint32_t threads_count = 0);
+
+	// queued jobs still run, then the threads are joined
+	~worker_pool_c();
+
+	// false if the pool has no threads (none could be started)
+	bool post(std::function<void()> job);
+
+	uint32_t threads_count() const { return (uint32_t)m_threads.size(); }
+
+private:
+	void worker_routine();
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_jobs_cv;
+
+	std::deque<std::function<void()>> m_jobs;
+
+	bool m_stopping;
+
+	std::vector<std::thread> m_threads;
+};
+
+}